@@ -0,0 +1,111 @@
+#!/bin/sh
+# run the bundled roms and the compute kernels headless, one json object per run on stdout
+# usage: bench/bench.sh [simulator] [engines]
+#
+# the kernels are raw binaries loaded at address 0, rebuild one with e.g.
+#   riscv32-unknown-elf-gcc -march=rv32imac -nostdlib -Ttext=0 -o sieve.elf sieve.S
+#   riscv32-unknown-elf-objcopy -O binary sieve.elf sieve.rom
+# bits_zb.S and zb.S need -march=rv32imac_zba_zbb_zbs, fp.S -march=rv32imafdc, atomics.S runs on four harts
+
+SIM=${1:-./ffvm_sim}
+ENGINES=${2:-"switch dcache block jit"}
+DIR=$(dirname "$0")
+OUT=$(mktemp)
+TMP=$(mktemp -d)
+STATUS=0
+
+fail() {
+    echo "$*" >&2
+    STATUS=1
+}
+
+# json file, key: the value of the key in the last object of the file
+field() {
+    sed -n "s/.*\"$2\": \([^,}]*\).*/\1/p" "$1" 2> /dev/null | tail -n 1
+}
+
+# rom, instruction budget (0 - run to exit), expected exit code, extra simulator options
+run() {
+    for e in $ENGINES; do
+        "$SIM" -H -e "$e" -n "$2" $4 -i "$DIR/keys.txt" -j "$OUT" "$1" > /dev/null
+        code=$?
+        if [ -n "$3" ] && [ "$code" -ne "$3" ]; then
+            fail "$1 ($e): exit code $code, expected $3"
+        fi
+    done
+}
+
+# rom, instruction budget: records the device reads with -R and replays them with -P, the replay must print the same
+# output, exit the same way and retire as many instructions
+replay() {
+    for e in $ENGINES; do
+        rm -f "$TMP/rec.json" "$TMP/play.json"
+        "$SIM" -H -e "$e" -n "$2" -i "$DIR/keys.txt" -R "$TMP/log" -j "$TMP/rec.json" "$1" > "$TMP/rec.out"
+        want=$?
+        "$SIM" -H -e "$e" -n "$2" -P "$TMP/log" -j "$TMP/play.json" "$1" > "$TMP/play.out"
+        code=$?
+        [ "$code" -eq "$want" ] || fail "$1 ($e): replay exit code $code, recorded $want"
+        cmp -s "$TMP/rec.out" "$TMP/play.out" || fail "$1 ($e): replay output differs from the recording"
+        [ "$(field "$TMP/play.json" insts)" = "$(field "$TMP/rec.json" insts)" ] || fail "$1 ($e): replay instruction count differs from the recording"
+    done
+}
+
+# rom that exits: saves a snapshot with -s halfway and restores it with -r, then saves checkpoints with -k at a quarter
+# of the run and restores the third, both must exit like a run straight through after as many instructions, the
+# restores load an empty rom so all the state comes from the snapshots
+snapshot() {
+    for e in $ENGINES; do
+        rm -f "$TMP"/snap* "$TMP/run.json" "$TMP/restore.json" "$TMP/chain.json"
+        "$SIM" -H -e "$e" -j "$TMP/run.json" "$1" > /dev/null
+        want=$?
+        n=$(field "$TMP/run.json" insts)
+        "$SIM" -H -e "$e" -n $((n / 2)) -s "$TMP/snap" "$1" > /dev/null
+        "$SIM" -H -e "$e" -r "$TMP/snap" -j "$TMP/restore.json" /dev/null > /dev/null
+        code=$?
+        [ "$code" -eq "$want" ] || fail "$1 ($e): exit code $code after restoring the snapshot, expected $want"
+        [ "$(field "$TMP/restore.json" insts)" = "$n" ] || fail "$1 ($e): instruction count differs after restoring the snapshot"
+        "$SIM" -H -e "$e" -s "$TMP/snap" -k $((n / 4 + 1)) "$1" > /dev/null
+        "$SIM" -H -e "$e" -r "$TMP/snap.3" -j "$TMP/chain.json" /dev/null > /dev/null
+        code=$?
+        [ "$code" -eq "$want" ] || fail "$1 ($e): exit code $code after restoring the checkpoints, expected $want"
+        [ "$(field "$TMP/chain.json" insts)" = "$n" ] || fail "$1 ($e): instruction count differs after restoring the checkpoints"
+    done
+}
+
+# rom that exits: runs a -b job file of four jobs on two threads, one of them with an input file that does not exist,
+# that one must report an error and the others the exit code and instruction count of a run straight through
+batch() {
+    printf -- '-\n-\n%s\n-\n' "$TMP/missing.txt" > "$TMP/jobs"
+    for e in $ENGINES; do
+        rm -f "$TMP/run.json" "$TMP/batch.json"
+        "$SIM" -H -e "$e" -j "$TMP/run.json" "$1" > /dev/null
+        "$SIM" -H -e "$e" -b "$TMP/jobs" -t 2 -j "$TMP/batch.json" "$1" || fail "$1 ($e): batch exit code $?"
+        done=$(grep -c "\"insts\": $(field "$TMP/run.json" insts), .*\"exit_code\": $(field "$TMP/run.json" exit_code)," "$TMP/batch.json")
+        [ "$done" -eq 3 ] || fail "$1 ($e): $done of 3 batch jobs ran like a straight run"
+        grep -q '"job": 2, .*"error"' "$TMP/batch.json" || fail "$1 ($e): the batch job with a missing input reported no error"
+    done
+}
+
+run "$DIR/../ffvm/2048.rom"   50000000
+run "$DIR/../ffvm/snack.rom"  50000000
+run "$DIR/../ffvm/bricks.rom" 50000000
+run "$DIR/alu.rom"    0 0
+run "$DIR/sieve.rom"  0 105
+run "$DIR/matmul.rom" 0 0
+run "$DIR/fib.rom"    0 40
+run "$DIR/crc32.rom"  0 104
+run "$DIR/vmsieve.rom" 0 105
+run "$DIR/vm.rom"     0 0
+run "$DIR/bits.rom"   0 161
+run "$DIR/bits_zb.rom" 0 161
+run "$DIR/zb.rom"     0 0
+run "$DIR/atomics.rom" 0 160 "-c 4"
+run "$DIR/fp.rom"     0 0
+replay "$DIR/../ffvm/2048.rom" 20000000
+snapshot "$DIR/sieve.rom"
+batch    "$DIR/sieve.rom"
+
+cat "$OUT"
+rm -f "$OUT"
+rm -rf "$TMP"
+exit $STATUS
@@ -0,0 +1,367 @@
+// reader of the traces ffvm_sim -T writes, replays them into set associative caches and a branch predictor
+//   fftrace [-i sets:ways:line] [-d sets:ways:line] [-b bimodal|gshare] [-h bits] [-B btb] [-r ras] [-n records] trace
+// build with -DFFTRACE_NO_MAIN to use ftrace_open, ftrace_next and ftrace_close from another tool
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// the format, see the trace comment of riscv.c
+#define TRACE_MAGIC     "FFVMTRC1"
+#define TRACE_BUF_SIZE  (1 << 20)
+#define TRACE_FETCH     0
+#define TRACE_LOAD      1
+#define TRACE_STORE     2
+#define TRACE_CONTROL   3
+#define TRACE_CTL_NOT_TAKEN 0
+#define TRACE_CTL_TAKEN     1
+#define TRACE_CTL_JUMP      2
+#define TRACE_CTL_JUMP_IND  3
+#define TRACE_CTL_CALL      4
+#define TRACE_CTL_CALL_IND  5
+#define TRACE_CTL_RET       6
+#define MAX_HARTS       64
+
+typedef struct {
+    int      kind;   // TRACE_FETCH, LOAD, STORE or CONTROL
+    int      hart;
+    int      len;    // instruction length of a fetch, access size of a load or store
+    int      ctl;    // TRACE_CTL_* of a control record
+    uint32_t pc;     // fetched pc, for loads, stores and branches the pc of their instruction
+    uint32_t addr;   // load or store address, branch or jump target
+    uint32_t next;   // pc after the instruction when it falls through
+} FTRECORD;
+
+typedef struct {
+    uint32_t pc, next, addr;
+} FTHART;
+
+typedef struct {
+    FILE    *fp;
+    uint8_t *data, *packed;
+    uint32_t len, pos, hart;
+    uint64_t records;
+    FTHART   harts[MAX_HARTS];
+} FTRACE;
+
+static int ftrace_leb_file(FILE *fp, uint32_t *v)
+{
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if ((c = fgetc(fp)) == EOF || shift > 28) return -1;
+        *v |= (uint32_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+static int ftrace_leb(const uint8_t *p, uint32_t n, uint32_t *pos, uint64_t *v)
+{
+    int shift = 0;
+    *v = 0;
+    do {
+        if (*pos >= n || shift > 63) return -1;
+        *v |= (uint64_t)(p[*pos] & 0x7f) << shift;
+        shift += 7;
+    } while (p[(*pos)++] & 0x80);
+    return 0;
+}
+
+// undoes the lz77 of the writer thread, returns -1 unless the block comes out exactly n bytes
+static int ftrace_unpack(const uint8_t *in, uint32_t packed, uint8_t *out, uint32_t n)
+{
+    uint32_t pos = 0, o = 0, i;
+    uint64_t lit, len, dist;
+    for (;;) {
+        if (ftrace_leb(in, packed, &pos, &lit) < 0 || lit > packed - pos || lit > n - o) return -1;
+        memcpy(out + o, in + pos, lit);
+        pos += (uint32_t)lit;
+        o   += (uint32_t)lit;
+        if (pos == packed) return o == n ? 0 : -1;
+        if (ftrace_leb(in, packed, &pos, &len) < 0 || ftrace_leb(in, packed, &pos, &dist) < 0) return -1;
+        len += 4;
+        if (!dist || dist > o || len > n - o) return -1;
+        for (i = 0; i < len; i++, o++) out[o] = out[o - dist]; // may overlap
+    }
+}
+
+static int ftrace_block(FTRACE *t)
+{
+    uint32_t hart, len, packed;
+    if (ftrace_leb_file(t->fp, &hart) < 0) return 0;
+    if (ftrace_leb_file(t->fp, &len) < 0 || ftrace_leb_file(t->fp, &packed) < 0) return -1;
+    if (hart >= MAX_HARTS || len > TRACE_BUF_SIZE || packed > 2 * TRACE_BUF_SIZE) return -1;
+    if (!packed) {
+        if (fread(t->data, 1, len, t->fp) != len) return -1;
+    } else if (fread(t->packed, 1, packed, t->fp) != packed || ftrace_unpack(t->packed, packed, t->data, len) < 0) {
+        return -1;
+    }
+    t->hart = hart;
+    t->len  = len;
+    t->pos  = 0;
+    return 1;
+}
+
+FTRACE* ftrace_open(const char *file)
+{
+    FTRACE *t;
+    char    magic[sizeof(TRACE_MAGIC) - 1];
+    if (!(t = calloc(1, sizeof(FTRACE)))) return NULL;
+    t->data   = malloc(TRACE_BUF_SIZE);
+    t->packed = malloc(2 * TRACE_BUF_SIZE);
+    if (!t->data || !t->packed || !(t->fp = fopen(file, "rb"))) goto fail;
+    if (fread(magic, 1, sizeof(magic), t->fp) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic))) goto fail;
+    return t;
+fail:
+    if (t->fp) fclose(t->fp);
+    free(t->data);
+    free(t->packed);
+    free(t);
+    return NULL;
+}
+
+void ftrace_close(FTRACE *t)
+{
+    if (!t) return;
+    fclose(t->fp);
+    free(t->data);
+    free(t->packed);
+    free(t);
+}
+
+// reads the next record, returns 1, 0 at the end of the trace or -1 if it is damaged
+int ftrace_next(FTRACE *t, FTRECORD *r)
+{
+    FTHART  *h;
+    uint64_t v;
+    uint32_t d;
+    int      ret;
+
+    while (t->pos == t->len) {
+        if ((ret = ftrace_block(t)) <= 0) return ret;
+    }
+    if (ftrace_leb(t->data, t->len, &t->pos, &v) < 0) return -1;
+    h       = t->harts + t->hart;
+    r->hart = t->hart;
+    r->kind = v & 3;
+    r->ctl  = 0;
+    v     >>= 2;
+    switch (r->kind) {
+    case TRACE_FETCH:
+        d       = (uint32_t)(v >> 1);
+        r->len  = v & 1 ? 2 : 4;
+        h->pc   = h->next + ((d >> 1) ^ -(d & 1));
+        h->next = h->pc + r->len;
+        r->addr = h->pc;
+        break;
+    case TRACE_LOAD: case TRACE_STORE:
+        d       = (uint32_t)(v >> 2);
+        r->len  = 1 << (v & 3);
+        h->addr = h->addr + ((d >> 1) ^ -(d & 1));
+        r->addr = h->addr;
+        break;
+    default:
+        d       = (uint32_t)(v >> 3);
+        r->ctl  = v & 7;
+        r->len  = (int)(h->next - h->pc);
+        r->addr = h->pc + ((d >> 1) ^ -(d & 1));
+        break;
+    }
+    r->pc   = h->pc;
+    r->next = h->next;
+    t->records++;
+    return 1;
+}
+
+#ifndef FFTRACE_NO_MAIN
+// set associative cache with lru replacement, allocates on stores too
+typedef struct {
+    uint32_t  sets, ways, line;
+    uint32_t *tags;   // line address + 1, 0 if empty
+    uint64_t *used;   // lru stamp
+    uint64_t  clock, accesses, misses;
+} FTCACHE;
+
+// predicts conditional branches with bimodal or gshare counters, the targets of taken branches and jumps with a
+// direct mapped btb and returns with a return address stack
+typedef struct {
+    int       gshare;
+    uint32_t  bits, history;
+    uint8_t  *counters; // 2 bit saturating, 2 and up predict taken
+    uint32_t  btb_size;
+    uint32_t *btb_pc, *btb_target;
+    uint32_t  ras_size, ras_top;
+    uint32_t *ras;
+    uint64_t  branches, mispredicts, targets, target_misses, returns, return_misses;
+} FTPRED;
+
+typedef struct {
+    FTCACHE  icache, dcache;
+    FTPRED   pred;
+    uint64_t fetches, loads, stores;
+} FTMODEL;
+
+static int ftcache_init(FTCACHE *c, const char *spec)
+{
+    if (sscanf(spec, "%u:%u:%u", &c->sets, &c->ways, &c->line) != 3) return -1;
+    if (!c->sets || !c->ways || !c->line || (c->sets & (c->sets - 1)) || (c->line & (c->line - 1))) return -1;
+    c->tags = calloc((size_t)c->sets * c->ways, sizeof(uint32_t));
+    c->used = calloc((size_t)c->sets * c->ways, sizeof(uint64_t));
+    return c->tags && c->used ? 0 : -1;
+}
+
+static void ftcache_line(FTCACHE *c, uint32_t line)
+{
+    uint32_t  set  = line & (c->sets - 1), i, victim = 0;
+    uint32_t *tags = c->tags + (size_t)set * c->ways;
+    uint64_t *used = c->used + (size_t)set * c->ways;
+    c->accesses++;
+    c->clock++;
+    for (i = 0; i < c->ways; i++) {
+        if (tags[i] == line + 1) { used[i] = c->clock; return; }
+        if (used[i] < used[victim]) victim = i;
+    }
+    c->misses++;
+    tags[victim] = line + 1;
+    used[victim] = c->clock;
+}
+
+// an access crossing a line touches both
+static void ftcache_access(FTCACHE *c, uint32_t addr, int size)
+{
+    uint32_t first = addr / c->line, last = (addr + size - 1) / c->line;
+    ftcache_line(c, first);
+    if (last != first) ftcache_line(c, last);
+}
+
+static int ftpred_init(FTPRED *p)
+{
+    p->counters   = malloc((size_t)1 << p->bits);
+    p->btb_pc     = calloc(p->btb_size, sizeof(uint32_t));
+    p->btb_target = calloc(p->btb_size, sizeof(uint32_t));
+    p->ras        = calloc(p->ras_size ? p->ras_size : 1, sizeof(uint32_t));
+    if (!p->counters || !p->btb_pc || !p->btb_target || !p->ras) return -1;
+    memset(p->counters, 1, (size_t)1 << p->bits); // weakly not taken
+    return 0;
+}
+
+static void ftpred_target(FTPRED *p, uint32_t pc, uint32_t target)
+{
+    uint32_t i = (pc >> 1) & (p->btb_size - 1);
+    p->targets++;
+    if (p->btb_pc[i] != pc + 1 || p->btb_target[i] != target) p->target_misses++;
+    p->btb_pc[i]     = pc + 1;
+    p->btb_target[i] = target;
+}
+
+static void ftpred_control(FTPRED *p, const FTRECORD *r)
+{
+    uint32_t mask = (1u << p->bits) - 1, i;
+    uint8_t *c;
+    int      taken;
+
+    switch (r->ctl) {
+    case TRACE_CTL_NOT_TAKEN: case TRACE_CTL_TAKEN:
+        taken = r->ctl == TRACE_CTL_TAKEN;
+        i     = (r->pc >> 1) & mask;
+        if (p->gshare) i ^= p->history & mask;
+        c = p->counters + i;
+        p->branches++;
+        if ((*c >= 2) != taken) p->mispredicts++;
+        if (taken) { if (*c < 3) ++*c; } else if (*c > 0) --*c;
+        p->history = p->history << 1 | taken;
+        if (taken) ftpred_target(p, r->pc, r->addr);
+        break;
+    case TRACE_CTL_CALL: case TRACE_CTL_CALL_IND:
+        if (p->ras_size) { p->ras[p->ras_top % p->ras_size] = r->next; p->ras_top++; }
+        ftpred_target(p, r->pc, r->addr);
+        break;
+    case TRACE_CTL_RET:
+        p->returns++;
+        if (!p->ras_size || !p->ras_top || p->ras[--p->ras_top % p->ras_size] != r->addr) p->return_misses++;
+        break;
+    default:
+        ftpred_target(p, r->pc, r->addr);
+        break;
+    }
+}
+
+static double ftrate(uint64_t n, uint64_t of)
+{
+    return of ? 100.0 * n / of : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ispec = "64:4:32", *dspec = "64:4:32";
+    FTMODEL    *models[MAX_HARTS] = {0}, *m;
+    FTRACE     *t;
+    FTRECORD    r;
+    FTPRED      pred = { .gshare = 1, .bits = 12, .btb_size = 512, .ras_size = 16 };
+    uint64_t    limit = 0;
+    int         opt, i, ret = 0;
+
+    while ((opt = getopt(argc, argv, "i:d:b:h:B:r:n:")) != -1) {
+        switch (opt) {
+        case 'i': ispec = optarg; break;                      // instruction cache sets:ways:line
+        case 'd': dspec = optarg; break;                      // data cache sets:ways:line
+        case 'b':                                             // conditional branch predictor
+            if      (strcmp(optarg, "bimodal") == 0) pred.gshare = 0;
+            else if (strcmp(optarg, "gshare" ) == 0) pred.gshare = 1;
+            else { fprintf(stderr, "unknown predictor: %s\n", optarg); return 1; }
+            break;
+        case 'h': pred.bits     = atoi(optarg); break;        // log2 counters, gshare hashes as many history bits
+        case 'B': pred.btb_size = atoi(optarg); break;        // btb entries, a power of 2
+        case 'r': pred.ras_size = atoi(optarg); break;        // return address stack depth, 0 for none
+        case 'n': limit = strtoull(optarg, NULL, 0); break;   // stop after this many records
+        default:
+            fprintf(stderr, "usage: %s [-i sets:ways:line] [-d sets:ways:line] [-b bimodal|gshare] [-h bits] [-B btb] [-r ras] [-n records] trace\n", argv[0]);
+            return 1;
+        }
+    }
+    if (pred.bits < 1 || pred.bits > 28) { fprintf(stderr, "predictor bits must be 1 to 28\n"); return 1; }
+    if (!pred.btb_size || (pred.btb_size & (pred.btb_size - 1))) { fprintf(stderr, "btb entries must be a power of 2\n"); return 1; }
+    if (optind >= argc) { fprintf(stderr, "no trace\n"); return 1; }
+    if (!(t = ftrace_open(argv[optind]))) { fprintf(stderr, "failed to open the trace %s\n", argv[optind]); return 1; }
+
+    while ((!limit || t->records < limit) && (ret = ftrace_next(t, &r)) > 0) {
+        if (!(m = models[r.hart])) { // every hart has its own caches and predictor
+            if (!(m = models[r.hart] = calloc(1, sizeof(FTMODEL)))) { fprintf(stderr, "out of memory\n"); return 1; }
+            m->pred = pred;
+            if (ftcache_init(&m->icache, ispec) < 0 || ftcache_init(&m->dcache, dspec) < 0) {
+                fprintf(stderr, "caches are sets:ways:line with power of 2 sets and lines\n");
+                return 1;
+            }
+            if (ftpred_init(&m->pred) < 0) { fprintf(stderr, "out of memory\n"); return 1; }
+        }
+        switch (r.kind) {
+        case TRACE_FETCH: m->fetches++; ftcache_access(&m->icache, r.addr, r.len); break;
+        case TRACE_LOAD : m->loads++;   ftcache_access(&m->dcache, r.addr, r.len); break;
+        case TRACE_STORE: m->stores++;  ftcache_access(&m->dcache, r.addr, r.len); break;
+        default: ftpred_control(&m->pred, &r); break;
+        }
+    }
+    if (ret < 0) fprintf(stderr, "damaged trace %s after %llu records\n", argv[optind], (unsigned long long)t->records);
+
+    printf("records: %llu\n", (unsigned long long)t->records);
+    for (i = 0; i < MAX_HARTS; i++) {
+        if (!(m = models[i])) continue;
+        printf("hart %d: %llu instructions, %llu loads, %llu stores\n", i,
+            (unsigned long long)m->fetches, (unsigned long long)m->loads, (unsigned long long)m->stores);
+        printf("  icache %s: %llu accesses, %llu misses, %.3f%%\n", ispec, (unsigned long long)m->icache.accesses,
+            (unsigned long long)m->icache.misses, ftrate(m->icache.misses, m->icache.accesses));
+        printf("  dcache %s: %llu accesses, %llu misses, %.3f%%\n", dspec, (unsigned long long)m->dcache.accesses,
+            (unsigned long long)m->dcache.misses, ftrate(m->dcache.misses, m->dcache.accesses));
+        printf("  %s %u bits: %llu branches, %llu mispredicted, %.3f%%\n", m->pred.gshare ? "gshare" : "bimodal", m->pred.bits,
+            (unsigned long long)m->pred.branches, (unsigned long long)m->pred.mispredicts, ftrate(m->pred.mispredicts, m->pred.branches));
+        printf("  btb %u: %llu targets, %llu missed, %.3f%%\n", m->pred.btb_size, (unsigned long long)m->pred.targets,
+            (unsigned long long)m->pred.target_misses, ftrate(m->pred.target_misses, m->pred.targets));
+        printf("  ras %u: %llu returns, %llu missed, %.3f%%\n", m->pred.ras_size, (unsigned long long)m->pred.returns,
+            (unsigned long long)m->pred.return_misses, ftrate(m->pred.return_misses, m->pred.returns));
+    }
+    ftrace_close(t);
+    return ret < 0;
+}
+#endif
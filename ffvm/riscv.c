@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -5,9 +6,34 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+#include <fenv.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <elf.h>
 
-#include <termios.h>
+// the jit tier needs an x86-64 linux host, build with -DFFVM_NO_JIT to leave it out
+#if defined(__x86_64__) && defined(__linux__) && !defined(FFVM_NO_JIT)
+#define FFVM_JIT 1
+#else
+#define FFVM_JIT 0
+#endif
+
+// headless builds for hosts without sdl2, build with -DFFVM_NO_SDL
+#ifndef FFVM_NO_SDL
+#define FFVM_SDL 1
 #include <SDL2/SDL.h>
+#else
+#define FFVM_SDL 0
+#endif
+
+#include <termios.h>
 static struct termios old, current;
 
 /* Initialize new terminal i/o settings */
@@ -24,20 +50,26 @@ void initTermios(int echo)
   tcsetattr(0, TCSANOW, &current); /* use these new terminal i/o settings now */
 }
 
+#if FFVM_SDL
+static SDL_Window   *video_window;
+static SDL_Renderer *video_renderer;
+static SDL_Texture  *video_fbtex; // streaming copy of the guest framebuffer
+static int           video_redraw;
+
 void init_video() {
     //Create a basic SDL env
-    SDL_Event event;
-    SDL_Renderer *renderer;
-    SDL_Window *window;
-
     SDL_Init(SDL_INIT_VIDEO);
-    SDL_CreateWindowAndRenderer(640, 480, 0, &window, &renderer);
-    SDL_RenderSetScale(renderer, 8, 8);
-    SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
+    SDL_InitSubSystem(SDL_INIT_AUDIO); // without it the guest audio is dropped
+    SDL_CreateWindowAndRenderer(640, 480, 0, &video_window, &video_renderer);
+    SDL_RenderSetScale(video_renderer, 8, 8);
+    SDL_SetRenderDrawColor(video_renderer, 0, 255, 0, 255);
+    SDL_RenderClear(video_renderer);
+    SDL_RenderPresent(video_renderer);
 
 }
+#else
+void init_video() {}
+#endif
 
 /* Restore old terminal i/o settings */
 void resetTermios(void) 
@@ -45,53 +77,12 @@ void resetTermios(void)
   tcsetattr(0, TCSANOW, &old);
 }
 
-/* Read 1 character - echo defines echo mode */
-char getch_(int echo) 
+/* Restore the terminal before dying on a signal */
+static void termSignal(int sig)
 {
-  char ch;
-  initTermios(echo);
-  ch = getchar();
   resetTermios();
-  return ch;
-}
-
-/* Read 1 character without echo */
-char getch(void) 
-{
-  return getch_(0);
-}
-
-/* Read 1 character with echo */
-char getche(void) 
-{
-  return getch_(1);
-}
-
-int kbhit(void)
-{
-  struct termios oldt, newt;
-  int ch;
-  int oldf;
- 
-  tcgetattr(STDIN_FILENO, &oldt);
-  newt = oldt;
-  newt.c_lflag &= ~(ICANON | ECHO);
-  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-  oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-  fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
- 
-  ch = getchar();
- 
-  tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-  fcntl(STDIN_FILENO, F_SETFL, oldf);
- 
-  if(ch != EOF)
-  {
-    ungetc(ch, stdin);
-    return 1;
-  }
- 
-  return 0;
+  signal(sig, SIG_DFL);
+  raise(sig);
 }
 
 uint32_t  get_tick_count() {
@@ -103,287 +94,3225 @@ uint32_t  get_tick_count() {
     return theTick;
 }
 
-void SetConsoleCursorPosition(int XPos, int YPos) {
-    printf("\033[%d;%dH",YPos+1,XPos+1);
+void SetConsoleCursorPosition(FILE *fp, int XPos, int YPos) {
+    fprintf(fp, "\033[%d;%dH",YPos+1,XPos+1);
 }
 
+// predecoded instruction handler ids
+enum {
+    OP_SLOW = 0, // not predecoded, executed by riscv_execute_rv32/rv16
+    OP_LUI , OP_AUIPC, OP_JAL , OP_JALR,
+    OP_BEQ , OP_BNE  , OP_BLT , OP_BGE , OP_BLTU, OP_BGEU,
+    OP_LB  , OP_LH   , OP_LW  , OP_LBU , OP_LHU ,
+    OP_SB  , OP_SH   , OP_SW  ,
+    OP_ADDI, OP_SLTI , OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_ADD , OP_SUB  , OP_SLL , OP_SLT , OP_SLTU, OP_XOR , OP_SRL , OP_SRA , OP_OR, OP_AND,
+    OP_MUL , OP_MULH , OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    // zba, zbb and zbs with register operands
+    OP_SH1ADD, OP_SH2ADD, OP_SH3ADD, OP_ANDN, OP_ORN, OP_XNOR, OP_MIN, OP_MINU, OP_MAX, OP_MAXU, OP_ROL, OP_ROR,
+    OP_BCLR, OP_BSET, OP_BINV, OP_BEXT,
+    // zbb and zbs unary and with immediate operands
+    OP_CLZ, OP_CTZ, OP_CPOP, OP_SEXTB, OP_SEXTH, OP_ZEXTH, OP_ORCB, OP_REV8, OP_RORI, OP_BCLRI, OP_BSETI, OP_BINVI, OP_BEXTI,
+    // threaded-code only ops
+    OP_EXIT, // leave the block at a fall-through pc
+    OP_FUSE_LI,   // lui  rd, hi + addi rd, rd, lo
+    OP_FUSE_CALL, // auipc rd, hi + jalr rd2, lo(rd)
+    OP_FUSE_SLT_BEQZ, OP_FUSE_SLT_BNEZ, OP_FUSE_SLTU_BEQZ, OP_FUSE_SLTU_BNEZ, // slt[u]  rd, rs1, rs2 + b{eq,ne}z rd
+    OP_FUSE_SLTI_BEQZ, OP_FUSE_SLTI_BNEZ, OP_FUSE_SLTIU_BEQZ, OP_FUSE_SLTIU_BNEZ, // slti[u] rd, rs1, imm + b{eq,ne}z rd
+    OP_NUM,
+};
+
+typedef struct {
+    uint32_t pc;   // tag, DCACHE_INVALID if the entry is empty
+    uint32_t ppc;  // physical pc, the entry only hits while pc still translates to it
+    uint32_t inst; // raw instruction, used by OP_SLOW
+    int32_t  imm;  // sign-extended immediate
+    uint8_t  op, rd, rs1, rs2;
+    uint8_t  len;  // 2 or 4
+} RVDECODED;
+
+typedef struct {
+    const void *handler;     // computed-goto label of the op
+    uint32_t   *rd, *rs1, *rs2; // point into x[], rd of x0 points to a sink
+    int32_t     imm, imm2;   // imm2 is the second immediate of fused ops
+    uint32_t    pc;
+    uint8_t     len;         // bytes of guest code covered by the op
+    uint8_t     n;           // guest instructions retired once the op completes
+} RVTHREADED;
+
+#define BLOCK_MAX_INSTS 32
+#define BLOCK_MAX_SPAN  256 // bytes of guest code a block covers at most, compiled ones up to JIT_MAX_INSTS 4-byte instructions
+typedef struct RVBLOCK {
+    uint32_t   pc;
+    uint32_t   ppc;       // physical pc and translation state the block was translated under, it only runs under both
+    uint32_t   vm;
+    uint32_t   ninst;
+    uint32_t   hits;      // entries counted towards JIT_THRESHOLD
+    uint32_t   jit_ninst; // guest instructions in the compiled code
+    uint8_t   *jit;       // compiled host code, NULL if not compiled
+    uint8_t   *jit_skip;  // rel32 of the budget check in the prologue, zeroed the code always leaves to the dispatcher
+    uint32_t   len;       // bytes of guest code the ops and the compiled code cover from ppc
+    struct RVBLOCK *page_next; // next block starting in a page of the same bpage bucket
+    uint8_t    loop_len;  // instructions per iteration if the block starts with a counting loop, else 0
+    uint8_t    loop_reg;  // counter of the loop, stepped by loop_step every iteration
+    uint8_t    loop_cmp;  // register the branch back compares the counter with
+    uint8_t    loop_op;   // the branch back, loop_swap if the counter is its rs2
+    uint8_t    loop_swap;
+    int32_t    loop_step;
+    RVTHREADED ops[BLOCK_MAX_INSTS + 1];
+} RVBLOCK;
+
+typedef struct {
+    const char *name;
+    uint32_t    base;
+    uint32_t    size;
+    int32_t     ram;  // offset into mem for a ram window, -1 for a device
+    uint32_t  (*read )(void *opaque, uint32_t offset, int size);
+    void      (*write)(void *opaque, uint32_t offset, uint32_t data, int size);
+    void       *opaque;
+} RVREGION;
+
+// profiler: counters per guest pc in pages allocated on first use, a call tree for the folded stacks and per
+// register device access counts
+#define PROF_PAGE_SHIFT 16
+#define PROF_MAX_DEPTH  256  // deeper calls are counted in the deepest frame
+#define PROF_IO_SIZE    1024
+#define PROF_IO_REGS    0x1000 // regions up to this size are counted per register, larger ones as a whole
+#define PROF_HOT_BLOCKS 32
+#define PROF_OP_AMO    (OP_NUM + 0) // histogram buckets of the ops executed by riscv_execute_rv32/rv16
+#define PROF_OP_FENCE  (OP_NUM + 1)
+#define PROF_OP_SYSTEM (OP_NUM + 2)
+#define PROF_OP_FP     (OP_NUM + 3)
+#define PROF_OP_OTHER  (OP_NUM + 4)
+#define PROF_OP_NUM    (OP_NUM + 5)
+typedef struct {
+    uint64_t hits;    // instructions executed at this pc
+    uint64_t entries; // blocks started at this pc
+    uint64_t insts;   // instructions executed in the blocks started at this pc
+} RVPROFPC;
+
+typedef struct {
+    uint32_t func;   // entry pc
+    int32_t  parent;
+    uint64_t self;   // instructions executed in exactly this call path
+} RVPROFNODE;
+
+typedef struct {
+    uint32_t    addr;   // register address or base of a large region
+    int32_t     offset; // of the register in its region, -1 for a large region
+    const char *name;   // region name, NULL for a free slot
+    uint64_t    reads, writes;
+} RVPROFIO;
+
+typedef struct {
+    RVPROFPC   *pages[1 << (32 - PROF_PAGE_SHIFT)];
+    RVPROFPC   *block;  // counters of the running block, NULL after a control transfer
+    uint32_t    next;   // pc continuing the running block
+    uint64_t    ops[PROF_OP_NUM];
+    RVPROFNODE *nodes;
+    int32_t    *index;  // open addressing hash of (parent, func) to node, -1 for a free slot
+    uint32_t    nnodes, cap; // index has 2 * cap slots
+    int32_t     node;   // current call path
+    uint32_t    depth, overflow;
+    RVPROFIO    io[PROF_IO_SIZE];
+} RVPROF;
+
+// trace: an 8 byte magic, then blocks of the records of one hart as unsigned LEB128 hart, record bytes and packed
+// bytes, 0 if the block is stored as is, followed by the block. records are LEB128 values with the kind in the low 2
+// bits and addresses as deltas, so a loop repeats the same bytes and the lz77 packer of the writer thread takes them out
+//   fetch   (zigzag(pc - pc after the previous fetch) << 1 | compressed) << 2 | 0
+//   load    (zigzag(addr - previous load or store addr) << 2 | log2 size) << 2 | 1
+//   store   as a load, kind 2
+//   control (zigzag(target - pc of the last fetch) << 3 | TRACE_CTL_*) << 2 | 3, a branch not taken has the target
+//           it would have gone to
+#define TRACE_MAGIC     "FFVMTRC1"
+#define TRACE_BUF_SIZE  (1 << 20)
+#define TRACE_MAX_BUFS  16 // harts wait for the writer once this many buffers are queued
+#define TRACE_HASH_BITS 16
+#define TRACE_FETCH     0
+#define TRACE_LOAD      1
+#define TRACE_STORE     2
+#define TRACE_CONTROL   3
+#define TRACE_CTL_NOT_TAKEN 0
+#define TRACE_CTL_TAKEN     1
+#define TRACE_CTL_JUMP      2 // jal
+#define TRACE_CTL_JUMP_IND  3 // jalr
+#define TRACE_CTL_CALL      4 // jal linking through ra or t0
+#define TRACE_CTL_CALL_IND  5
+#define TRACE_CTL_RET       6 // jalr x0, 0(ra or t0)
+#define TRACE_ZIGZAG(d) (((uint32_t)(d) << 1) ^ (uint32_t)((int32_t)(d) >> 31))
+typedef struct RVTRACEBUF {
+    struct RVTRACEBUF *next;
+    uint32_t hart, len;
+    uint8_t  data[TRACE_BUF_SIZE];
+} RVTRACEBUF;
+
+// the writer thread packs and writes the buffers the harts queue
+typedef struct {
+    FILE           *fp;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;  // a buffer was queued or written
+    RVTRACEBUF     *queue, *tail, *free;
+    int             nbufs; // allocated
+    int             quit, failed;
+    uint8_t        *out;   // packed block
+    uint32_t       *hash;  // last position of each hashed 4 bytes
+} RVTRACEOUT;
+
+// the records of one hart
+typedef struct {
+    RVTRACEOUT *out;
+    RVTRACEBUF *buf;   // being filled, NULL if none could be allocated
+    uint32_t    hart;
+    uint32_t    pc;    // of the last fetch
+    uint32_t    next;  // pc after the last fetch
+    uint32_t    addr;  // of the last load or store
+} RVTRACE;
+
+// single producer single consumer byte ring, size is a power of 2
+typedef struct {
+    uint8_t         *buf;
+    uint32_t         size;
+    _Atomic uint32_t head; // advanced by the producer only
+    _Atomic uint32_t tail; // advanced by the consumer only
+} RVRING;
+
+#define KBD_RING_SIZE 256
+typedef struct {
+    RVRING   ring[2];    // 0 - stdin reader thread, 1 - sdl key events from the main thread
+    uint8_t  buf[2][KBD_RING_SIZE];
+    #define KBD_STATUS_READY   (1 << 0)
+    #define KBD_STATUS_DROPPED (1 << 1)
+    #define KBD_CTRL_IRQ_EN    (1 << 0)
+    uint32_t ctrl;
+    _Atomic int dropped; // a producer found its ring full
+    _Atomic int eof;     // no input source attached or stdin reached end of file
+    int      fd;
+    int      echo;       // fd is a terminal in raw mode, reads of stdio offset 0 echo like its line discipline did
+    int      thread_ok;
+    pthread_t       thread;
+    pthread_mutex_t lock; // only taken to sleep while the rings are empty
+    pthread_cond_t  cond;
+    int    (*pump)(void *opaque); // host event pump run while a blocking read waits, nonzero to give up
+    void    *pump_opaque;
+    pthread_t pump_thread;        // the pump only runs on this thread
+    pthread_mutex_t *iolock;      // held by the reader, dropped while it sleeps so other harts reach their devices
+} RVKBD;
+
+#define AUDIO_RING_SIZE 65536 // bytes, 370 ms of 44.1 kHz 16 bit stereo
+typedef struct {
+    RVRING   ring;      // the guest produces, the host audio callback or the guest clocked sink consumes
+    uint8_t  buf[AUDIO_RING_SIZE];
+    uint32_t rate;      // frames per second
+    uint32_t channels;
+    #define AUDIO_FMT_U8  0
+    #define AUDIO_FMT_S16 1
+    uint32_t format;
+    uint32_t threshold; // the fifo is low while it holds fewer bytes
+    #define AUDIO_CTRL_ENABLE (1 << 0)
+    #define AUDIO_CTRL_IRQ_EN (1 << 1)
+    uint32_t ctrl;
+    #define AUDIO_STATUS_LOW      (1 << 0)
+    #define AUDIO_STATUS_OVERRUN  (1 << 1)
+    #define AUDIO_STATUS_UNDERRUN (1 << 2)
+    int      overrun;            // the guest wrote to a full fifo
+    _Atomic int      underrun;   // the sink found the fifo empty and played silence
+    _Atomic uint64_t played;     // bytes the sink took since playback started, silence included
+    int      host;               // a host device takes the samples in real time, else the sink is clocked by the guest
+    _Atomic int      playing;    // the host device is open and its callback runs
+    uint32_t host_rate;          // bytes per second of the open host device
+    int      reconfig;           // playback started, stopped or changed format, the host device must be reopened
+    uint64_t start;              // cycles of the guest clock when the guest clocked sink started
+    FILE    *wav;                // the guest clocked sink writes a wav file, NULL to drop the samples
+    uint32_t wav_bytes;
+    uint32_t wav_spec[3];        // rate, channels and format of the first playback, the file header is written with them
+} RVAUDIO;
+
+typedef struct {
+    uint32_t src, dst, len;
+    uint32_t fill;     // byte a fill stores
+    #define DMA_OP_FILL  (1 << 0) // memset of dst with the fill byte, else memmove from src to dst
+    #define DMA_OP_ASYNC (1 << 1) // a ram to ram transfer runs on the helper thread, the others always run at once
+    #define DMA_OP_IRQ   (1 << 2) // raise the completion interrupt
+    uint32_t op;       // of the last transfer
+    #define DMA_STATUS_BUSY  (1 << 0)
+    #define DMA_STATUS_DONE  (1 << 1)
+    #define DMA_STATUS_ERROR (1 << 2)
+    _Atomic uint32_t status;
+    uint8_t *job_dst;  // host side of the transfer the helper runs
+    uint8_t *job_src;  // NULL for a fill
+    uint32_t job_len;
+    uint8_t  job_fill;
+    int      quit;
+    int      thread_ok;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond; // a job for the helper or the end of one
+    RVKBD   *kbd;         // woken at the end of a job, a hart may wait for it in wfi
+} RVDMA;
+
+// header of a pcm wav file
+typedef struct {
+    char     riff[4];
+    uint32_t riff_size;
+    char     wave[8];
+    uint32_t fmt_size;
+    uint16_t tag, channels;
+    uint32_t rate, byte_rate;
+    uint16_t align, bits;
+    char     data[4];
+    uint32_t data_size;
+} RVWAVHDR;
+
+#define FB_MAX_WIDTH  1024
+#define FB_MAX_HEIGHT 768
+#define FB_MEM_SIZE  (FB_MAX_WIDTH * FB_MAX_HEIGHT * 4)
+#define FB_TILE_SHIFT 4 // dirty tracking granularity, 16x16 pixels
+#define FB_TILES_X   (FB_MAX_WIDTH  >> FB_TILE_SHIFT)
+#define FB_TILES_Y   (FB_MAX_HEIGHT >> FB_TILE_SHIFT)
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    #define FB_FMT_OFF      0
+    #define FB_FMT_PAL8     1
+    #define FB_FMT_RGB565   2
+    #define FB_FMT_ARGB8888 3
+    uint32_t format;
+    uint32_t pitch;
+    #define FB_CTRL_VSYNC (1 << 0) // only show frames the guest marked complete through the present register
+    uint32_t ctrl;
+    uint32_t frames;   // frames uploaded by the host
+    int      ready;    // guest wrote the present register since the last upload
+    int      reconfig; // geometry or format changed, the host texture must be recreated
+    int      ndirty;
+    uint32_t palette[256]; // ARGB8888
+    uint8_t  dirty[FB_TILES_Y * FB_TILES_X];
+    uint8_t  mem[FB_MEM_SIZE];
+} RVFB;
+
+#define CON_MAX_COLS 160
+#define CON_MAX_ROWS 64
+#define CON_VRAM_SIZE (CON_MAX_ROWS * CON_MAX_COLS * 2)
+typedef struct {
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t x, y;  // cursor
+    uint32_t attr;  // attribute of characters written through the console register
+    #define CON_ATTR_DEFAULT 0x07 // bit[2:0] fg, bit3 bright fg, bit[6:4] bg, bit7 bright bg, ansi color order
+    #define CON_MODE_STREAM  0    // console writes go straight to stdout
+    #define CON_MODE_VRAM    1    // console writes land in the vram, the host shows it once per frame
+    uint32_t mode;
+    int      esc, npar, par[4];   // escape sequence parser
+    uint16_t vram  [CON_MAX_ROWS * CON_MAX_COLS]; // char | attr << 8, cols cells per row
+    uint16_t shadow[CON_MAX_ROWS * CON_MAX_COLS]; // what the terminal currently shows
+    int      shadow_ok;
+    uint32_t shown_x, shown_y, shown_attr;
+} RVCON;
+
+typedef struct RVMACHINE RVMACHINE;
+
+// csrs with a meaning to the emulator, the rest of the csr space is plain storage
+#define CSR_FFLAGS    0x001
+#define CSR_FRM       0x002
+#define CSR_FCSR      0x003
+#define CSR_SSTATUS   0x100
+#define CSR_SIE       0x104
+#define CSR_STVEC     0x105
+#define CSR_SEPC      0x141
+#define CSR_SCAUSE    0x142
+#define CSR_STVAL     0x143
+#define CSR_SIP       0x144
+#define CSR_SATP      0x180
+#define CSR_MSTATUS   0x300
+#define CSR_MISA      0x301
+#define CSR_MEDELEG   0x302
+#define CSR_MIDELEG   0x303
+#define CSR_MIE       0x304
+#define CSR_MTVEC     0x305
+#define CSR_MEPC      0x341
+#define CSR_MCAUSE    0x342
+#define CSR_MTVAL     0x343
+#define CSR_MIP       0x344
+#define CSR_MCYCLE    0xB00
+#define CSR_MINSTRET  0xB02
+#define CSR_MCYCLEH   0xB80
+#define CSR_MINSTRETH 0xB82
+#define CSR_CYCLE     0xC00
+#define CSR_TIME      0xC01
+#define CSR_INSTRET   0xC02
+#define CSR_CYCLEH    0xC80
+#define CSR_TIMEH     0xC81
+#define CSR_INSTRETH  0xC82
+#define CSR_MHARTID   0xF14
+#define MSTATUS_SIE   (1 << 1)
+#define MSTATUS_MIE   (1 << 3)
+#define MSTATUS_SPIE  (1 << 5)
+#define MSTATUS_MPIE  (1 << 7)
+#define MSTATUS_SPP   (1 << 8)
+#define MSTATUS_MPP   (3 << 11)
+#define MSTATUS_FS    (3 << 13) // off, initial, clean or dirty, the f and d instructions are illegal while off
+#define MSTATUS_FS_INITIAL (1 << 13)
+#define MSTATUS_MPRV  (1 << 17) // loads and stores of machine mode use the privilege in mpp
+#define MSTATUS_SUM   (1 << 18) // supervisor mode may load and store user pages
+#define MSTATUS_MXR   (1 << 19) // executable pages are readable
+#define MSTATUS_TVM   (1 << 20) // satp and sfence.vma are illegal in supervisor mode
+#define MSTATUS_TSR   (1 << 22) // sret is illegal in supervisor mode
+#define MSTATUS_SD    (1u << 31)
+#define SSTATUS_MASK  (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_FS | MSTATUS_SUM | MSTATUS_MXR | MSTATUS_SD)
+#define MIP_SSIP      (1 << 1)  // the supervisor interrupts are set by machine mode software
+#define MIP_MSIP      (1 << 3)  // clint msip of the hart
+#define MIP_STIP      (1 << 5)
+#define MIP_MTIP      (1 << 7)  // the time of the hart reached its mtimecmp
+#define MIP_SEIP      (1 << 9)
+#define MIP_MEIP      (1 << 11) // keyboard irq line
+#define MIP_SMASK     (MIP_SSIP | MIP_STIP | MIP_SEIP)
+#define CAUSE_FETCH_ACCESS 1
+#define CAUSE_ILLEGAL      2
+#define CAUSE_BREAKPOINT   3
+#define CAUSE_LOAD_ACCESS  5
+#define CAUSE_STORE_ACCESS 7
+#define CAUSE_ECALL_U      8
+#define CAUSE_ECALL_S      9
+#define CAUSE_FETCH_PAGE   12
+#define CAUSE_LOAD_PAGE    13
+#define CAUSE_STORE_PAGE   15
+#define PTE_V         (1 << 0)
+#define PTE_R         (1 << 1)
+#define PTE_W         (1 << 2)
+#define PTE_X         (1 << 3)
+#define PTE_U         (1 << 4)
+#define PTE_A         (1 << 6)
+#define PTE_D         (1 << 7)
+#define FFLAGS_NX     (1 << 0)
+#define FFLAGS_UF     (1 << 1)
+#define FFLAGS_OF     (1 << 2)
+#define FFLAGS_DZ     (1 << 3)
+#define FFLAGS_NV     (1 << 4)
+
+// software tlb entry of a virtual page, a tag is the page if the access it stands for is allowed and TLB_INVALID
+// otherwise, only pages of ram are entered so a hit goes straight to host memory
+#define TLB_SIZE    256 // entries per set, direct mapped by the virtual page number
+#define TLB_INVALID 0xffffffff
+typedef struct {
+    uint32_t tag_r, tag_w, tag_x; // tag_w is only set once the page is dirty
+    uint32_t ppage;               // physical page
+    uint8_t *host;                // the ram of the page
+} RVTLB;
+
+// one hart, the state every engine works on, ram and devices are shared through the machine
 typedef struct {
     uint32_t pc;
     uint32_t x[32];
-    uint64_t f[32];
+    uint64_t f[32];      // single precision values are nan-boxed in the upper half
     uint32_t csr[0x1000];
-    uint32_t mreserved;
-    #define MAX_MEM_SIZE (64 * 1024 * 1024)
-    uint8_t  mem[MAX_MEM_SIZE];
-    uint32_t heap;
-    #define TS_EXIT (1 << 0)
+    RVMACHINE *mach;
+    uint32_t hartid;
+    uint32_t resv_addr;  // lr.w reservation, sc.w stores only if the word still holds resv_val
+    uint32_t resv_val;
+    int      resv_valid;
+    #define PRIV_U 0
+    #define PRIV_S 1
+    #define PRIV_M 3
+    uint32_t priv;       // privilege mode
+    #define VM_FETCH (1 << 0) // instruction fetches go through sv32
+    #define VM_DATA  (1 << 1) // loads and stores go through sv32, at the privilege mstatus.mprv gives them
+    uint32_t vm;         // follows satp, priv and mstatus, riscv_vm_update recomputes it
+    uint32_t ram_data;   // mem_size while loads and stores address ram directly, 0 while they translate or are traced
+    RVTLB   *itlb, *dtlb; // tlb sets of the fetches and of the loads and stores
+    RVTLB    tlb[2][2][TLB_SIZE]; // fetch and data sets of the user and supervisor mode translations
+    uint64_t tlb_misses; // page walks
+    uint32_t trap_cause; // exception the instruction in progress raised, riscv_run_n takes it
+    uint32_t trap_tval;
+    #define MIN_MEM_SIZE (1    * 1024 * 1024)
+    #define DEF_MEM_SIZE (64   * 1024 * 1024)
+    #define MAX_MEM_SIZE (1024 * 1024 * 1024) // keeps the ram and its mirror at 0x80000000 below the io space
+    uint8_t *mem;        // the machine ram, cached here for the engines
+    uint32_t mem_size;
+    #define CODEMAP_SHIFT   4        // one codemap byte flags 16 bytes of ram
+    #define CODEMAP_CODE   (1 << 0) // holds decoded code
+    #define CODEMAP_CLEAN  (1 << 1) // page not written since the last checkpoint, set while dirty pages are tracked
+    uint8_t *codemap;    // the machine codemap, stores into flagged granules take the slow path
+    uint32_t codegen;    // machine codegen the decoded caches of this hart are current with
+    #define TS_EXIT    (1 << 0)
+    #define TS_WAIT    (1 << 1) // guest is waiting on an io register, e.g. polled an empty keyboard
+    #define TS_CODEMOD (1 << 2) // guest stored into decoded code, cached blocks were dropped
+    #define TS_IRQ     (1 << 3) // interrupt enables or lines changed, riscv_run_n looks at the pending interrupts again
+    #define TS_TRAP    (1 << 4) // the instruction raised an exception, the engine leaves pc on it and does not retire it
+    #define TS_BREAK   (TS_EXIT | TS_WAIT | TS_CODEMOD | TS_IRQ | TS_TRAP)
     uint32_t status;
+    uint64_t icount;
+    uint64_t idle;       // cycles spent waiting in wfi, the cycle count and the time of the hart are icount + idle
+    uint64_t mtimecmp;   // clint timer compare of the hart
+    _Atomic uint32_t msip; // clint software interrupt of the hart, raised by any hart
+    int      wfi;        // waiting for an interrupt, riscv_wfi_wait lets the time pass
+    #define POLL_MAX_INSTS 64 // longest idle poll loop recognized
+    uint32_t poll_pc;    // pc and registers after the last poll of an idle device, an idle poll loop comes back to both
+    uint32_t poll_x[32];
+    uint64_t poll_icount;
+    uint32_t poll_insts; // instructions per iteration of the idle poll loop riscv_run_n found, riscv_poll_wait skips them
+    uint64_t skipped;    // instructions of idle poll loops and counting loops credited to icount without running them
+    #define ENGINE_SWITCH 0 // fetch and decode every instruction
+    #define ENGINE_DCACHE 1 // single step through the predecoded instruction cache
+    #define ENGINE_BLOCK  2 // threaded code over translated basic blocks
+    #define ENGINE_JIT    3 // block engine with hot blocks compiled to host code
+    int      engine;
+    uint32_t xsink;
+    #define DCACHE_SIZE    (1 << 14)
+    #define DCACHE_INVALID  1
+    RVDECODED dcache[DCACHE_SIZE];
+    #define BCACHE_SIZE (1 << 12)
+    #define BPOOL_SIZE  (1 << 12)
+    #define BPAGE_SIZE  (1 << 10)
+    RVBLOCK **bcache;
+    RVBLOCK **bpage;  // blocks by the ram page their ppc is in, hashed, a store into code drops only the blocks it overlaps
+    RVBLOCK  *bpool;
+    int       bpool_used;
+    #define JIT_CACHE_SIZE (16 * 1024 * 1024)
+    #define JIT_THRESHOLD   64
+    uint8_t  *jit_code;   // executable code cache, entry/exit stubs first
+    uint32_t  jit_stubs;
+    uint32_t  jit_exit;
+    uint32_t  jit_used;
+    int64_t   jit_budget; // instructions the compiled code may still retire
+    int64_t   jit_start;  // jit_budget when the compiled code was entered
+    uint32_t  io_retired; // instructions of the running block retired before the device read in progress
+    RVPROF   *prof;       // NULL unless profiling
+    RVTRACE  *trace;      // NULL unless tracing
+    uint8_t  *jit_patch;  // rel32 of the chainable jmp the compiled code left through
 } RISCV;
 
+// device read log: an 8 byte magic, then entries of the instructions retired since the previous read, the zigzag coded
+// value and how many reads in a row repeat both, all as unsigned LEB128, so polling loops take a few bytes
+#define IOLOG_MAGIC "FFVMIOL1"
+typedef struct {
+    FILE    *fp;
+    int      replay; // 0 records the device reads, 1 feeds the recorded values back instead of reading the devices
+    int      failed; // the replay ran off the end of the log or the guest read at another instruction than recorded
+    uint64_t last;   // instruction count of the previous read
+    uint64_t reads;
+    uint64_t delta;  // entry being collected or replayed
+    uint32_t value;
+    uint64_t count;  // reads left in the entry
+} RVIOLOG;
+
+// function and label symbols of an elf image
+typedef struct {
+    uint32_t    addr;
+    uint32_t    size; // 0 if unknown
+    const char *name;
+} RVSYM;
+
+typedef struct {
+    RVSYM *syms;  // sorted by addr
+    int    nsyms;
+    char  *names; // string table the names point into
+} RVSYMTAB;
+
+#define MAX_HARTS 64
+struct RVMACHINE {
+    uint8_t *mem;     // mem_size bytes of ram, committed by the host on first touch
+    uint32_t mem_size; // power of 2 from MIN_MEM_SIZE to MAX_MEM_SIZE
+    uint8_t *codemap; // code decoded by any hart
+    #define SNAP_PAGE_SHIFT 12
+    uint8_t *dirty;   // one byte per ram page written since the last checkpoint, NULL while not tracking
+    _Atomic uint32_t codegen; // bumped when a store hits decoded code, the other harts then drop their caches
+    #define CODERING_SIZE 64
+    struct {
+        _Atomic uint32_t gen; // codegen + 1 of the store once offset and size are valid
+        _Atomic uint32_t offset, size;
+    } codering[CODERING_SIZE]; // the latest stores into decoded code, harts that kept up invalidate just these
+    #define BUS_PAGE_SHIFT  16
+    #define BUS_MAX_REGIONS 32
+    RVREGION regions[BUS_MAX_REGIONS]; // sorted by base
+    int      nregions;
+    uint8_t  busmap[1 << (32 - BUS_PAGE_SHIFT)]; // 1 + index of the lowest region overlapping each page, 0 if none
+    uint32_t entry;    // pc the harts start at
+    uint32_t heap;     // program break, the end of the loaded image until the guest moves it with brk
+    RVSYMTAB syms;     // of an elf rom, empty for a raw binary
+    #define SYS_MAX_FILES 32
+    int      files[SYS_MAX_FILES]; // 1 + host fd of the file the guest opened as fd 3 + index, 0 if free
+    int      files_root;           // host directory guest paths resolve under, AT_FDCWD for the current directory
+    RVKBD    kbd;
+    RVFB     fb;
+    RVCON    con;
+    RVAUDIO  audio;
+    RVDMA    dma;
+    FILE    *out;           // stream mode console output, stdout unless captured
+    RVIOLOG *iolog;         // device reads are recorded or replayed, single hart only, NULL if not
+    RVTRACEOUT *trace;      // NULL unless tracing
+    pthread_mutex_t iolock; // device callbacks of all harts are serialized
+    _Atomic int exited;     // some hart made the exit ecall or the host window was closed
+    uint32_t exit_code;     // a0 of the exit ecall
+    int      headless;      // no host display and no real time, guest sleeps return at once
+    RISCV   *harts[MAX_HARTS];
+    int      nharts;
+};
+
+// hart whose access a device callback is serving, devices flag TS_WAIT on it
+static _Thread_local RISCV *riscv_io_hart;
+
 typedef struct _COORD {
   int16_t X;
   int16_t Y;
 } COORD, *PCOORD;
 
-static uint8_t riscv_memr8(RISCV *riscv, uint32_t addr)
+static void riscv_block_flush(RISCV *riscv)
 {
-    return *(riscv->mem + (addr & (MAX_MEM_SIZE - 1)));
+    if (riscv->bcache) memset(riscv->bcache, 0, BCACHE_SIZE * sizeof(RVBLOCK*));
+    if (riscv->bpage ) memset(riscv->bpage , 0, BPAGE_SIZE  * sizeof(RVBLOCK*));
+    riscv->bpool_used = 0;
+    riscv->jit_used   = riscv->jit_stubs;
+    riscv->jit_patch  = NULL;
 }
 
-static void riscv_memw8(RISCV *riscv, uint32_t addr, uint8_t data)
+static void riscv_dcache_flush(RISCV *riscv)
 {
-    *(riscv->mem + (addr & (MAX_MEM_SIZE - 1))) = data;
+    int i;
+    for (i = 0; i < DCACHE_SIZE; i++) riscv->dcache[i].pc = DCACHE_INVALID;
+    riscv_block_flush(riscv);
 }
 
-static uint16_t riscv_memr16(RISCV *riscv, uint32_t addr)
+// drops the blocks overlapping [offset, offset + size) of ram, the pool slots are reclaimed by the next flush
+static void riscv_block_invalidate(RISCV *riscv, uint32_t offset, int size)
 {
-    if ((addr & 0x1) == 0) {
-        return *(uint16_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1)));
-    } else {
-        return (riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] << 0)
-             | (riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] << 8);
+    // such a block starts in a page from BLOCK_MAX_SPAN bytes before offset up to the last byte stored
+    uint32_t mask = riscv->mem_size - 1, page = ((offset - BLOCK_MAX_SPAN) & mask) >> 12, last = (offset + size - 1) >> 12, start;
+    RVBLOCK **link, *b;
+    int       dropped = 0;
+    if (!riscv->bpool_used) return;
+    for (;;) {
+        for (link = riscv->bpage + (page & (BPAGE_SIZE - 1)); (b = *link); ) {
+            start = b->ppc & mask;
+            if (start >= offset + size || offset >= start + b->len) {
+                link = &b->page_next;
+                continue;
+            }
+            *link = b->page_next;
+            if (riscv->bcache[(b->pc >> 1) & (BCACHE_SIZE - 1)] == b) riscv->bcache[(b->pc >> 1) & (BCACHE_SIZE - 1)] = NULL;
+            // compiled code stays reachable through the jumps chained into it, make its prologue leave right away
+            if (b->jit) memset(b->jit_skip, 0, 4);
+            b->jit  = NULL;
+            dropped = 1;
+        }
+        if (page == last) break;
+        page = (page + 1) & (mask >> 12);
     }
+    if (dropped) riscv->status |= TS_CODEMOD;
 }
 
-static void riscv_memw16(RISCV *riscv, uint32_t addr, uint16_t data)
+static void riscv_dcache_invalidate(RISCV *riscv, uint32_t offset, int size)
 {
-    if ((addr & 0x1) == 0) {
-        *(uint16_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1))) = data;
-    } else {
-        riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 0);
-        riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 8);
+    // an instruction overlapping [offset, offset + size) of ram starts at most 2 bytes before it
+    uint32_t a = (offset & ~1) - 2, end = offset + size;
+    RVDECODED *d;
+    for (; (int32_t)(end - a) > 0; a += 2) {
+        d = riscv->dcache + ((a >> 1) & (DCACHE_SIZE - 1));
+        if (((d->ppc ^ a) & (riscv->mem_size - 1)) == 0) d->pc = DCACHE_INVALID;
     }
+    riscv_block_invalidate(riscv, offset, size);
+}
+
+// records the first store into a page since the last checkpoint
+static void riscv_page_dirty(RISCV *riscv, uint32_t offset)
+{
+    uint32_t page = offset >> SNAP_PAGE_SHIFT, i;
+    uint8_t *m    = riscv->codemap + (page << (SNAP_PAGE_SHIFT - CODEMAP_SHIFT));
+    riscv->mach->dirty[page] = 1;
+    for (i = 0; i < 1 << (SNAP_PAGE_SHIFT - CODEMAP_SHIFT); i++) __atomic_fetch_and(m + i, ~CODEMAP_CLEAN, __ATOMIC_RELAXED);
 }
 
-static uint32_t riscv_memr32(RISCV *riscv, uint32_t addr)
+// called with a ram offset whenever ram is written
+static inline void riscv_code_written(RISCV *riscv, uint32_t offset, int size)
 {
-    switch (addr) {
-    case 0xF0000000: return fgetc(stdin);
-    case 0xF0000008: return getch();
-    case 0xF000000C: return kbhit();
+    RVMACHINE *mach = riscv->mach;
+    uint32_t   gen, slot;
+    uint8_t    m = riscv->codemap[offset >> CODEMAP_SHIFT] | riscv->codemap[(offset + size - 1) >> CODEMAP_SHIFT];
+    if (!m) return;
+    if (m & CODEMAP_CLEAN) { // first store into the page since the last checkpoint
+        riscv_page_dirty(riscv, offset);
+        if ((offset ^ (offset + size - 1)) >> SNAP_PAGE_SHIFT) riscv_page_dirty(riscv, offset + size - 1);
+    }
+    if (m & CODEMAP_CODE) {
+        riscv_dcache_invalidate(riscv, offset, size);
+        if (mach->nharts > 1) { // the other harts invalidate the range when they see the new generation
+            gen  = atomic_fetch_add(&mach->codegen, 1);
+            slot = gen & (CODERING_SIZE - 1);
+            atomic_store_explicit(&mach->codering[slot].gen, 0, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            atomic_store_explicit(&mach->codering[slot].offset, offset, memory_order_relaxed);
+            atomic_store_explicit(&mach->codering[slot].size  , size  , memory_order_relaxed);
+            atomic_store_explicit(&mach->codering[slot].gen, gen + 1, memory_order_release);
+            if (gen == riscv->codegen) riscv->codegen = gen + 1;
+        }
     }
-    if (addr >= 0xF0000000) return 0;
+}
 
-    if ((addr & 0x3) == 0) {
-        return *(uint32_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1)));
-    } else {
-        return (riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] << 0)
-             | (riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] << 8)
-             | (riscv->mem[(addr + 2) & (MAX_MEM_SIZE - 1)] <<16)
-             | (riscv->mem[(addr + 3) & (MAX_MEM_SIZE - 1)] <<24);
+// invalidates what other harts stored into decoded code since the caches were filled, drops the caches entirely
+// if the ring overran those stores or a slot is still being written
+static void riscv_code_sync(RISCV *riscv)
+{
+    RVMACHINE *mach = riscv->mach;
+    uint32_t   gen  = atomic_load_explicit(&mach->codegen, memory_order_acquire), g, slot, offset, size;
+    if (gen == riscv->codegen) return;
+    if (gen - riscv->codegen > CODERING_SIZE) riscv_dcache_flush(riscv);
+    else for (g = riscv->codegen; g != gen; g++) {
+        slot   = g & (CODERING_SIZE - 1);
+        if (atomic_load_explicit(&mach->codering[slot].gen, memory_order_acquire) != g + 1) { riscv_dcache_flush(riscv); break; }
+        offset = atomic_load_explicit(&mach->codering[slot].offset, memory_order_relaxed);
+        size   = atomic_load_explicit(&mach->codering[slot].size  , memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&mach->codering[slot].gen, memory_order_relaxed) != g + 1) { riscv_dcache_flush(riscv); break; }
+        riscv_dcache_invalidate(riscv, offset, (int)size);
     }
+    riscv->codegen = gen;
 }
 
-static void riscv_memw32(RISCV *riscv, uint32_t addr, uint32_t data)
+// maps a ram window or a device into the guest address space, regions must not overlap
+int riscv_bus_map(RVMACHINE *mach, const RVREGION *region)
 {
-    switch (addr) {
-        COORD coord;
-    case 0xF0000000: if (data == (uint32_t)-1) fflush(stdout); else fputc(data, stdout); return;
-    case 0xF0000004: if (data == (uint32_t)-1) fflush(stderr); else fputc(data, stderr); return;
-    case 0xF0000100: usleep(data * 1000); return;
-    case 0xF0000104: system("cls");       return;
-    case 0xF0000108:
-        coord.X = (data >> 0 ) & 0xFFFF;
-        coord.Y = (data >> 16) & 0xFFFF;
-        SetConsoleCursorPosition(coord.X,coord.Y);
-        break;
+    RVREGION *r = mach->regions;
+    uint32_t  page;
+    int       i, j;
+
+    if (mach->nregions == BUS_MAX_REGIONS || region->size == 0 || region->base + (region->size - 1) < region->base) return -1;
+    for (i = 0; i < mach->nregions && r[i].base < region->base; i++);
+    if (i > 0 && r[i - 1].base + (r[i - 1].size - 1) >= region->base) return -1;
+    if (i < mach->nregions && region->base + (region->size - 1) >= r[i].base) return -1;
+    memmove(r + i + 1, r + i, (mach->nregions - i) * sizeof(RVREGION));
+    r[i] = *region;
+    mach->nregions++;
+
+    // each page remembers the lowest region overlapping it, regions are sorted by base
+    memset(mach->busmap, 0, sizeof(mach->busmap));
+    for (j = mach->nregions - 1; j >= 0; j--) {
+        for (page = r[j].base >> BUS_PAGE_SHIFT; ; page++) {
+            mach->busmap[page] = j + 1;
+            if (page == (r[j].base + (r[j].size - 1)) >> BUS_PAGE_SHIFT) break;
+        }
     }
-    if (addr >= 0xF0000000) return;
+    return 0;
+}
 
-    if ((addr & 0x3) == 0) {
-        *(uint32_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1))) = data;
-    } else {
-        riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 0);
-        riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 8);
-        riscv->mem[(addr + 2) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >>16);
-        riscv->mem[(addr + 3) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >>24);
+static RVREGION* riscv_bus_find(RVMACHINE *mach, uint32_t addr)
+{
+    int i = mach->busmap[addr >> BUS_PAGE_SHIFT];
+    if (!i) return NULL;
+    for (i--; i < mach->nregions && mach->regions[i].base <= addr; i++) {
+        if (addr - mach->regions[i].base < mach->regions[i].size) return mach->regions + i;
     }
+    return NULL;
 }
 
-static int32_t signed_extend(uint32_t a, int size)
+// returns 1 and the ram offset if addr is backed by ram
+static int riscv_bus_ram(RISCV *riscv, uint32_t addr, uint32_t *offset)
 {
-    return (a & (1 << (size - 1))) ? (a | ~((1 << size) - 1)) : a;
+    RVREGION *r;
+    if (addr < riscv->mem_size) { *offset = addr; return 1; }
+    r = riscv_bus_find(riscv->mach, addr);
+    if (!r || r->ram < 0) return 0;
+    *offset = r->ram + (addr - r->base);
+    return 1;
 }
 
-static uint32_t handle_ecall(RISCV *riscv)
+static void riscv_iolog_put(FILE *fp, uint64_t v)
 {
-    switch (riscv->x[17]) {
-    case 93: riscv->status |= TS_EXIT; return 0; //sys_exit
-    default: return 0;
-    }
+    while (v >= 0x80) { fputc((int)(v & 0x7F) | 0x80, fp); v >>= 7; }
+    fputc((int)v, fp);
 }
 
-static void riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
+static int riscv_iolog_get(FILE *fp, uint64_t *v)
 {
-    const uint16_t inst_opcode = (instruction >> 0) & 0x3;
-    const uint16_t inst_rd     = (instruction >> 7) & 0x1f;
-    const uint16_t inst_rs1    = (instruction >> 7) & 0x1f;
-    const uint16_t inst_rs2    = (instruction >> 2) & 0x1f;
-    const uint16_t inst_rs1s   = (instruction >> 7) & 0x7;
-    const uint16_t inst_rs2s   = (instruction >> 2) & 0x7;
-    const uint16_t inst_rds    = (instruction >> 2) & 0x7;
-    const uint16_t inst_imm6   =((instruction >> 2) & 0x1f) | ((instruction >> 7) & (1 << 5));
-    const uint16_t inst_imm7   =((instruction >> 4) & (1 << 2)) | ((instruction >> 7) & (0x7 << 3)) | ((instruction << 1) & (1 << 6));
-    const uint16_t inst_imm8   =((instruction >> 7) & (0x7 << 3)) | ((instruction << 1) & (0x3 << 6));
-    const uint16_t inst_imm9   =((instruction >> 2) & (0x3 << 3)) | ((instruction >> 7) & (1 << 5)) | ((instruction << 4) & (0x7 << 6));
-    const uint16_t inst_imm10  =((instruction >> 4) & (1 << 2)) | ((instruction >> 2) & (1 << 3)) | ((instruction >> 7) & (0x3 << 4)) | ((instruction >> 1) & (0x7 << 6));
-    const uint16_t inst_imm12  =((instruction >> 2) & (0x7 << 1)) | ((instruction >> 7) & (1 << 4)) | ((instruction << 3) & (1 << 5))
-                               |((instruction >> 1) & (0x2d << 6)) | ((instruction << 1) & (1 << 7)) | ((instruction << 2) & (1 << 10));
-    const uint16_t inst_imm18  =((instruction << 5) & (1 << 17)) | ((instruction << 10) & (0x1f << 12));
-    const uint16_t inst_funct2 = (instruction >>10) & 0x3;
-    const uint16_t inst_funct3 = (instruction >>13) & 0x7;
-    uint32_t bflag = 0, temp;
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if ((c = getc(fp)) == EOF || shift > 63) return -1;
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
 
-    switch (inst_opcode) {
-    case 0:
-        switch (inst_funct3) {
-        case 0: riscv->x[8 + inst_rds] = riscv->x[2] + inst_imm10; break; // c.addi4spn
-        case 1: // c.fld
-            riscv->f[8 + inst_rds] = (uint64_t)riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 0) << 0 ;
-            riscv->f[8 + inst_rds]|= (uint64_t)riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 4) << 32;
-            break;
-        case 2: riscv->x[8 + inst_rds] = riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7); break; // c.lw
-        case 3: riscv->f[8 + inst_rds] = riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7); break; // c.flw
-        case 5: // c.fsd
-            riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 0, (uint32_t)(riscv->f[8 + inst_rs2s] >> 0 ));
-            riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 4, (uint32_t)(riscv->f[8 + inst_rs2s] >> 32));
-            break;
-        case 6: riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7, riscv->x[8 + inst_rs2s]); break; // c.sw
-        case 7: riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7, (uint32_t)riscv->f[8 + inst_rs2s]); break; // c.fsw
-        }
-        break;
-    case 1:
-        switch (inst_funct3) {
-        case 0: riscv->x[inst_rd] += signed_extend(inst_imm6, 6); break; // c.addi
-        case 1: // c.jal
-            riscv->x[1] = riscv->pc + 2;
-            riscv->pc  += signed_extend(inst_imm12, 12);
-            bflag = 1;
-            break;
-        case 2: riscv->x[inst_rd] = signed_extend(inst_imm6, 6); break; // c.li
-        case 3:
-            if (inst_rd == 2) { // c.addi16sp
-                temp = ((instruction >> 2) & (1 << 4)) | ((instruction << 3) & (1 << 5)) | ((instruction << 1) & (1 << 6))
-                     | ((instruction << 4) & (0x3 << 7)) | ((instruction >> 3) & (1 << 9));
-                riscv->x[inst_rd] += signed_extend(temp, 10);
-            } else { // c.lui
-                riscv->x[inst_rd]  = signed_extend(inst_imm18, 18);
-            }
-            break;
-        case 4:
-            switch (inst_funct2) {
-            case 0: riscv->x[8 + inst_rs1s] = (uint32_t)riscv->x[8 + inst_rs1s] >> inst_imm6; break; // c.srli
-            case 1: riscv->x[8 + inst_rs1s] = (int32_t )riscv->x[8 + inst_rs1s] >> inst_imm6; break; // c.srai
-            case 2: riscv->x[8 + inst_rs1s]&= signed_extend(inst_imm6, 6); break; // c.andi
-            case 3:
-                switch ((instruction >> 5) & 3) {
-                case 0: riscv->x[8 + inst_rs1s] -= riscv->x[8 + inst_rs2s]; break; // c.sub
-                case 1: riscv->x[8 + inst_rs1s] ^= riscv->x[8 + inst_rs2s]; break; // c.xor
-                case 2: riscv->x[8 + inst_rs1s] |= riscv->x[8 + inst_rs2s]; break; // c.or
-                case 3: riscv->x[8 + inst_rs1s] &= riscv->x[8 + inst_rs2s]; break; // c.and
-                }
-                break;
-            }
-            break;
-        case 5: riscv->pc += signed_extend(inst_imm12, 12); bflag = 1; break; // c.j
-        case 6: // c.beqz
-        case 7: // c.bnez
-            if (inst_funct3 == 6 && riscv->x[8 + inst_rs1s] == 0 || inst_funct3 == 7 && riscv->x[8 + inst_rs1s] != 0) {
-                temp = ((instruction >> 2) & (0x3 << 1)) | ((instruction >> 7) & (0x3 << 3)) | ((instruction << 3) & (1 << 5))
-                     | ((instruction << 1) & (0x3 << 6)) | ((instruction >> 4) & (1 << 8));
-                riscv->pc += signed_extend(temp, 9);
-                bflag = 1;
-            }
-            break;
+static void riscv_iolog_flush(RVIOLOG *log)
+{
+    if (!log->count) return;
+    riscv_iolog_put(log->fp, log->delta);
+    riscv_iolog_put(log->fp, (log->value << 1) ^ (uint32_t)((int32_t)log->value >> 31));
+    riscv_iolog_put(log->fp, log->count);
+    log->count = 0;
+}
+
+// stops the replay at a read the log has no value for
+static uint32_t riscv_iolog_fail(RISCV *riscv)
+{
+    riscv->mach->iolog->failed = 1;
+    riscv->status |= TS_EXIT;
+    atomic_store(&riscv->mach->exited, 1);
+    return 0;
+}
+
+// called for every device read with the value the device returned, returns the value the guest gets
+static uint32_t riscv_iolog_read(RISCV *riscv, uint32_t data)
+{
+    RVIOLOG *log    = riscv->mach->iolog;
+    uint64_t icount = riscv->icount + riscv->io_retired, value;
+
+    if (!log->replay) {
+        if (!log->count || log->delta != icount - log->last || log->value != data) {
+            riscv_iolog_flush(log);
+            log->delta = icount - log->last;
+            log->value = data;
         }
-        break;
-    case 2:
-        switch (inst_funct3) {
-        case 0: riscv->x[inst_rd] <<= inst_imm6; break; // c.slli
-        case 1: // c.fldsp
-            riscv->f[inst_rd]  = (uint64_t)riscv_memr32(riscv, riscv->x[2] + inst_imm9 + 0) << 0 ;
-            riscv->f[inst_rd] |= (uint64_t)riscv_memr32(riscv, riscv->x[2] + inst_imm9 + 4) << 32;
-            break;
-        case 2: // c.lwsp
-        case 3: // c.flwsp
-            temp = ((instruction >> 2) & (0x7 << 2)) | ((instruction >> 7) & (1 << 5)) | ((instruction << 4) & (0x3 << 6));
-            if (inst_funct3 == 2) riscv->x[inst_rd] = riscv_memr32(riscv, riscv->x[2] + temp); // c.lwsp
-            else                  riscv->f[inst_rd] = riscv_memr32(riscv, riscv->x[2] + temp); // c.flwsp
-            break;
-        case 4:
-            if ((instruction & (1 << 12)) == 0) {
-                if (inst_rs2 == 0) { // c.jr
-                    riscv->pc = riscv->x[inst_rs1]; bflag = 1;
-                } else { // c.mv
-                    riscv->x[inst_rd] = riscv->x[inst_rs2];
-                }
-            } else {
-                if (inst_rs1 == 0 && inst_rs2 == 0) { // c.ebreak;
-                } else if (inst_rs2 == 0) { // c.jalr
-                    temp        = riscv->pc + 2;
-                    riscv->pc   = riscv->x[inst_rs1];
-                    riscv->x[1] = temp;
-                    bflag       = 1;
-                } else { // c.add
-                    riscv->x[inst_rd] += riscv->x[inst_rs2];
-                }
-            }
-            break;
-        case 5: // c.fsdsp
-            temp = ((instruction >> 7) & (0x7 << 3)) | ((instruction >> 1) & (0x7 << 6));
-            riscv_memw32(riscv, riscv->x[2] + temp + 0, (uint32_t)(riscv->f[inst_rs2] >> 0 ));
-            riscv_memw32(riscv, riscv->x[2] + temp + 4, (uint32_t)(riscv->f[inst_rs2] >> 32));
-            break;
-        case 6: // c.swsp
-        case 7: // c.fswsp
-            temp = ((instruction >> 7) & (0xf << 2)) | ((instruction >> 1) & (0x3 << 6));
-            riscv_memw32(riscv, riscv->x[2] + temp, inst_funct3 == 6 ? riscv->x[inst_rs2] : (uint32_t)riscv->f[inst_rs2]);
-            break;
+        log->count++;
+        log->last = icount;
+        log->reads++;
+        return data;
+    }
+    if (!log->count) {
+        if (riscv_iolog_get(log->fp, &log->delta) < 0 || riscv_iolog_get(log->fp, &value) < 0
+         || riscv_iolog_get(log->fp, &log->count) < 0 || !log->count) {
+            if (!log->failed) fprintf(stderr, "replay: log ends at read %llu, instruction %llu\n", (unsigned long long)log->reads, (unsigned long long)icount);
+            log->count = 0;
+            return riscv_iolog_fail(riscv);
         }
-        break;
+        log->value = (uint32_t)(value >> 1) ^ -(uint32_t)(value & 1);
     }
-    riscv->pc += bflag ? 0 : 2;
+    if (log->last + log->delta != icount) {
+        if (!log->failed) fprintf(stderr, "replay: read %llu diverged, recorded at instruction %llu, now at %llu\n",
+            (unsigned long long)log->reads, (unsigned long long)(log->last + log->delta), (unsigned long long)icount);
+        return riscv_iolog_fail(riscv);
+    }
+    log->count--;
+    log->last = icount;
+    log->reads++;
+    return log->value;
 }
 
-static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
+// starts recording the device reads to file or replaying them from it, instruction counts in the log are absolute
+// so a replay starts from the same rom or snapshot as the recording
+int riscv_iolog_open(RVMACHINE *mach, const char *file, int replay)
 {
-    const uint32_t inst_opcode = (instruction >> 0) & 0x7f;
-    const uint32_t inst_rd     = (instruction >> 7) & 0x1f;
-    const uint32_t inst_funct3 = (instruction >>12) & 0x07;
-    const uint32_t inst_rs1    = (instruction >>15) & 0x1f;
-    const uint32_t inst_rs2    = (instruction >>20) & 0x1f;
-    const uint32_t inst_funct7 = (instruction >>25) & 0x7f;
-    const uint32_t inst_imm12i = (instruction >>20) & 0xfff;
-    const uint32_t inst_imm12s =((instruction >>20) & (0x7f << 5)) | ((instruction >> 7) & 0x1f);
-    const uint32_t inst_imm13b =((instruction >>19) & (0x1  <<12)) | ((instruction << 4) & (0x1 << 11))
-                               |((instruction >>20) & (0x3f << 5)) | ((instruction >> 7) & (0xf <<  1));
-    const uint32_t inst_imm20u = instruction & (0xfffff << 12);
-    const uint32_t inst_imm21j =((instruction >> 11) & (1 << 20)) | (instruction & (0xff << 12))
-                               |((instruction >> 9 ) & (1 << 11)) | ((instruction >> 20) & (0x3ff << 1));
-    const uint32_t inst_csr    = (instruction >> 20);
-    uint32_t bflag = 0, maddr, temp;
-    int64_t  mult64res;
+    char magic[sizeof(IOLOG_MAGIC) - 1];
+    if (mach->iolog || mach->nharts != 1 || !(mach->iolog = calloc(1, sizeof(RVIOLOG)))) return -1;
+    mach->iolog->replay = replay;
+    if ((mach->iolog->fp = fopen(file, replay ? "rb" : "wb"))) {
+        if (replay ? fread(magic, 1, sizeof(magic), mach->iolog->fp) == sizeof(magic) && memcmp(magic, IOLOG_MAGIC, sizeof(magic)) == 0
+                   : fwrite(IOLOG_MAGIC, 1, sizeof(magic), mach->iolog->fp) == sizeof(magic)) return 0;
+        fclose(mach->iolog->fp);
+    }
+    free(mach->iolog);
+    mach->iolog = NULL;
+    return -1;
+}
 
-    switch (inst_opcode) {
-    case 0x37: riscv->x[inst_rd] = inst_imm20u; break; // u-type lui
-    case 0x17: riscv->x[inst_rd] = riscv->pc + (int32_t)inst_imm20u; break; // u-type auipc
-    case 0x6f: // j-type jal
-        riscv->x[inst_rd] = riscv->pc + 4;
-        riscv->pc += signed_extend(inst_imm21j, 21);
-        bflag = 1;
-        break;
-    case 0x67: // i-type
-        switch (inst_funct3) {
-        case 0x0: // jalr
-            temp = riscv->pc + 4;
-            riscv->pc = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12);
-            riscv->pc&=~(1 << 0);
-            riscv->x[inst_rd] = temp;
-            bflag = 1;
-            break;
-        }
-        break;
-    case 0x63: // b-type
+// returns -1 if the replay failed or the log could not be written
+int riscv_iolog_close(RVMACHINE *mach)
+{
+    RVIOLOG *log = mach->iolog;
+    int      ret;
+    if (!log) return 0;
+    if (!log->replay) riscv_iolog_flush(log);
+    ret = log->failed || ferror(log->fp) ? -1 : 0;
+    if (fclose(log->fp) != 0) ret = -1;
+    free(log);
+    mach->iolog = NULL;
+    return ret;
+}
+
+// slot of a register or large region in the device access counters, NULL if the table is full
+static RVPROFIO* riscv_prof_io_slot(RVPROFIO *io, uint32_t addr, int32_t offset, const char *name)
+{
+    uint32_t h, n;
+    for (h = ((addr >> 2) * 0x9E3779B1u >> 16) & (PROF_IO_SIZE - 1), n = 0; n < PROF_IO_SIZE; h = (h + 1) & (PROF_IO_SIZE - 1), n++) {
+        if (!io[h].name) { io[h].addr = addr; io[h].offset = offset; io[h].name = name; }
+        if (io[h].addr == addr) return io + h;
+    }
+    return NULL;
+}
+
+// counts a device access of the hart being profiled
+static void riscv_prof_io(RISCV *riscv, const RVREGION *r, uint32_t addr, int write)
+{
+    RVPROFIO *io = r->size <= PROF_IO_REGS ? riscv_prof_io_slot(riscv->prof->io, addr & ~3, (addr & ~3) - r->base, r->name)
+                                           : riscv_prof_io_slot(riscv->prof->io, r->base, -1, r->name);
+    if (!io) return;
+    if (write) io->writes++;
+    else       io->reads++;
+}
+
+// slow path of every access missing ram at address 0, unmapped reads return 0 and unmapped writes are dropped
+static uint32_t riscv_bus_read(RISCV *riscv, uint32_t addr, int size)
+{
+    RVREGION *r = riscv_bus_find(riscv->mach, addr);
+    uint32_t  offset, data = 0;
+    int       i;
+
+    if (!r) return 0;
+    offset = addr - r->base;
+    if ((uint32_t)size > r->size - offset) { // the access straddles the end of the region
+        for (i = 0; i < size; i++) data |= riscv_bus_read(riscv, addr + i, 1) << (8 * i);
+        return data;
+    }
+    if (r->ram >= 0) {
+        memcpy(&data, riscv->mem + r->ram + offset, size);
+        return data;
+    }
+    if (!r->read) return 0;
+    if (riscv->prof) riscv_prof_io(riscv, r, addr, 0);
+    if (riscv->mach->iolog && riscv->mach->iolog->replay) return riscv_iolog_read(riscv, 0);
+    pthread_mutex_lock(&riscv->mach->iolock);
+    riscv_io_hart = riscv;
+    data = r->read(r->opaque, offset, size);
+    if (riscv->mach->iolog) data = riscv_iolog_read(riscv, data);
+    pthread_mutex_unlock(&riscv->mach->iolock);
+    return data;
+}
+
+static void riscv_bus_write(RISCV *riscv, uint32_t addr, uint32_t data, int size)
+{
+    RVREGION *r = riscv_bus_find(riscv->mach, addr);
+    uint32_t  offset;
+    int       i;
+
+    if (!r) return;
+    offset = addr - r->base;
+    if ((uint32_t)size > r->size - offset) {
+        for (i = 0; i < size; i++) riscv_bus_write(riscv, addr + i, (data >> (8 * i)) & 0xff, 1);
+        return;
+    }
+    if (r->ram >= 0) {
+        riscv_code_written(riscv, r->ram + offset, size);
+        memcpy(riscv->mem + r->ram + offset, &data, size);
+        return;
+    }
+    if (!r->write) return;
+    if (riscv->prof) riscv_prof_io(riscv, r, addr, 1);
+    pthread_mutex_lock(&riscv->mach->iolock);
+    riscv_io_hart = riscv;
+    r->write(r->opaque, offset, data, size);
+    pthread_mutex_unlock(&riscv->mach->iolock);
+}
+
+// records the exception the instruction in progress raised, the first one counts
+static void riscv_raise(RISCV *riscv, uint32_t cause, uint32_t tval)
+{
+    if (riscv->status & TS_TRAP) return;
+    riscv->status    |= TS_TRAP | TS_IRQ;
+    riscv->trap_cause = cause;
+    riscv->trap_tval  = tval;
+}
+
+// a load writes its register only if it did not fault, the trap sees the registers as they were
+static void riscv_setx(RISCV *riscv, uint32_t *rd, uint32_t data)
+{
+    if (!(riscv->status & TS_TRAP)) *rd = data;
+}
+
+// any write to f or fcsr marks the fp state dirty
+static void riscv_fp_dirty(RISCV *riscv)
+{
+    riscv->csr[CSR_MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+}
+
+static void riscv_setf(RISCV *riscv, uint32_t rd, uint64_t data)
+{
+    if (riscv->status & TS_TRAP) return;
+    riscv->f[rd] = data;
+    riscv_fp_dirty(riscv);
+}
+
+static uint32_t riscv_phys_read(RISCV *riscv, uint32_t addr, int size)
+{
+    uint32_t data = 0;
+    if (addr <= riscv->mem_size - size) {
+        memcpy(&data, riscv->mem + addr, size);
+        return data;
+    }
+    return riscv_bus_read(riscv, addr, size);
+}
+
+static void riscv_phys_write(RISCV *riscv, uint32_t addr, uint32_t data, int size)
+{
+    if (addr <= riscv->mem_size - size) {
+        riscv_code_written(riscv, addr, size);
+        memcpy(riscv->mem + addr, &data, size);
+        return;
+    }
+    riscv_bus_write(riscv, addr, data, size);
+}
+
+static void riscv_tlb_flush(RISCV *riscv)
+{
+    memset(riscv->tlb, 0xff, sizeof(riscv->tlb));
+}
+
+// the entries a page may sit in are dropped in all sets
+static void riscv_tlb_flush_page(RISCV *riscv, uint32_t vaddr)
+{
+    int i, j;
+    for (i = 0; i < 2; i++) for (j = 0; j < 2; j++) memset(&riscv->tlb[i][j][(vaddr >> 12) & (TLB_SIZE - 1)], 0xff, sizeof(RVTLB));
+}
+
+// which accesses translate and through which tlb set, follows satp, the privilege mode and mstatus.mprv
+static void riscv_vm_update(RISCV *riscv)
+{
+    uint32_t status = riscv->csr[CSR_MSTATUS];
+    uint32_t dpriv  = riscv->priv == PRIV_M && (status & MSTATUS_MPRV) ? (status & MSTATUS_MPP) >> 11 : riscv->priv;
+    uint32_t paged  = riscv->csr[CSR_SATP] >> 31;
+    riscv->vm       = (paged && riscv->priv < PRIV_M ? VM_FETCH : 0) | (paged && dpriv < PRIV_M ? VM_DATA : 0);
+    riscv->ram_data = (riscv->vm & VM_DATA) || riscv->trace ? 0 : riscv->mem_size;
+    riscv->itlb     = riscv->tlb[0][riscv->priv != PRIV_U];
+    riscv->dtlb     = riscv->tlb[1][dpriv != PRIV_U];
+}
+
+// sv32 walk of an access that missed the tlb, acc is 0 for a fetch, 1 for a load and 2 for a store, sets the accessed
+// and dirty bits of the leaf, enters the page in the tlb if it is ram and returns 0 with the physical address, or
+// raises the page or access fault and returns -1
+#define ACC_FETCH 0
+#define ACC_LOAD  1
+#define ACC_STORE 2
+static int riscv_vm_walk(RISCV *riscv, uint32_t vaddr, int acc, uint32_t *paddr)
+{
+    static const uint32_t faults[3][2] = {
+        { CAUSE_FETCH_PAGE, CAUSE_FETCH_ACCESS }, { CAUSE_LOAD_PAGE, CAUSE_LOAD_ACCESS }, { CAUSE_STORE_PAGE, CAUSE_STORE_ACCESS },
+    };
+    uint32_t status = riscv->csr[CSR_MSTATUS];
+    uint32_t priv   = acc != ACC_FETCH && riscv->priv == PRIV_M && (status & MSTATUS_MPRV) ? (status & MSTATUS_MPP) >> 11 : riscv->priv;
+    uint64_t a      = (uint64_t)(riscv->csr[CSR_SATP] & 0x3fffff) << 12, pa;
+    uint32_t level, off, pte, set, r, w, x, user;
+    RVTLB   *e;
+
+    riscv->tlb_misses++;
+    for (level = 1; ; level--) {
+        a += ((vaddr >> (12 + 10 * level)) & 0x3ff) * 4;
+        if (a >> 32 || !riscv_bus_ram(riscv, (uint32_t)a, &off) || off > riscv->mem_size - 4) {
+            riscv_raise(riscv, faults[acc][1], vaddr);
+            return -1;
+        }
+        pte = __atomic_load_n((uint32_t*)(riscv->mem + off), __ATOMIC_RELAXED);
+        if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W)) || (level == 0 && !(pte & (PTE_R | PTE_X)))) { pte = 0; break; }
+        if (pte & (PTE_R | PTE_X)) break; // leaf
+        a = (uint64_t)(pte >> 10) << 12;
+    }
+    if ((pte & PTE_U) ? priv == PRIV_U : priv != PRIV_U) user = 3;                      // r/w and x by the privilege
+    else user = (pte & PTE_U) && priv == PRIV_S && (status & MSTATUS_SUM) ? 1 : 0;      // supervisor loads and stores
+    r = (user & 1) && ((pte & PTE_R) || ((status & MSTATUS_MXR) && (pte & PTE_X)));
+    w = (user & 1) && (pte & PTE_W);
+    x = (user & 2) && (pte & PTE_X);
+    if (!(pte & PTE_V) || !(pte & (PTE_R | PTE_X)) || (level && ((pte >> 10) & 0x3ff)) || !(acc == ACC_FETCH ? x : acc == ACC_LOAD ? r : w)) {
+        riscv_raise(riscv, faults[acc][0], vaddr);
+        return -1;
+    }
+    set = PTE_A | (acc == ACC_STORE ? PTE_D : 0);
+    if ((pte & set) != set) {
+        riscv_code_written(riscv, off, 4);
+        pte = __atomic_or_fetch((uint32_t*)(riscv->mem + off), set, __ATOMIC_RELAXED);
+    }
+    pa = ((uint64_t)(pte >> 10) << 12) | (level ? vaddr & 0x3ff000 : 0);
+    if (pa >> 32) {
+        riscv_raise(riscv, faults[acc][1], vaddr);
+        return -1;
+    }
+    *paddr = (uint32_t)pa | (vaddr & 0xfff);
+    if (riscv_bus_ram(riscv, (uint32_t)pa, &off) && off <= riscv->mem_size - 0x1000) {
+        e = (acc == ACC_FETCH ? riscv->itlb : riscv->dtlb) + ((vaddr >> 12) & (TLB_SIZE - 1));
+        e->tag_r = r ? vaddr & ~0xfffu : TLB_INVALID;
+        e->tag_w = w && (pte & PTE_D) ? vaddr & ~0xfffu : TLB_INVALID;
+        e->tag_x = x ? vaddr & ~0xfffu : TLB_INVALID;
+        e->ppage = (uint32_t)pa;
+        e->host  = riscv->mem + off;
+    }
+    return 0;
+}
+
+// physical address of an access while translation is on, a tlb hit is one compare
+static int riscv_vm_translate(RISCV *riscv, uint32_t vaddr, int acc, uint32_t *paddr)
+{
+    RVTLB   *e   = (acc == ACC_FETCH ? riscv->itlb : riscv->dtlb) + ((vaddr >> 12) & (TLB_SIZE - 1));
+    uint32_t tag = acc == ACC_FETCH ? e->tag_x : acc == ACC_LOAD ? e->tag_r : e->tag_w;
+    if (tag == (vaddr & ~0xfffu)) {
+        *paddr = e->ppage | (vaddr & 0xfff);
+        return 0;
+    }
+    return riscv_vm_walk(riscv, vaddr, acc, paddr);
+}
+
+// physical pc of an instruction, the fetch fault is raised if it has none
+static int riscv_vm_fetch(RISCV *riscv, uint32_t pc, uint32_t *ppc)
+{
+    if (!(riscv->vm & VM_FETCH)) {
+        *ppc = pc;
+        return 0;
+    }
+    return riscv_vm_translate(riscv, pc, ACC_FETCH, ppc);
+}
+
+// loads and stores while translation is on, an aligned access hits the tlb with one compare of its page, accesses
+// straddling two pages go byte by byte, a store only once both pages are writable
+static uint32_t riscv_vm_read(RISCV *riscv, uint32_t addr, int size)
+{
+    RVTLB   *e = riscv->dtlb + ((addr >> 12) & (TLB_SIZE - 1));
+    uint32_t data = 0, paddr;
+    int      i;
+    if ((addr & (~0xfffu | (size - 1))) == e->tag_r || ((addr & ~0xfffu) == e->tag_r && (addr & 0xfff) <= 0x1000u - size)) {
+        memcpy(&data, e->host + (addr & 0xfff), size);
+        return data;
+    }
+    if ((addr & 0xfff) > 0x1000u - size) {
+        for (i = 0; i < size && !(riscv->status & TS_TRAP); i++) data |= riscv_vm_read(riscv, addr + i, 1) << (8 * i);
+        return data;
+    }
+    if (riscv_vm_walk(riscv, addr, ACC_LOAD, &paddr) < 0) return 0;
+    return riscv_phys_read(riscv, paddr, size);
+}
+
+static void riscv_vm_write(RISCV *riscv, uint32_t addr, uint32_t data, int size)
+{
+    RVTLB   *e = riscv->dtlb + ((addr >> 12) & (TLB_SIZE - 1));
+    uint32_t paddr;
+    int      i;
+    if ((addr & (~0xfffu | (size - 1))) == e->tag_w || ((addr & ~0xfffu) == e->tag_w && (addr & 0xfff) <= 0x1000u - size)) {
+        riscv_code_written(riscv, (uint32_t)(e->host - riscv->mem) + (addr & 0xfff), size);
+        memcpy(e->host + (addr & 0xfff), &data, size);
+        return;
+    }
+    if ((addr & 0xfff) > 0x1000u - size) {
+        if (riscv_vm_translate(riscv, addr, ACC_STORE, &paddr) < 0 || riscv_vm_translate(riscv, (addr + size - 1) & ~0xfffu, ACC_STORE, &paddr) < 0) return;
+        for (i = 0; i < size; i++) riscv_vm_write(riscv, addr + i, (data >> (8 * i)) & 0xff, 1);
+        return;
+    }
+    if (riscv_vm_walk(riscv, addr, ACC_STORE, &paddr) < 0) return;
+    riscv_phys_write(riscv, paddr, data, size);
+}
+
+static uint8_t* riscv_trace_leb(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) { *p++ = (uint8_t)(v | 0x80); v >>= 7; }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// greedy lz77 of a block into runs of LEB128 literal count, literals, match length - 4 and match distance, the block
+// ends with a literal run, returns the packed size, which may exceed n
+static uint32_t riscv_trace_pack(const uint8_t *in, uint32_t n, uint8_t *out, uint32_t *hash)
+{
+    uint8_t *p = out;
+    uint32_t i = 0, lit = 0, v, h, cand, len;
+
+    memset(hash, 0xff, sizeof(uint32_t) << TRACE_HASH_BITS);
+    while (i + 4 <= n) {
+        memcpy(&v, in + i, 4);
+        h       = (v * 0x9E3779B1u) >> (32 - TRACE_HASH_BITS);
+        cand    = hash[h];
+        hash[h] = i;
+        if (cand == 0xffffffff || memcmp(in + cand, in + i, 4)) { i++; continue; }
+        for (len = 4; i + len < n && in[cand + len] == in[i + len]; len++);
+        p = riscv_trace_leb(p, i - lit);
+        memcpy(p, in + lit, i - lit);
+        p = riscv_trace_leb(p + (i - lit), len - 4);
+        p = riscv_trace_leb(p, i - cand);
+        lit = i += len;
+    }
+    p = riscv_trace_leb(p, n - lit);
+    memcpy(p, in + lit, n - lit);
+    return (uint32_t)(p + (n - lit) - out);
+}
+
+static void* riscv_trace_thread(void *arg)
+{
+    RVTRACEOUT *t = arg;
+    RVTRACEBUF *b;
+    uint8_t     hdr[32], *p;
+    uint32_t    n;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (!t->queue && !t->quit) pthread_cond_wait(&t->cond, &t->lock);
+        if (!(b = t->queue)) break;
+        if (!(t->queue = b->next)) t->tail = NULL;
+        pthread_mutex_unlock(&t->lock);
+        n = riscv_trace_pack(b->data, b->len, t->out, t->hash);
+        if (n >= b->len) n = 0; // stored as is
+        p = riscv_trace_leb(riscv_trace_leb(riscv_trace_leb(hdr, b->hart), b->len), n);
+        if (fwrite(hdr, 1, p - hdr, t->fp) != (size_t)(p - hdr) || fwrite(n ? t->out : b->data, 1, n ? n : b->len, t->fp) != (n ? n : b->len)) t->failed = 1;
+        pthread_mutex_lock(&t->lock);
+        b->next = t->free;
+        t->free = b;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// queues the buffer of a hart to the writer, and gives the hart an empty one unless it is done
+static void riscv_trace_submit(RVTRACE *tr, int done)
+{
+    RVTRACEOUT *t = tr->out;
+    RVTRACEBUF *b = tr->buf;
+
+    pthread_mutex_lock(&t->lock);
+    if (b && b->len) {
+        b->next = NULL;
+        if (t->tail) t->tail->next = b; else t->queue = b;
+        t->tail = b;
+        b       = NULL;
+        pthread_cond_broadcast(&t->cond);
+    }
+    if (!b && !done) {
+        while (!t->free && t->nbufs >= TRACE_MAX_BUFS) pthread_cond_wait(&t->cond, &t->lock);
+        if ((b = t->free)) t->free = b->next;
+        else if ((b = malloc(sizeof(RVTRACEBUF)))) t->nbufs++;
+        else t->failed = 1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    if (b) { b->hart = tr->hart; b->len = 0; }
+    tr->buf = b;
+}
+
+static void riscv_trace_put(RVTRACE *tr, uint64_t v)
+{
+    RVTRACEBUF *b = tr->buf;
+    if (!b || b->len > TRACE_BUF_SIZE - 16) {
+        riscv_trace_submit(tr, 0);
+        if (!(b = tr->buf)) return;
+    }
+    b->len = (uint32_t)(riscv_trace_leb(b->data + b->len, v) - b->data);
+}
+
+static void riscv_trace_fetch(RVTRACE *tr, uint32_t pc, int len)
+{
+    riscv_trace_put(tr, ((uint64_t)TRACE_ZIGZAG(pc - tr->next) << 1 | (len == 2)) << 2 | TRACE_FETCH);
+    tr->pc   = pc;
+    tr->next = pc + len;
+}
+
+static void riscv_trace_data(RVTRACE *tr, int kind, uint32_t addr, int size)
+{
+    riscv_trace_put(tr, ((uint64_t)TRACE_ZIGZAG(addr - tr->addr) << 2 | (size >> 1)) << 2 | kind);
+    tr->addr = addr;
+}
+
+static void riscv_trace_control(RVTRACE *tr, int kind, uint32_t target)
+{
+    riscv_trace_put(tr, ((uint64_t)TRACE_ZIGZAG(target - tr->pc) << 3 | kind) << 2 | TRACE_CONTROL);
+}
+
+// starts tracing all harts into file, loads and stores then leave the inline ram path so that all of them are seen
+int riscv_trace_open(RVMACHINE *mach, const char *file)
+{
+    RVTRACEOUT *t;
+    RVTRACE    *tr;
+    int         i;
+
+    if (mach->trace || !(t = calloc(1, sizeof(RVTRACEOUT)))) return -1;
+    t->out  = malloc(2 * TRACE_BUF_SIZE);
+    t->hash = malloc(sizeof(uint32_t) << TRACE_HASH_BITS);
+    if (!t->out || !t->hash || !(t->fp = fopen(file, "wb"))) goto fail;
+    if (fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, t->fp) != sizeof(TRACE_MAGIC) - 1) goto fail;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init (&t->cond, NULL);
+    if (pthread_create(&t->thread, NULL, riscv_trace_thread, t) != 0) {
+        pthread_cond_destroy (&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        goto fail;
+    }
+    mach->trace = t;
+    for (i = 0; i < mach->nharts; i++) {
+        if (!(tr = calloc(1, sizeof(RVTRACE)))) { t->failed = 1; continue; }
+        tr->out  = t;
+        tr->hart = i;
+        tr->next = mach->harts[i]->pc;
+        mach->harts[i]->trace = tr;
+        riscv_vm_update(mach->harts[i]);
+    }
+    return 0;
+fail:
+    if (t->fp) fclose(t->fp);
+    free(t->out);
+    free(t->hash);
+    free(t);
+    return -1;
+}
+
+// flushes the harts and waits for the writer, returns -1 if some records were lost or the file could not be written
+int riscv_trace_close(RVMACHINE *mach)
+{
+    RVTRACEOUT *t = mach->trace;
+    RVTRACEBUF *b;
+    RISCV      *riscv;
+    int         i, ret;
+
+    if (!t) return 0;
+    for (i = 0; i < mach->nharts; i++) {
+        riscv = mach->harts[i];
+        if (!riscv->trace) continue;
+        riscv_trace_submit(riscv->trace, 1);
+        free(riscv->trace);
+        riscv->trace = NULL;
+        riscv_vm_update(riscv);
+    }
+    pthread_mutex_lock(&t->lock);
+    t->quit = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_cond_destroy (&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    while ((b = t->free)) { t->free = b->next; free(b); }
+    ret = t->failed || ferror(t->fp) ? -1 : 0;
+    if (fclose(t->fp) != 0) ret = -1;
+    free(t->out);
+    free(t->hash);
+    free(t);
+    mach->trace = NULL;
+    return ret;
+}
+
+// the loads and stores riscv_memr*/memw* do not take to ram directly, all of them while tracing
+static uint32_t riscv_mem_read(RISCV *riscv, uint32_t addr, int size)
+{
+    if (riscv->trace) riscv_trace_data(riscv->trace, TRACE_LOAD, addr, size);
+    return riscv->vm & VM_DATA ? riscv_vm_read(riscv, addr, size) : riscv_phys_read(riscv, addr, size);
+}
+
+static void riscv_mem_write(RISCV *riscv, uint32_t addr, uint32_t data, int size)
+{
+    if (riscv->trace) riscv_trace_data(riscv->trace, TRACE_STORE, addr, size);
+    if (riscv->vm & VM_DATA) riscv_vm_write(riscv, addr, data, size);
+    else riscv_phys_write(riscv, addr, data, size);
+}
+
+// ram at address 0 is accessed inline while loads and stores are neither translated nor traced
+static inline uint8_t riscv_memr8(RISCV *riscv, uint32_t addr)
+{
+    if (addr < riscv->ram_data) return riscv->mem[addr];
+    return (uint8_t)riscv_mem_read(riscv, addr, 1);
+}
+
+static inline void riscv_memw8(RISCV *riscv, uint32_t addr, uint8_t data)
+{
+    if (addr < riscv->ram_data) {
+        riscv_code_written(riscv, addr, 1);
+        riscv->mem[addr] = data;
+        return;
+    }
+    riscv_mem_write(riscv, addr, data, 1);
+}
+
+static inline uint16_t riscv_memr16(RISCV *riscv, uint32_t addr)
+{
+    uint16_t data;
+    if ((uint64_t)addr + 2 <= riscv->ram_data) {
+        memcpy(&data, riscv->mem + addr, 2);
+        return data;
+    }
+    return (uint16_t)riscv_mem_read(riscv, addr, 2);
+}
+
+static inline void riscv_memw16(RISCV *riscv, uint32_t addr, uint16_t data)
+{
+    if ((uint64_t)addr + 2 <= riscv->ram_data) {
+        riscv_code_written(riscv, addr, 2);
+        memcpy(riscv->mem + addr, &data, 2);
+        return;
+    }
+    riscv_mem_write(riscv, addr, data, 2);
+}
+
+static inline uint32_t riscv_memr32(RISCV *riscv, uint32_t addr)
+{
+    uint32_t data;
+    if ((uint64_t)addr + 4 <= riscv->ram_data) {
+        memcpy(&data, riscv->mem + addr, 4);
+        return data;
+    }
+    return riscv_mem_read(riscv, addr, 4);
+}
+
+static inline void riscv_memw32(RISCV *riscv, uint32_t addr, uint32_t data)
+{
+    if ((uint64_t)addr + 4 <= riscv->ram_data) {
+        riscv_code_written(riscv, addr, 4);
+        memcpy(riscv->mem + addr, &data, 4);
+        return;
+    }
+    riscv_mem_write(riscv, addr, data, 4);
+}
+
+// fld and c.fld
+static uint64_t riscv_memr64(RISCV *riscv, uint32_t addr)
+{
+    uint64_t data = riscv_memr32(riscv, addr);
+    return data | (uint64_t)riscv_memr32(riscv, addr + 4) << 32;
+}
+
+static uint32_t riscv_ring_count(RVRING *r)
+{
+    return atomic_load_explicit(&r->head, memory_order_acquire) - atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+// producer side, returns the number of bytes that fit
+static uint32_t riscv_ring_push(RVRING *r, const void *data, uint32_t n)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint32_t pos  = head & (r->size - 1), part;
+    if (n > r->size - (head - tail)) n = r->size - (head - tail);
+    part = n < r->size - pos ? n : r->size - pos;
+    memcpy(r->buf + pos, data, part);
+    memcpy(r->buf, (const uint8_t*)data + part, n - part);
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+// consumer side, returns the number of bytes taken
+static uint32_t riscv_ring_pop(RVRING *r, void *data, uint32_t n)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t pos  = tail & (r->size - 1), part;
+    if (n > head - tail) n = head - tail;
+    part = n < r->size - pos ? n : r->size - pos;
+    memcpy(data, r->buf + pos, part);
+    memcpy((uint8_t*)data + part, r->buf, n - part);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return n;
+}
+
+static void riscv_kbd_init(RVKBD *kbd)
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        kbd->ring[i].buf  = kbd->buf[i];
+        kbd->ring[i].size = KBD_RING_SIZE;
+    }
+    atomic_store(&kbd->eof, 1);
+    pthread_mutex_init(&kbd->lock, NULL);
+    pthread_cond_init (&kbd->cond, NULL);
+}
+
+// wakes a hart blocked on a keyboard read and the harts sleeping in wfi
+static void riscv_kbd_wake(RVKBD *kbd)
+{
+    pthread_mutex_lock    (&kbd->lock);
+    pthread_cond_broadcast(&kbd->cond);
+    pthread_mutex_unlock  (&kbd->lock);
+}
+
+#if FFVM_SDL
+// src 1 is for host events that must not block, keys that do not fit are dropped
+static void riscv_kbd_push(RVKBD *kbd, int src, const void *data, uint32_t n)
+{
+    if (riscv_ring_push(&kbd->ring[src], data, n) < n) atomic_store(&kbd->dropped, 1);
+    if (src == 0) riscv_kbd_wake(kbd);
+}
+#endif
+
+static void* riscv_kbd_thread(void *arg)
+{
+    RVKBD   *kbd = arg;
+    uint8_t  buf[64];
+    ssize_t  n, i;
+    while ((n = read(kbd->fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // the input may be a file, wait for the guest instead of dropping it
+        for (i = 0; i < n; ) {
+            uint32_t m = riscv_ring_push(&kbd->ring[0], buf + i, (uint32_t)(n - i));
+            if (m) riscv_kbd_wake(kbd);
+            else   usleep(1000);
+            i += m;
+        }
+    }
+    atomic_store(&kbd->eof, 1);
+    riscv_kbd_wake(kbd);
+    return NULL;
+}
+
+// start feeding the keyboard from fd, e.g. stdin or a scripted input file, only one machine per process should own stdin
+int riscv_kbd_attach(RVKBD *kbd, int fd)
+{
+    kbd->fd = fd;
+    atomic_store(&kbd->eof, 0);
+    kbd->thread_ok = pthread_create(&kbd->thread, NULL, riscv_kbd_thread, kbd) == 0;
+    if (!kbd->thread_ok) atomic_store(&kbd->eof, 1);
+    return kbd->thread_ok ? 0 : -1;
+}
+
+static void riscv_kbd_free(RVKBD *kbd)
+{
+    if (kbd->thread_ok) {
+        pthread_cancel(kbd->thread);
+        pthread_join  (kbd->thread, NULL);
+        kbd->thread_ok = 0;
+    }
+    pthread_cond_destroy (&kbd->cond);
+    pthread_mutex_destroy(&kbd->lock);
+}
+
+static int riscv_kbd_ready(RVKBD *kbd)
+{
+    return riscv_ring_count(&kbd->ring[0]) || riscv_ring_count(&kbd->ring[1]);
+}
+
+// returns the next key or -1, a blocking read gives up once stdin hits eof or the host pump asks to
+static int riscv_kbd_getc(RVKBD *kbd, int block)
+{
+    struct timespec ts;
+    uint8_t c;
+    for (;;) {
+        if (riscv_ring_pop(&kbd->ring[0], &c, 1) || riscv_ring_pop(&kbd->ring[1], &c, 1)) return c;
+        if (!block || atomic_load(&kbd->eof)) return -1;
+        if (kbd->pump && pthread_equal(kbd->pump_thread, pthread_self()) && kbd->pump(kbd->pump_opaque)) return -1;
+        if (riscv_ring_count(&kbd->ring[1])) continue;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10 * 1000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        if (kbd->iolock) pthread_mutex_unlock(kbd->iolock);
+        pthread_mutex_lock(&kbd->lock);
+        if (!riscv_ring_count(&kbd->ring[0]) && !atomic_load(&kbd->eof)) pthread_cond_timedwait(&kbd->cond, &kbd->lock, &ts);
+        pthread_mutex_unlock(&kbd->lock);
+        if (kbd->iolock) pthread_mutex_lock(kbd->iolock);
+    }
+}
+
+static void riscv_con_fill(RVCON *con, uint32_t from, uint32_t to)
+{
+    for (; from < to; from++) con->vram[from] = ' ' | (con->attr << 8);
+}
+
+static void riscv_con_setup(RVCON *con, uint32_t cols, uint32_t rows)
+{
+    con->cols = cols < 1 ? 1 : cols > CON_MAX_COLS ? CON_MAX_COLS : cols;
+    con->rows = rows < 1 ? 1 : rows > CON_MAX_ROWS ? CON_MAX_ROWS : rows;
+    con->x    = con->y = 0;
+    con->shadow_ok = 0;
+    riscv_con_fill(con, 0, con->cols * con->rows);
+}
+
+static void riscv_con_init(RVCON *con)
+{
+    con->attr = CON_ATTR_DEFAULT;
+    riscv_con_setup(con, 80, 25);
+}
+
+static void riscv_con_newline(RVCON *con)
+{
+    con->x = 0;
+    if (++con->y < con->rows) return;
+    con->y = con->rows - 1;
+    memmove(con->vram, con->vram + con->cols, con->cols * (con->rows - 1) * sizeof(con->vram[0]));
+    riscv_con_fill(con, con->cols * (con->rows - 1), con->cols * con->rows);
+}
+
+// the subset of ansi csi sequences text mode programs use: cursor moves, erase and colors
+static void riscv_con_csi(RVCON *con, uint8_t c)
+{
+    int n = con->par[0] ? con->par[0] : 1, i, p;
+    switch (c) {
+    case 'H': case 'f':
+        con->y = con->par[0] ? con->par[0] - 1 : 0;
+        con->x = con->par[1] ? con->par[1] - 1 : 0;
+        break;
+    case 'A': con->y = (int)con->y > n ? con->y - n : 0; break;
+    case 'B': con->y += n; break;
+    case 'C': con->x += n; break;
+    case 'D': con->x = (int)con->x > n ? con->x - n : 0; break;
+    case 'J':
+        if (con->par[0] == 2) riscv_con_fill(con, 0, con->cols * con->rows);
+        else riscv_con_fill(con, con->y * con->cols + con->x, con->cols * con->rows);
+        break;
+    case 'K':
+        if (con->par[0] == 2) riscv_con_fill(con, con->y * con->cols, (con->y + 1) * con->cols);
+        else riscv_con_fill(con, con->y * con->cols + con->x, (con->y + 1) * con->cols);
+        break;
+    case 'm':
+        for (i = 0; i < con->npar; i++) {
+            p = con->par[i];
+            if      (p == 0) con->attr = CON_ATTR_DEFAULT;
+            else if (p == 1) con->attr |= 0x08;
+            else if (p >= 30  && p <= 37 ) con->attr = (con->attr & 0xF8) | (p - 30);
+            else if (p >= 90  && p <= 97 ) con->attr = (con->attr & 0xF0) | (p - 90) | 0x08;
+            else if (p == 39) con->attr = (con->attr & 0xF0) | (CON_ATTR_DEFAULT & 0x0F);
+            else if (p >= 40  && p <= 47 ) con->attr = (con->attr & 0x8F) | (p - 40) << 4;
+            else if (p >= 100 && p <= 107) con->attr = (con->attr & 0x0F) | (p - 100) << 4 | 0x80;
+            else if (p == 49) con->attr = (con->attr & 0x0F) | (CON_ATTR_DEFAULT & 0xF0);
+        }
+        break;
+    }
+    if (con->x >= con->cols) con->x = con->cols - 1;
+    if (con->y >= con->rows) con->y = con->rows - 1;
+}
+
+static void riscv_con_putc(RVCON *con, uint8_t c)
+{
+    if (con->esc == 1) {
+        con->esc  = c == '[' ? 2 : 0;
+        con->npar = 0;
+        memset(con->par, 0, sizeof(con->par));
+        return;
+    }
+    if (con->esc == 2) {
+        if (c >= '0' && c <= '9') { con->par[con->npar] = con->par[con->npar] * 10 + c - '0'; return; }
+        if (c == ';') { if (con->npar < 3) con->npar++; return; }
+        if (c == '?') return;
+        con->esc = 0;
+        con->npar++;
+        riscv_con_csi(con, c);
+        return;
+    }
+    switch (c) {
+    case 0x1b: con->esc = 1; break;
+    case '\n': riscv_con_newline(con); break;
+    case '\r': con->x = 0; break;
+    case '\b': if (con->x) con->x--; break;
+    case '\t': con->x = (con->x + 8) & ~7; if (con->x >= con->cols) riscv_con_newline(con); break;
+    default:
+        con->vram[con->y * con->cols + con->x] = c | (con->attr << 8);
+        if (++con->x >= con->cols) riscv_con_newline(con);
+        break;
+    }
+}
+
+// append to the update buffer, flushing it to fp when full
+static void riscv_con_emit(char *buf, int *len, FILE *fp, const char *str, int n)
+{
+    if (*len + n > 4096) { fwrite(buf, 1, *len, fp); *len = 0; }
+    memcpy(buf + *len, str, n);
+    *len += n;
+}
+
+// bring the terminal in line with the vram using one buffered write of the cells that changed
+void riscv_con_update(RVCON *con, FILE *fp)
+{
+    static const int bright[2] = { 30, 90 };
+    char     buf[4096 + 64], seq[64];
+    int      len = 0, n, dirty = 0;
+    uint32_t x, y, cell, cx = (uint32_t)-1, cy = (uint32_t)-1;
+
+    if (!con->shadow_ok) {
+        riscv_con_emit(buf, &len, fp, "\033[0m\033[2J", 8);
+        for (x = 0; x < CON_MAX_ROWS * CON_MAX_COLS; x++) con->shadow[x] = ' ' | (CON_ATTR_DEFAULT << 8);
+        con->shown_attr = (uint32_t)-1;
+        con->shadow_ok  = 1;
+    }
+    for (y = 0; y < con->rows; y++) {
+        uint16_t *row = con->vram + y * con->cols, *old = con->shadow + y * con->cols;
+        if (memcmp(row, old, con->cols * sizeof(row[0])) == 0) continue;
+        for (x = 0; x < con->cols; x++) {
+            if ((cell = row[x]) == old[x]) continue;
+            if (!dirty) { riscv_con_emit(buf, &len, fp, "\033[?25l", 6); dirty = 1; }
+            if (cx != x || cy != y) {
+                n = sprintf(seq, "\033[%u;%uH", y + 1, x + 1);
+                riscv_con_emit(buf, &len, fp, seq, n);
+            }
+            if ((cell >> 8) != con->shown_attr) {
+                con->shown_attr = cell >> 8;
+                n = sprintf(seq, "\033[0;%d;%dm", bright[(cell >> 11) & 1] + ((cell >> 8) & 7), bright[(cell >> 15) & 1] + 10 + ((cell >> 12) & 7));
+                riscv_con_emit(buf, &len, fp, seq, n);
+            }
+            seq[0] = (cell & 0xFF) >= ' ' && (cell & 0xFF) < 0x7F ? cell & 0xFF : ' ';
+            riscv_con_emit(buf, &len, fp, seq, 1);
+            old[x] = cell;
+            cx = x + 1; cy = y;
+        }
+    }
+    if (dirty || con->x != con->shown_x || con->y != con->shown_y) {
+        n = sprintf(seq, "\033[%u;%uH%s", con->y + 1, con->x + 1, dirty ? "\033[?25h" : "");
+        riscv_con_emit(buf, &len, fp, seq, n);
+        con->shown_x = con->x;
+        con->shown_y = con->y;
+    }
+    if (len) { fwrite(buf, 1, len, fp); fflush(fp); }
+}
+
+static void riscv_con_write(RVMACHINE *mach, uint32_t data)
+{
+    if (mach->con.mode == CON_MODE_VRAM) {
+        if (data != (uint32_t)-1) riscv_con_putc(&mach->con, data);
+    } else {
+        if (data == (uint32_t)-1) fflush(mach->out); else fputc(data, mach->out);
+    }
+}
+
+// 0xF0000000 standard input and output registers, the reads are served from the keyboard rings
+static uint32_t dev_stdio_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach = opaque;
+    int        c;
+    switch (offset) {
+    case 0x0:
+        c = riscv_kbd_getc(&mach->kbd, 1);
+        if (c >= 0 && mach->kbd.echo) { riscv_con_write(mach, c); riscv_con_write(mach, -1); }
+        return c;
+    case 0x8: return riscv_kbd_getc(&mach->kbd, 1);
+    case 0xC:
+        if (riscv_kbd_ready(&mach->kbd)) return 1;
+        riscv_io_hart->status |= TS_WAIT;
+        return 0;
+    }
+    return 0;
+}
+
+static void dev_stdio_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    switch (offset) {
+    case 0x0: riscv_con_write(opaque, data); break;
+    case 0x4: if (data == (uint32_t)-1) fflush(stderr); else fputc(data, stderr); break;
+    }
+}
+
+// 0xF0000200 keyboard registers
+static uint32_t dev_kbd_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach  = opaque;
+    RVKBD     *kbd   = &mach->kbd;
+    int        ready = riscv_kbd_ready(kbd), c;
+    switch (offset) {
+    case 0x0:
+        if (!ready) riscv_io_hart->status |= TS_WAIT;
+        return (ready ? KBD_STATUS_READY : 0) | (atomic_exchange(&kbd->dropped, 0) ? KBD_STATUS_DROPPED : 0);
+    case 0x4:
+        if ((c = riscv_kbd_getc(kbd, 0)) < 0) riscv_io_hart->status |= TS_WAIT;
+        return c;
+    case 0x8: return kbd->ctrl;
+    case 0xC: return (kbd->ctrl & KBD_CTRL_IRQ_EN) && ready;
+    }
+    return 0;
+}
+
+static void dev_kbd_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    if (offset == 0x8) {
+        mach->kbd.ctrl = data & KBD_CTRL_IRQ_EN;
+        riscv_io_hart->status |= TS_IRQ;
+    }
+}
+
+static int riscv_fb_bpp_shift(uint32_t format)
+{
+    return format == FB_FMT_ARGB8888 ? 2 : format == FB_FMT_RGB565 ? 1 : 0;
+}
+
+static void riscv_fb_dirty_all(RVFB *fb)
+{
+    memset(fb->dirty, 1, sizeof(fb->dirty));
+    fb->ndirty = sizeof(fb->dirty);
+}
+
+static void riscv_fb_setup(RVFB *fb, uint32_t width, uint32_t height, uint32_t format)
+{
+    fb->width    = width  < 1 ? 1 : width  > FB_MAX_WIDTH  ? FB_MAX_WIDTH  : width;
+    fb->height   = height < 1 ? 1 : height > FB_MAX_HEIGHT ? FB_MAX_HEIGHT : height;
+    fb->format   = format <= FB_FMT_ARGB8888 ? format : FB_FMT_OFF;
+    fb->pitch    = fb->width << riscv_fb_bpp_shift(fb->format);
+    fb->reconfig = 1;
+    riscv_fb_dirty_all(fb);
+}
+
+static void riscv_fb_init(RVFB *fb)
+{
+    uint32_t i, r, g, b;
+    for (i = 0; i < 256; i++) { // rgb332 until the guest loads its own palette
+        r = (i >> 5) * 255 / 7;
+        g = ((i >> 2) & 7) * 255 / 7;
+        b = (i & 3) * 255 / 3;
+        fb->palette[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+    }
+    riscv_fb_setup(fb, 320, 240, FB_FMT_OFF);
+}
+
+static void riscv_fb_mark(RVFB *fb, uint32_t offset)
+{
+    uint32_t y = offset / fb->pitch, x;
+    uint8_t *t;
+    if (y >= fb->height) return;
+    x = (offset - y * fb->pitch) >> riscv_fb_bpp_shift(fb->format);
+    t = fb->dirty + (y >> FB_TILE_SHIFT) * FB_TILES_X + (x >> FB_TILE_SHIFT);
+    if (!*t) { *t = 1; fb->ndirty++; }
+}
+
+// 0xF1000000 framebuffer memory
+static uint32_t dev_fbmem_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach = opaque;
+    uint32_t   data = 0;
+    memcpy(&data, mach->fb.mem + offset, size);
+    return data;
+}
+
+static void dev_fbmem_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVFB      *fb   = &mach->fb;
+    memcpy(fb->mem + offset, &data, size);
+    if (fb->format == FB_FMT_OFF) return;
+    riscv_fb_mark(fb, offset);
+    if (size > 1) riscv_fb_mark(fb, offset + size - 1);
+}
+
+// 0xF0000800 framebuffer control registers, palette at 0x400
+static uint32_t dev_fbctl_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVFB      *fb   = &mach->fb;
+    uint32_t   data = 0;
+    if (offset >= 0x400) {
+        memcpy(&data, (uint8_t*)fb->palette + offset - 0x400, size);
+        return data;
+    }
+    switch (offset) {
+    case 0x00: return fb->width;
+    case 0x04: return fb->height;
+    case 0x08: return fb->format;
+    case 0x0C: return fb->pitch;
+    case 0x10: return fb->ctrl;
+    case 0x14: return fb->frames;
+    }
+    return 0;
+}
+
+static void dev_fbctl_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVFB      *fb   = &mach->fb;
+    if (offset >= 0x400) {
+        memcpy((uint8_t*)fb->palette + offset - 0x400, &data, size);
+        if (fb->format == FB_FMT_PAL8) riscv_fb_dirty_all(fb);
+        return;
+    }
+    switch (offset) {
+    case 0x00: riscv_fb_setup(fb, data, fb->height, fb->format); break;
+    case 0x04: riscv_fb_setup(fb, fb->width, data, fb->format); break;
+    case 0x08: riscv_fb_setup(fb, fb->width, fb->height, data); break;
+    case 0x10: fb->ctrl = data & FB_CTRL_VSYNC; break;
+    case 0x14: fb->ready = 1; riscv_io_hart->status |= TS_WAIT; break; // frame complete, let the host show it
+    }
+}
+
+// 0xF0000300 text console registers
+static uint32_t dev_con_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVCON     *con  = &mach->con;
+    switch (offset) {
+    case 0x00: return con->cols;
+    case 0x04: return con->rows;
+    case 0x08: return con->x | (con->y << 16);
+    case 0x0C: return con->attr;
+    case 0x10: return con->mode;
+    }
+    return 0;
+}
+
+static void dev_con_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVCON     *con  = &mach->con;
+    switch (offset) {
+    case 0x00: riscv_con_setup(con, data, con->rows); break;
+    case 0x04: riscv_con_setup(con, con->cols, data); break;
+    case 0x08:
+        con->x = (data & 0xFFFF) < con->cols ? (data & 0xFFFF) : con->cols - 1;
+        con->y = (data >> 16   ) < con->rows ? (data >> 16   ) : con->rows - 1;
+        break;
+    case 0x0C: con->attr = data & 0xFF; break;
+    case 0x10: con->mode = data & 1; con->shadow_ok = 0; break;
+    }
+}
+
+// 0xF0100000 text vram, char | attr << 8 per cell
+static uint32_t dev_vram_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach = opaque;
+    uint32_t   data = 0;
+    memcpy(&data, (uint8_t*)mach->con.vram + offset, size);
+    return data;
+}
+
+static void dev_vram_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    memcpy((uint8_t*)mach->con.vram + offset, &data, size);
+}
+
+// 0xF0000100 operating system interface registers
+static void dev_system_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    COORD      coord;
+    switch (offset) {
+    case 0x0: // sleep without the io lock, the other harts keep running
+        riscv_io_hart->status |= TS_WAIT;
+        if (mach->headless) break;
+        pthread_mutex_unlock(&mach->iolock);
+        usleep(data * 1000);
+        pthread_mutex_lock(&mach->iolock);
+        break;
+    case 0x4:
+        if (mach->con.mode == CON_MODE_VRAM) {
+            riscv_con_fill(&mach->con, 0, mach->con.cols * mach->con.rows);
+            mach->con.x = mach->con.y = 0;
+        } else {
+            fputs("\033[2J\033[H", mach->out);
+        }
+        break;
+    case 0x8:
+        coord.X = (data >> 0 ) & 0xFFFF;
+        coord.Y = (data >> 16) & 0xFFFF;
+        if (mach->con.mode == CON_MODE_VRAM) dev_con_write(mach, 0x08, data, size);
+        else SetConsoleCursorPosition(mach->out, coord.X,coord.Y);
+        break;
+    }
+}
+
+// 0xF2000000 clint: msip of hart n at 4 * n, mtimecmp at 0x4000 + 8 * n, mtime at 0xBFF8, every hart reads its own
+// cycle count as mtime, writes to mtime are ignored
+static uint32_t dev_clint_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach  = opaque;
+    RISCV     *riscv = riscv_io_hart;
+    uint64_t   time  = riscv->icount + riscv->io_retired + riscv->idle;
+    offset &= ~3;
+    if (offset == 0xBFF8) return (uint32_t)time;
+    if (offset == 0xBFFC) return (uint32_t)(time >> 32);
+    if (offset >= 0x4000 && offset < 0x4000 + 8 * (uint32_t)mach->nharts) {
+        return (uint32_t)(mach->harts[(offset - 0x4000) >> 3]->mtimecmp >> (offset & 4 ? 32 : 0));
+    }
+    if (offset < 4 * (uint32_t)mach->nharts) return atomic_load(&mach->harts[offset >> 2]->msip);
+    return 0;
+}
+
+// another hart sees its new mtimecmp or msip at its next slice at the latest
+static void dev_clint_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    RISCV     *hart;
+    offset &= ~3;
+    if (offset >= 0x4000 && offset < 0x4000 + 8 * (uint32_t)mach->nharts) {
+        hart = mach->harts[(offset - 0x4000) >> 3];
+        if (offset & 4) hart->mtimecmp = (hart->mtimecmp & 0xFFFFFFFF) | (uint64_t)data << 32;
+        else            hart->mtimecmp = (hart->mtimecmp & ~(uint64_t)0xFFFFFFFF) | data;
+    } else if (offset < 4 * (uint32_t)mach->nharts) {
+        hart = mach->harts[offset >> 2];
+        atomic_store(&hart->msip, data & 1);
+        if (hart != riscv_io_hart) riscv_kbd_wake(&mach->kbd); // it may sleep in wfi
+    } else {
+        return;
+    }
+    riscv_io_hart->status |= TS_IRQ;
+}
+
+// stops all harts at their next slice, harts blocked on the keyboard give up the read
+static void riscv_stop(RVMACHINE *mach)
+{
+    atomic_store(&mach->exited, 1);
+    atomic_store(&mach->kbd.eof, 1);
+    riscv_kbd_wake(&mach->kbd);
+}
+
+static int32_t signed_extend(uint32_t a, int size)
+{
+    return (a & (1 << (size - 1))) ? (a | ~((1 << size) - 1)) : a;
+}
+
+#define RISCV_CPU_FREQ  (1*1000*1000) // instructions per second of a hart with a window, also the rate of mtime
+#define RISCV_FRAMERATE  100
+
+static uint32_t riscv_audio_frame(RVAUDIO *a)
+{
+    return a->channels << (a->format == AUDIO_FMT_S16);
+}
+
+static void riscv_audio_init(RVAUDIO *a)
+{
+    a->ring.buf  = a->buf;
+    a->ring.size = AUDIO_RING_SIZE;
+    a->rate      = 44100;
+    a->channels  = 2;
+    a->format    = AUDIO_FMT_S16;
+    a->threshold = AUDIO_RING_SIZE / 2;
+}
+
+// bytes the guest clocked sink has yet to take to have played everything due by time
+static uint64_t riscv_audio_due(RVAUDIO *a, uint64_t time)
+{
+    uint64_t bytes, played;
+    if (a->host || !(a->ctrl & AUDIO_CTRL_ENABLE) || time <= a->start) return 0;
+    bytes  = (time - a->start) * a->rate / RISCV_CPU_FREQ * riscv_audio_frame(a);
+    played = atomic_load(&a->played);
+    return bytes > played ? bytes - played : 0;
+}
+
+// cycles of the guest clock until the fifo level drops below the threshold, 0 if it is below, UINT64_MAX if the sink
+// does not take anything
+static uint64_t riscv_audio_wait(RVAUDIO *a, uint64_t time)
+{
+    uint64_t count, due, frames, at;
+    if (!(a->ctrl & AUDIO_CTRL_ENABLE) || !a->threshold) return UINT64_MAX;
+    count = riscv_ring_count(&a->ring);
+    due   = riscv_audio_due(a, time);
+    if (count < a->threshold + due) return 0;
+    if (a->host) { // at the nominal rate of the device
+        if (!atomic_load(&a->playing)) return UINT64_MAX;
+        return ((count - a->threshold + 1) * RISCV_CPU_FREQ + a->host_rate - 1) / a->host_rate;
+    }
+    // the level is below once the sink took this many frames since it started
+    frames = (count + atomic_load(&a->played) - a->threshold) / riscv_audio_frame(a) + 1;
+    at     = a->start + (frames * RISCV_CPU_FREQ + a->rate - 1) / a->rate;
+    return at > time ? at - time : 0;
+}
+
+static int riscv_audio_irq(RVAUDIO *a, uint64_t time)
+{
+    return (a->ctrl & AUDIO_CTRL_IRQ_EN) && riscv_audio_wait(a, time) == 0;
+}
+
+// the guest clocked sink takes what it played by time, into the wav file or nowhere, running dry plays silence
+static void riscv_audio_sync(RVAUDIO *a, uint64_t time)
+{
+    uint8_t  buf[4096];
+    uint64_t due = riscv_audio_due(a, time);
+    uint32_t n, m;
+    if (!due) return;
+    atomic_fetch_add(&a->played, due);
+    for (; due; due -= n) {
+        n = due < sizeof(buf) ? (uint32_t)due : sizeof(buf);
+        m = riscv_ring_pop(&a->ring, buf, n);
+        if (m < n) {
+            atomic_store(&a->underrun, 1);
+            if (!a->wav) break;
+            memset(buf + m, a->format == AUDIO_FMT_U8 ? 0x80 : 0, n - m);
+        }
+        if (a->wav) a->wav_bytes += (uint32_t)fwrite(buf, 1, n, a->wav);
+    }
+}
+
+#if FFVM_SDL
+// consumer side of a host device, runs on the audio thread of the host
+static void riscv_audio_pull(RVAUDIO *a, uint8_t *out, uint32_t len, uint8_t silence)
+{
+    uint32_t n = riscv_ring_pop(&a->ring, out, len);
+    if (n < len) {
+        memset(out + n, silence, len - n);
+        atomic_store(&a->underrun, 1);
+    }
+    atomic_fetch_add(&a->played, len);
+}
+#endif
+
+// playback started, stopped or changed format at time
+static void riscv_audio_restart(RVAUDIO *a, uint64_t time)
+{
+    a->start    = time;
+    a->reconfig = 1;
+    atomic_store(&a->played, 0);
+    if (a->wav && !a->wav_bytes) {
+        a->wav_spec[0] = a->rate;
+        a->wav_spec[1] = a->channels;
+        a->wav_spec[2] = a->format;
+    }
+}
+
+// the guest clocked sink writes the samples to file instead of dropping them, the file keeps the format playback
+// first started with, the header is written when the machine is freed
+int riscv_audio_wav(RVAUDIO *a, const char *file)
+{
+    RVWAVHDR hdr = {0};
+    if (!(a->wav = fopen(file, "wb"))) return -1;
+    fwrite(&hdr, sizeof(hdr), 1, a->wav);
+    a->wav_spec[0] = a->rate;
+    a->wav_spec[1] = a->channels;
+    a->wav_spec[2] = a->format;
+    return 0;
+}
+
+// the wav file gets what is left in the fifo and its header
+static void riscv_audio_free(RVAUDIO *a)
+{
+    RVWAVHDR hdr = { .riff = "RIFF", .wave = "WAVEfmt ", .fmt_size = 16, .tag = 1 }; // pcm
+    uint8_t  buf[4096];
+    uint32_t n;
+    if (!a->wav) return;
+    while ((n = riscv_ring_pop(&a->ring, buf, sizeof(buf)))) a->wav_bytes += (uint32_t)fwrite(buf, 1, n, a->wav);
+    hdr.riff_size = 36 + a->wav_bytes;
+    hdr.channels  = a->wav_spec[1];
+    hdr.rate      = a->wav_spec[0];
+    hdr.bits      = a->wav_spec[2] == AUDIO_FMT_S16 ? 16 : 8;
+    hdr.align     = hdr.channels * hdr.bits / 8;
+    hdr.byte_rate = hdr.rate * hdr.align;
+    memcpy(hdr.data, "data", 4);
+    hdr.data_size = a->wav_bytes;
+    fseek(a->wav, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, a->wav);
+    fclose(a->wav);
+    a->wav = NULL;
+}
+
+// 0xF0000400 audio registers, the samples written to the data register go to the fifo as they are
+static uint32_t dev_audio_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach  = opaque;
+    RVAUDIO   *a     = &mach->audio;
+    RISCV     *riscv = riscv_io_hart;
+    uint32_t   level, status;
+    riscv_audio_sync(a, riscv->icount + riscv->io_retired + riscv->idle);
+    level = riscv_ring_count(&a->ring);
+    switch (offset) {
+    case 0x00: return a->rate;
+    case 0x04: return a->channels;
+    case 0x08: return a->format;
+    case 0x0C: return a->ctrl;
+    case 0x14: // a loop polling for room is idle until the sink took enough
+        if (level >= a->threshold) riscv->status |= TS_WAIT;
+        return level;
+    case 0x18: return a->threshold;
+    case 0x1C:
+        status = (level < a->threshold ? AUDIO_STATUS_LOW : 0) | (a->overrun ? AUDIO_STATUS_OVERRUN : 0)
+               | (atomic_exchange(&a->underrun, 0) ? AUDIO_STATUS_UNDERRUN : 0);
+        a->overrun = 0;
+        if (!(status & AUDIO_STATUS_LOW)) riscv->status |= TS_WAIT;
+        return status;
+    case 0x20: return AUDIO_RING_SIZE;
+    }
+    return 0;
+}
+
+static void dev_audio_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach  = opaque;
+    RVAUDIO   *a     = &mach->audio;
+    RISCV     *riscv = riscv_io_hart;
+    uint64_t   time  = riscv->icount + riscv->io_retired + riscv->idle;
+    uint32_t   ctrl  = a->ctrl;
+    riscv_audio_sync(a, time);
+    switch (offset) {
+    case 0x00: a->rate     = data < 8000 ? 8000 : data > 48000 ? 48000 : data; break;
+    case 0x04: a->channels = data < 1 ? 1 : data > 2 ? 2 : data; break;
+    case 0x08: a->format   = data == AUDIO_FMT_S16 ? AUDIO_FMT_S16 : AUDIO_FMT_U8; break;
+    case 0x0C: a->ctrl     = data & (AUDIO_CTRL_ENABLE | AUDIO_CTRL_IRQ_EN); break;
+    case 0x10: // a sample that does not fit whole is dropped, the fifo never blocks the guest
+        if (AUDIO_RING_SIZE - riscv_ring_count(&a->ring) < (uint32_t)size) a->overrun = 1;
+        else riscv_ring_push(&a->ring, &data, size);
+        return;
+    case 0x18: a->threshold = data < AUDIO_RING_SIZE ? data : AUDIO_RING_SIZE; break;
+    default: return;
+    }
+    if (offset < 0x0C ? (a->ctrl & AUDIO_CTRL_ENABLE) : offset == 0x0C && ((a->ctrl ^ ctrl) & AUDIO_CTRL_ENABLE)) riscv_audio_restart(a, time);
+    riscv->status |= TS_IRQ;
+}
+
+// ram offset of the syscall buffer addr..addr+len, which may also be in the mirror at 0x80000000, -1 if not all ram
+static int64_t riscv_sys_ram(RISCV *riscv, uint32_t addr, uint32_t len)
+{
+    if (addr >= 0x80000000) addr -= 0x80000000;
+    return addr <= riscv->mem_size && len <= riscv->mem_size - addr ? (int64_t)addr : -1;
+}
+
+// a syscall result from the host, recorded and replayed like a device read so -R/-P also cover the syscalls
+static int32_t riscv_sys_ret(RISCV *riscv, int32_t ret)
+{
+    return riscv->mach->iolog ? (int32_t)riscv_iolog_read(riscv, ret) : ret;
+}
+
+// the host stores len bytes at ram offset off: decoded code there is dropped and the pages are dirty
+static void riscv_ram_stored(RISCV *riscv, uint32_t off, uint32_t len)
+{
+    uint32_t i, n;
+    for (i = 0; i < len; i += n) { // riscv_code_written looks at the first and the last granule only
+        n = (1 << CODEMAP_SHIFT) - ((off + i) & ((1 << CODEMAP_SHIFT) - 1));
+        if (n > len - i) n = len - i;
+        riscv_code_written(riscv, off + i, n);
+    }
+}
+
+// after a syscall stored len bytes at ram offset off: decoded code there is dropped and the bytes go through the log
+static void riscv_sys_stored(RISCV *riscv, uint32_t off, uint32_t len)
+{
+    uint32_t i, n, v;
+    riscv_ram_stored(riscv, off, len);
+    if (!riscv->mach->iolog) return;
+    for (i = 0; i < len; i += n) {
+        n = len - i < 4 ? len - i : 4;
+        v = 0;
+        memcpy(&v, riscv->mem + off + i, n);
+        v = riscv_iolog_read(riscv, v);
+        memcpy(riscv->mem + off + i, &v, n);
+    }
+}
+
+static void riscv_dma_init(RVDMA *d, RVKBD *kbd)
+{
+    d->kbd = kbd;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init (&d->cond, NULL);
+}
+
+static void riscv_dma_job(RVDMA *d)
+{
+    if (d->job_src) memmove(d->job_dst, d->job_src, d->job_len);
+    else            memset (d->job_dst, d->job_fill, d->job_len);
+}
+
+static void* riscv_dma_thread(void *arg)
+{
+    RVDMA *d = arg;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (!d->quit && !(atomic_load(&d->status) & DMA_STATUS_BUSY)) pthread_cond_wait(&d->cond, &d->lock);
+        if (d->quit) break;
+        pthread_mutex_unlock(&d->lock);
+        riscv_dma_job(d);
+        pthread_mutex_lock(&d->lock);
+        atomic_store(&d->status, DMA_STATUS_DONE);
+        pthread_cond_broadcast(&d->cond);
+        riscv_kbd_wake(d->kbd);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+static int riscv_dma_busy(RVDMA *d)
+{
+    return !!(atomic_load(&d->status) & DMA_STATUS_BUSY);
+}
+
+// waits for the transfer on the helper thread, the guest starts another or the host needs the ram as it is
+static void riscv_dma_wait(RVDMA *d)
+{
+    pthread_mutex_lock(&d->lock);
+    while (atomic_load(&d->status) & DMA_STATUS_BUSY) pthread_cond_wait(&d->cond, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void riscv_dma_free(RVDMA *d)
+{
+    if (d->thread_ok) {
+        pthread_mutex_lock(&d->lock);
+        d->quit = 1;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->thread, NULL);
+        d->thread_ok = 0;
+    }
+    pthread_cond_destroy (&d->cond);
+    pthread_mutex_destroy(&d->lock);
+}
+
+static int riscv_dma_irq(RVDMA *d)
+{
+    return (d->op & DMA_OP_IRQ) && (atomic_load_explicit(&d->status, memory_order_relaxed) & DMA_STATUS_DONE);
+}
+
+// where the controller finds len bytes at addr: in ram at *off with *region NULL, or all inside one device region,
+// -1 if neither, the controller does not transfer to or from its own registers
+static int riscv_dma_span(RISCV *riscv, uint32_t addr, uint32_t len, RVREGION **region, uint32_t *off)
+{
+    int64_t   ram = riscv_sys_ram(riscv, addr, len);
+    RVREGION *r;
+    if (ram >= 0) {
+        *region = NULL;
+        *off    = (uint32_t)ram;
+        return 0;
+    }
+    r = riscv_bus_find(riscv->mach, addr);
+    if (!r || r->ram >= 0 || strcmp(r->name, "dma") == 0 || len > r->size - (addr - r->base)) return -1;
+    *region = r;
+    *off    = addr - r->base;
+    return 0;
+}
+
+// ram to ram transfers are a host memmove or memset, on the helper thread if the guest asked for it, a device on
+// either side, e.g. the framebuffer, goes through its callbacks a word at a time where it can
+static void riscv_dma_start(RISCV *riscv, RVDMA *d, uint32_t op)
+{
+    RVREGION *rs = NULL, *rd;
+    uint8_t  *mem  = riscv->mach->mem;
+    uint32_t  fill = op & DMA_OP_FILL, so = 0, doff, unit, i, n, v;
+    riscv_dma_wait(d);
+    d->op = op;
+    if (riscv_dma_span(riscv, d->dst, d->len, &rd, &doff) < 0 || (!fill && riscv_dma_span(riscv, d->src, d->len, &rs, &so) < 0)) {
+        atomic_store(&d->status, DMA_STATUS_DONE | DMA_STATUS_ERROR);
+        return;
+    }
+    if (!rd) riscv_ram_stored(riscv, doff, d->len);
+    if (!rd && !rs) {
+        d->job_dst  = mem + doff;
+        d->job_src  = fill ? NULL : mem + so;
+        d->job_len  = d->len;
+        d->job_fill = d->fill;
+        // replay needs the guest to see the same memory at the same instruction, the transfer runs at once then
+        if ((op & DMA_OP_ASYNC) && !riscv->mach->iolog
+         && (d->thread_ok || (d->thread_ok = pthread_create(&d->thread, NULL, riscv_dma_thread, d) == 0))) {
+            pthread_mutex_lock(&d->lock);
+            atomic_store(&d->status, DMA_STATUS_BUSY);
+            pthread_cond_broadcast(&d->cond);
+            pthread_mutex_unlock(&d->lock);
+            return;
+        }
+        riscv_dma_job(d);
+        atomic_store(&d->status, DMA_STATUS_DONE);
+        return;
+    }
+    unit = (d->dst | d->len | (fill ? 0 : d->src)) & 3 ? 1 : 4;
+    for (i = 0; i < d->len; i += unit) {
+        n = !fill && d->dst > d->src ? d->len - unit - i : i; // copying upwards runs from the end like memmove
+        if (fill) v = d->fill * 0x01010101;
+        else if (rs) v = rs->read ? rs->read(rs->opaque, so + n, unit) : 0;
+        else memcpy(&v, mem + so + n, unit);
+        if (!rd) memcpy(mem + doff + n, &v, unit);
+        else if (rd->write) rd->write(rd->opaque, doff + n, v, unit);
+    }
+    atomic_store(&d->status, DMA_STATUS_DONE);
+}
+
+// 0xF0000500 dma controller, the addresses are physical, writing the op register starts a transfer
+static uint32_t dev_dma_read(void *opaque, uint32_t offset, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVDMA     *d    = &mach->dma;
+    uint32_t   status;
+    switch (offset) {
+    case 0x00: return d->src;
+    case 0x04: return d->dst;
+    case 0x08: return d->len;
+    case 0x0C: return d->fill;
+    case 0x10: return d->op;
+    case 0x14:
+        status = atomic_load(&d->status);
+        if (status & DMA_STATUS_BUSY) riscv_io_hart->status |= TS_WAIT;
+        return status;
+    }
+    return 0;
+}
+
+static void dev_dma_write(void *opaque, uint32_t offset, uint32_t data, int size)
+{
+    RVMACHINE *mach = opaque;
+    RVDMA     *d    = &mach->dma;
+    switch (offset) {
+    case 0x00: d->src  = data; break;
+    case 0x04: d->dst  = data; break;
+    case 0x08: d->len  = data; break;
+    case 0x0C: d->fill = data & 0xFF; break;
+    case 0x10:
+        riscv_dma_start(riscv_io_hart, d, data & (DMA_OP_FILL | DMA_OP_ASYNC | DMA_OP_IRQ));
+        riscv_io_hart->status |= TS_IRQ;
+        break;
+    case 0x14: atomic_fetch_and(&d->status, ~(data & (DMA_STATUS_DONE | DMA_STATUS_ERROR))); break; // write 1 to clear
+    }
+}
+
+// host fd of guest fd 3 and up, -1 if it is not open
+static int riscv_sys_fd(RVMACHINE *mach, uint32_t fd)
+{
+    return fd >= 3 && fd - 3 < SYS_MAX_FILES ? mach->files[fd - 3] - 1 : -1;
+}
+
+// a path that is absolute or has a .. component could leave the files root
+static int riscv_sys_escapes(const char *path)
+{
+    const char *p;
+    if (path[0] == '/') return 1;
+    for (p = path; (p = strstr(p, "..")); p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) return 1;
+    }
+    return 0;
+}
+
+// the path is relative to the files root or a directory the guest opened under it, the flags are the riscv linux ones,
+// symbolic links inside the root are still followed
+static int32_t riscv_sys_openat(RISCV *riscv, uint32_t dirfd, uint32_t path, uint32_t flags, uint32_t mode)
+{
+    RVMACHINE *mach  = riscv->mach;
+    int64_t    off   = riscv_sys_ram(riscv, path, 0);
+    int        hflags = (flags & 3) | O_CLOEXEC, dir = (int32_t)dirfd == -100 ? mach->files_root : riscv_sys_fd(mach, dirfd), fd, i;
+    int32_t    ret;
+    if (off < 0 || !memchr(riscv->mem + off, 0, riscv->mem_size - off)) return -EFAULT;
+    if (dir == -1) return -EBADF;
+    if (riscv_sys_escapes((char*)riscv->mem + off)) return -EACCES;
+    if (flags & 00100) hflags |= O_CREAT;
+    if (flags & 00200) hflags |= O_EXCL;
+    if (flags & 01000) hflags |= O_TRUNC;
+    if (flags & 02000) hflags |= O_APPEND;
+    pthread_mutex_lock(&mach->iolock);
+    for (i = 0; i < SYS_MAX_FILES && mach->files[i]; i++);
+    if (i == SYS_MAX_FILES) {
+        ret = -EMFILE;
+    } else if ((fd = openat(dir, (char*)riscv->mem + off, hflags, mode & 0777)) < 0) {
+        ret = -errno;
+    } else {
+        mach->files[i] = fd + 1;
+        ret = i + 3;
+    }
+    pthread_mutex_unlock(&mach->iolock);
+    return ret;
+}
+
+// closing fds 0 to 2 leaves the console alone
+static int32_t riscv_sys_close(RVMACHINE *mach, uint32_t fd)
+{
+    int host = riscv_sys_fd(mach, fd);
+    if (fd < 3) return 0;
+    if (host < 0) return -EBADF;
+    pthread_mutex_lock(&mach->iolock);
+    mach->files[fd - 3] = 0;
+    pthread_mutex_unlock(&mach->iolock);
+    return close(host) < 0 ? -errno : 0;
+}
+
+static int32_t riscv_sys_lseek(RVMACHINE *mach, uint32_t fd, uint32_t offset, uint32_t whence)
+{
+    int   host = riscv_sys_fd(mach, fd);
+    off_t pos;
+    if (host < 0) return fd < 3 ? -ESPIPE : -EBADF;
+    if ((pos = lseek(host, (int32_t)offset, whence)) < 0) return -errno;
+    return pos > INT32_MAX ? -EOVERFLOW : (int32_t)pos;
+}
+
+// fd 0 reads the keyboard like a terminal in canonical mode, up to a line, blocking for the first byte only and echoed
+static int32_t riscv_sys_read(RISCV *riscv, uint32_t fd, uint32_t buf, uint32_t len)
+{
+    RVMACHINE *mach = riscv->mach;
+    int64_t    off  = riscv_sys_ram(riscv, buf, len);
+    uint8_t   *p;
+    uint32_t   n = 0;
+    ssize_t    r;
+    int        c, host;
+    if (off < 0) return -EFAULT;
+    p = riscv->mem + off;
+    if (fd == 0) {
+        pthread_mutex_lock(&mach->iolock);
+        riscv_io_hart = riscv;
+        while (n < len && (c = riscv_kbd_getc(&mach->kbd, n == 0)) >= 0) {
+            p[n++] = c;
+            riscv_con_write(mach, c);
+            if (c == '\n') break;
+        }
+        if (n) riscv_con_write(mach, -1);
+        pthread_mutex_unlock(&mach->iolock);
+        return n;
+    }
+    if ((host = riscv_sys_fd(mach, fd)) < 0) return -EBADF;
+    return (r = read(host, p, len)) < 0 ? -errno : (int32_t)r;
+}
+
+// fd 1 writes the console, fd 2 the host stderr, files are left alone while replaying
+static int32_t riscv_sys_write(RISCV *riscv, uint32_t fd, uint32_t buf, uint32_t len, int replay)
+{
+    RVMACHINE *mach = riscv->mach;
+    int64_t    off  = riscv_sys_ram(riscv, buf, len);
+    uint8_t   *p;
+    uint32_t   i;
+    ssize_t    r;
+    int        host;
+    if (off < 0) return -EFAULT;
+    p = riscv->mem + off;
+    if (fd == 1 || fd == 2) {
+        pthread_mutex_lock(&mach->iolock);
+        if (fd == 2) {
+            fwrite(p, 1, len, stderr);
+        } else if (mach->con.mode == CON_MODE_VRAM) {
+            for (i = 0; i < len; i++) riscv_con_write(mach, p[i]);
+        } else {
+            fwrite(p, 1, len, mach->out);
+            riscv_con_write(mach, -1);
+        }
+        pthread_mutex_unlock(&mach->iolock);
+        return len;
+    }
+    if (replay) return 0;
+    if ((host = riscv_sys_fd(mach, fd)) < 0) return -EBADF;
+    return (r = write(host, p, len)) < 0 ? -errno : (int32_t)r;
+}
+
+// the 128 byte kernel_stat of libgloss, fds 0 to 2 are character devices so newlib line buffers stdout
+static int32_t riscv_sys_fstat(RISCV *riscv, uint32_t fd, uint8_t *p)
+{
+    struct stat st;
+    uint32_t    w[32] = { 0 };
+    int         host  = riscv_sys_fd(riscv->mach, fd);
+    if (fd < 3) {
+        memset(&st, 0, sizeof(st));
+        st.st_mode    = S_IFCHR | 0620;
+        st.st_nlink   = 1;
+        st.st_blksize = 1024;
+    } else if (host < 0) {
+        return -EBADF;
+    } else if (fstat(host, &st) < 0) {
+        return -errno;
+    }
+    w[0 ] = st.st_dev;
+    w[2 ] = st.st_ino;
+    w[4 ] = st.st_mode;
+    w[5 ] = st.st_nlink;
+    w[6 ] = st.st_uid;
+    w[7 ] = st.st_gid;
+    w[8 ] = st.st_rdev;
+    w[12] = st.st_size;
+    w[13] = (uint64_t)st.st_size >> 32;
+    w[14] = st.st_blksize;
+    w[16] = st.st_blocks;
+    w[17] = (uint64_t)st.st_blocks >> 32;
+    w[18] = st.st_atim.tv_sec; w[19] = (uint64_t)st.st_atim.tv_sec >> 32; w[20] = st.st_atim.tv_nsec;
+    w[22] = st.st_mtim.tv_sec; w[23] = (uint64_t)st.st_mtim.tv_sec >> 32; w[24] = st.st_mtim.tv_nsec;
+    w[26] = st.st_ctim.tv_sec; w[27] = (uint64_t)st.st_ctim.tv_sec >> 32; w[28] = st.st_ctim.tv_nsec;
+    memcpy(p, w, sizeof(w));
+    return 0;
+}
+
+// a timespec or timeval with the 64 bit tv_sec of newlib, the realtime clock is the host one, the others run on the
+// time of the hart like mtime
+static void riscv_sys_clock(RISCV *riscv, uint32_t clk, uint8_t *p, int usec)
+{
+    struct timespec ts;
+    uint64_t        t = riscv->icount + riscv->io_retired + riscv->idle;
+    uint32_t        w[4] = { 0 };
+    if (clk == 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+    } else {
+        ts.tv_sec  = t / RISCV_CPU_FREQ;
+        ts.tv_nsec = t % RISCV_CPU_FREQ * (1000000000 / RISCV_CPU_FREQ);
+    }
+    w[0] = ts.tv_sec;
+    w[1] = (uint64_t)ts.tv_sec >> 32;
+    w[2] = usec ? ts.tv_nsec / 1000 : ts.tv_nsec;
+    memcpy(p, w, sizeof(w));
+}
+
+// the newlib and pk syscalls with their riscv linux numbers, errors return -errno, buffers are copied straight between
+// ram and the host fds, replaying skips the host calls and takes the results from the log
+static uint32_t handle_ecall(RISCV *riscv)
+{
+    RVMACHINE *mach   = riscv->mach;
+    uint32_t  *a      = riscv->x + 10, nr = riscv->x[17];
+    int        replay = mach->iolog && mach->iolog->replay;
+    int64_t    off;
+    int32_t    ret;
+    switch (nr) {
+    case 56: return riscv_sys_ret(riscv, replay ? 0 : riscv_sys_openat(riscv, a[0], a[1], a[2], a[3]));
+    case 57: return riscv_sys_ret(riscv, replay ? 0 : riscv_sys_close(mach, a[0]));
+    case 62: return riscv_sys_ret(riscv, replay ? 0 : riscv_sys_lseek(mach, a[0], a[1], a[2]));
+    case 63: // read
+        ret = riscv_sys_ret(riscv, replay ? 0 : riscv_sys_read(riscv, a[0], a[1], a[2]));
+        if (ret > 0) riscv_sys_stored(riscv, riscv_sys_ram(riscv, a[1], ret), ret);
+        return ret;
+    case 64: return riscv_sys_ret(riscv, riscv_sys_write(riscv, a[0], a[1], a[2], replay));
+    case 80: // fstat
+        if ((off = riscv_sys_ram(riscv, a[1], 128)) < 0) return -EFAULT;
+        ret = riscv_sys_ret(riscv, replay ? 0 : riscv_sys_fstat(riscv, a[0], riscv->mem + off));
+        if (ret == 0) riscv_sys_stored(riscv, off, 128);
+        return ret;
+    case 113: case 403: case 169: // clock_gettime, clock_gettime64 and gettimeofday
+        if ((off = riscv_sys_ram(riscv, a[nr != 169], 16)) < 0) return -EFAULT;
+        if (!replay) riscv_sys_clock(riscv, nr == 169 ? 0 : a[0], riscv->mem + off, nr == 169);
+        riscv_sys_stored(riscv, off, 16);
+        return 0;
+    case 214: // brk, a break outside ram stays where it was, brk(0) asks for it
+        if (a[0] && riscv_sys_ram(riscv, a[0], 0) >= 0) mach->heap = a[0];
+        return mach->heap;
+    case 93: case 94: // exit and exit_group, the first hart to exit sets the exit code and stops the others
+        riscv->status |= TS_EXIT;
+        if (!atomic_exchange(&mach->exited, 1)) mach->exit_code = a[0];
+        riscv_stop(mach);
+        return 0;
+    default: return -ENOSYS;
+    }
+}
+
+// the interrupt lines of the hart as mip shows them
+static uint32_t riscv_irq_lines(RISCV *riscv, uint64_t time)
+{
+    RVKBD *kbd = &riscv->mach->kbd;
+    return (time >= riscv->mtimecmp ? MIP_MTIP : 0) | (atomic_load_explicit(&riscv->msip, memory_order_relaxed) ? MIP_MSIP : 0)
+         | (((kbd->ctrl & KBD_CTRL_IRQ_EN) && riscv_kbd_ready(kbd)) || riscv_audio_irq(&riscv->mach->audio, time) || riscv_dma_irq(&riscv->mach->dma) ? MIP_MEIP : 0);
+}
+
+// the counters run live off icount and idle, mip off the interrupt lines and the supervisor interrupts software set,
+// the supervisor csrs are views of the machine ones
+static uint32_t riscv_csr_read(RISCV *riscv, uint32_t csr)
+{
+    uint64_t insts = riscv->icount + riscv->io_retired;
+    switch (csr) {
+    case CSR_MCYCLE  : case CSR_CYCLE  : case CSR_TIME : return (uint32_t) (insts + riscv->idle);
+    case CSR_MCYCLEH : case CSR_CYCLEH : case CSR_TIMEH: return (uint32_t)((insts + riscv->idle) >> 32);
+    case CSR_MINSTRET: case CSR_INSTRET : return (uint32_t) insts;
+    case CSR_MINSTRETH: case CSR_INSTRETH: return (uint32_t)(insts >> 32);
+    case CSR_MIP     : return riscv_irq_lines(riscv, insts + riscv->idle) | riscv->csr[CSR_MIP];
+    case CSR_SIP     : return (riscv_irq_lines(riscv, insts + riscv->idle) | riscv->csr[CSR_MIP]) & riscv->csr[CSR_MIDELEG];
+    case CSR_SIE     : return riscv->csr[CSR_MIE] & riscv->csr[CSR_MIDELEG];
+    case CSR_SSTATUS : return riscv->csr[CSR_MSTATUS] & SSTATUS_MASK;
+    case CSR_FFLAGS  : return riscv->csr[CSR_FCSR] & 0x1f;
+    case CSR_FRM     : return (riscv->csr[CSR_FCSR] >> 5) & 7;
+    }
+    return riscv->csr[csr];
+}
+
+// the counters are read only, mip only holds the supervisor interrupts, fflags and frm are fields of fcsr, a satp write
+// or a change of the page permissions mstatus grants flushes the tlb
+static void riscv_csr_write(RISCV *riscv, uint32_t csr, uint32_t data)
+{
+    uint32_t old = riscv->csr[CSR_MSTATUS];
+    switch (csr) {
+    case CSR_MCYCLE  : case CSR_MCYCLEH  : case CSR_CYCLE  : case CSR_CYCLEH  : case CSR_TIME: case CSR_TIMEH:
+    case CSR_MINSTRET: case CSR_MINSTRETH: case CSR_INSTRET: case CSR_INSTRETH:
+        return;
+    case CSR_FFLAGS: data = (riscv->csr[CSR_FCSR] & ~0x1f) | (data & 0x1f); csr = CSR_FCSR; break;
+    case CSR_FRM   : data = (riscv->csr[CSR_FCSR] & 0x1f) | ((data & 7) << 5); csr = CSR_FCSR; break;
+    case CSR_FCSR  : data &= 0xff; break;
+    case CSR_SIP   : data = (riscv->csr[CSR_MIP] & ~(riscv->csr[CSR_MIDELEG] & MIP_SSIP)) | (data & riscv->csr[CSR_MIDELEG] & MIP_SSIP); csr = CSR_MIP; break;
+    case CSR_SIE   : data = (riscv->csr[CSR_MIE] & ~riscv->csr[CSR_MIDELEG]) | (data & riscv->csr[CSR_MIDELEG]); csr = CSR_MIE; break;
+    case CSR_SSTATUS: data = (old & ~SSTATUS_MASK) | (data & SSTATUS_MASK); csr = CSR_MSTATUS; break;
+    case CSR_MIP    : data &= MIP_SMASK; break;
+    case CSR_MIDELEG: data &= MIP_SMASK; break;
+    case CSR_SATP   :
+        riscv->csr[csr] = data;
+        riscv_tlb_flush(riscv);
+        riscv_vm_update(riscv);
+        return;
+    }
+    if (csr == CSR_MSTATUS && (data & MSTATUS_MPP) == (2 << 11)) data &= ~MSTATUS_MPP; // no hypervisor mode, mpp reads user
+    if (csr == CSR_MSTATUS) data = (data & ~MSTATUS_SD) | ((data & MSTATUS_FS) == MSTATUS_FS ? MSTATUS_SD : 0); // sd sums up fs
+    riscv->csr[csr] = data;
+    switch (csr) {
+    case CSR_FCSR:
+        riscv_fp_dirty(riscv);
+        break;
+    case CSR_MSTATUS:
+        if ((old ^ data) & (MSTATUS_SUM | MSTATUS_MXR)) riscv_tlb_flush(riscv);
+        riscv_vm_update(riscv);
+        // fall through
+    case CSR_MIE: case CSR_MIP: case CSR_MIDELEG:
+        riscv->status |= TS_IRQ;
+        break;
+    }
+}
+
+// csrrw, csrrs and csrrc by funct3 & 3, src is the register value or the immediate, returns the old value, a csr above
+// the privilege of the hart, satp under mstatus.tvm and the fp csrs while mstatus.fs is off are illegal instructions
+static uint32_t riscv_csr_op(RISCV *riscv, uint32_t funct3, uint32_t csr, uint32_t src)
+{
+    uint32_t old;
+    if (((csr >> 8) & 3) > riscv->priv || (csr == CSR_SATP && riscv->priv == PRIV_S && (riscv->csr[CSR_MSTATUS] & MSTATUS_TVM))
+     || (csr >= CSR_FFLAGS && csr <= CSR_FCSR && !(riscv->csr[CSR_MSTATUS] & MSTATUS_FS))) {
+        riscv_raise(riscv, CAUSE_ILLEGAL, 0);
+        return 0;
+    }
+    old = riscv_csr_read(riscv, csr);
+    switch (funct3 & 3) {
+    case 1: riscv_csr_write(riscv, csr, src); break;
+    case 2: if (src) riscv_csr_write(riscv, csr, old |  src); break;
+    case 3: if (src) riscv_csr_write(riscv, csr, old & ~src); break;
+    }
+    return old;
+}
+
+// trap entry at pc for an exception or, with bit 31 of cause set, an interrupt, traps below machine mode that medeleg
+// or mideleg hand to supervisor mode go there
+static void riscv_trap(RISCV *riscv, uint32_t cause, uint32_t tval)
+{
+    uint32_t status = riscv->csr[CSR_MSTATUS], code = cause & 31, vec;
+    if (riscv->priv < PRIV_M && (riscv->csr[cause >> 31 ? CSR_MIDELEG : CSR_MEDELEG] >> code) & 1) {
+        riscv->csr[CSR_SEPC   ] = riscv->pc;
+        riscv->csr[CSR_SCAUSE ] = cause;
+        riscv->csr[CSR_STVAL  ] = tval;
+        riscv->csr[CSR_MSTATUS] = (status & ~(MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP)) | (status & MSTATUS_SIE ? MSTATUS_SPIE : 0) | (riscv->priv << 8);
+        vec = riscv->csr[CSR_STVEC];
+        riscv->priv = PRIV_S;
+    } else {
+        riscv->csr[CSR_MEPC   ] = riscv->pc;
+        riscv->csr[CSR_MCAUSE ] = cause;
+        riscv->csr[CSR_MTVAL  ] = tval;
+        riscv->csr[CSR_MSTATUS] = (status & ~(MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP)) | (status & MSTATUS_MIE ? MSTATUS_MPIE : 0) | (riscv->priv << 11);
+        vec = riscv->csr[CSR_MTVEC];
+        riscv->priv = PRIV_M;
+    }
+    riscv->pc         = (vec & ~3) + ((vec & 3) == 1 && (cause >> 31) ? 4 * code : 0); // direct or vectored
+    riscv->resv_valid = 0;
+    riscv->status     = (riscv->status & ~TS_TRAP) | TS_IRQ;
+    riscv_vm_update(riscv);
+}
+
+// mret and sret go back to the privilege mode the trap came from, below machine mode mstatus.mprv is cleared
+static void riscv_mret(RISCV *riscv)
+{
+    uint32_t status = riscv->csr[CSR_MSTATUS], priv = (status & MSTATUS_MPP) >> 11;
+    status = (status & ~(MSTATUS_MIE | MSTATUS_MPP)) | (status & MSTATUS_MPIE ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+    riscv->csr[CSR_MSTATUS] = priv == PRIV_M ? status : status & ~MSTATUS_MPRV;
+    riscv->priv    = priv;
+    riscv->pc      = riscv->csr[CSR_MEPC] & ~1;
+    riscv->status |= TS_IRQ;
+    riscv_vm_update(riscv);
+}
+
+static void riscv_sret(RISCV *riscv)
+{
+    uint32_t status = riscv->csr[CSR_MSTATUS];
+    riscv->priv = (status & MSTATUS_SPP) >> 8;
+    riscv->csr[CSR_MSTATUS] = (status & ~(MSTATUS_SIE | MSTATUS_SPP | MSTATUS_MPRV)) | (status & MSTATUS_SPIE ? MSTATUS_SIE : 0) | MSTATUS_SPIE;
+    riscv->pc      = riscv->csr[CSR_SEPC] & ~1;
+    riscv->status |= TS_IRQ;
+    riscv_vm_update(riscv);
+}
+
+// of the pending interrupts the ones the hart takes at its privilege: machine ones below machine mode or with
+// mstatus.mie, the ones mideleg hands to supervisor mode below it or with mstatus.sie, and machine ones first
+static uint32_t riscv_irq_enabled(RISCV *riscv, uint32_t pending)
+{
+    uint32_t status = riscv->csr[CSR_MSTATUS], m = pending & ~riscv->csr[CSR_MIDELEG], s = pending & riscv->csr[CSR_MIDELEG];
+    if (riscv->priv == PRIV_M && !(status & MSTATUS_MIE)) m = 0;
+    if (riscv->priv == PRIV_M || (riscv->priv == PRIV_S && !(status & MSTATUS_SIE))) s = 0;
+    return m ? m : s;
+}
+
+// takes a pending interrupt the hart has enabled, external before software before timer interrupts, returns the icount
+// where riscv_run_n has to look again, which is when the timer of the hart fires, the audio fifo runs low or end
+static uint64_t riscv_irq_check(RISCV *riscv, uint64_t end)
+{
+    uint64_t time = riscv->icount + riscv->idle, wait;
+    uint32_t mie  = riscv->csr[CSR_MIE], pending;
+    if (!mie) return end;
+    if ((pending = riscv_irq_enabled(riscv, (riscv_irq_lines(riscv, time) | riscv->csr[CSR_MIP]) & mie))) {
+        riscv_trap(riscv, 0x80000000 | (pending & MIP_MEIP ? 11 : pending & MIP_MSIP ? 3 : pending & MIP_MTIP ? 7
+                                      : pending & MIP_SEIP ?  9 : pending & MIP_SSIP ? 1 : 5), 0);
+        return end;
+    }
+    if ((mie & MIP_MTIP) && riscv_irq_enabled(riscv, MIP_MTIP) && riscv->mtimecmp - time < end - riscv->icount) end = riscv->icount + (riscv->mtimecmp - time);
+    if ((mie & MIP_MEIP) && (riscv->mach->audio.ctrl & AUDIO_CTRL_IRQ_EN) && riscv_irq_enabled(riscv, MIP_MEIP)
+     && (wait = riscv_audio_wait(&riscv->mach->audio, time)) < end - riscv->icount) end = riscv->icount + wait;
+    return end;
+}
+
+// cycles until an interrupt enabled in mie wakes the hart from wfi, 0 if one is pending already, UINT64_MAX if only
+// input or another hart can wake it
+static uint64_t riscv_wfi_cycles(RISCV *riscv)
+{
+    uint64_t time = riscv->icount + riscv->idle, n, wait;
+    uint32_t mie  = riscv->csr[CSR_MIE];
+    if ((riscv_irq_lines(riscv, time) | riscv->csr[CSR_MIP]) & mie) return 0;
+    n = (mie & MIP_MTIP) ? riscv->mtimecmp - time : UINT64_MAX;
+    if ((mie & MIP_MEIP) && (riscv->mach->audio.ctrl & AUDIO_CTRL_IRQ_EN) && (wait = riscv_audio_wait(&riscv->mach->audio, time)) < n) n = wait;
+    return n;
+}
+
+static uint32_t riscv_amo_op(uint32_t funct5, uint32_t a, uint32_t b)
+{
+    switch (funct5) {
+    case 0x01: return b;                               // amoswap.w
+    case 0x00: return a + b;                           // amoadd.w
+    case 0x04: return a ^ b;                           // amoxor.w
+    case 0x0c: return a & b;                           // amoand.w
+    case 0x08: return a | b;                           // amoor.w
+    case 0x10: return (int32_t)a < (int32_t)b ? a : b; // amomin.w
+    case 0x14: return (int32_t)a > (int32_t)b ? a : b; // amomax.w
+    case 0x18: return a < b ? a : b;                   // amominu.w
+    case 0x1c: return a > b ? a : b;                   // amomaxu.w
+    }
+    return a;
+}
+
+// lr.w, sc.w and the amos, returns the value for rd, aligned words in ram are accessed with host atomics, the
+// reservation is of the physical address
+static uint32_t riscv_amo32(RISCV *riscv, uint32_t funct5, uint32_t addr, uint32_t src)
+{
+    uint32_t  offset, old;
+    uint32_t *p;
+
+    if (riscv->trace) riscv_trace_data(riscv->trace, funct5 == 0x02 ? TRACE_LOAD : TRACE_STORE, addr, 4);
+    if ((riscv->vm & VM_DATA) && riscv_vm_translate(riscv, addr, funct5 == 0x02 ? ACC_LOAD : ACC_STORE, &addr) < 0) return 0;
+    if (funct5 == 0x03 && !(riscv->resv_valid && riscv->resv_addr == addr)) {
+        riscv->resv_valid = 0;
+        return 1;
+    }
+    if ((addr & 3) || !riscv_bus_ram(riscv, addr, &offset)) { // devices and misaligned words, not atomic
+        old = riscv_phys_read(riscv, addr, 4);
+        switch (funct5) {
+        case 0x02: break;
+        case 0x03:
+            if (old == riscv->resv_val) { riscv_phys_write(riscv, addr, src, 4); old = 0; } else old = 1;
+            break;
+        default: riscv_phys_write(riscv, addr, riscv_amo_op(funct5, old, src), 4); break;
+        }
+    } else {
+        p = (uint32_t*)(riscv->mem + offset);
+        if (funct5 != 0x02) riscv_code_written(riscv, offset, 4);
+        switch (funct5) {
+        case 0x02: old = __atomic_load_n(p, __ATOMIC_SEQ_CST); break;
+        case 0x03: // the reservation is the value lr.w saw, an aba sequence on another hart goes unnoticed
+            old = riscv->resv_val;
+            old = !__atomic_compare_exchange_n(p, &old, src, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            break;
+        case 0x01: old = __atomic_exchange_n(p, src, __ATOMIC_SEQ_CST); break;
+        case 0x00: old = __atomic_fetch_add (p, src, __ATOMIC_SEQ_CST); break;
+        case 0x04: old = __atomic_fetch_xor (p, src, __ATOMIC_SEQ_CST); break;
+        case 0x0c: old = __atomic_fetch_and (p, src, __ATOMIC_SEQ_CST); break;
+        case 0x08: old = __atomic_fetch_or  (p, src, __ATOMIC_SEQ_CST); break;
+        default: // min and max have no host instruction
+            old = __atomic_load_n(p, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(p, &old, riscv_amo_op(funct5, old, src), 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+            break;
+        }
+    }
+    if (funct5 == 0x02) {
+        riscv->resv_addr  = addr;
+        riscv->resv_val   = old;
+        riscv->resv_valid = 1;
+    } else if (funct5 == 0x03) {
+        riscv->resv_valid = 0;
+    }
+    return old;
+}
+
+// the m extension results for the operands the host traps on or gets wrong, division by zero gives all ones or the
+// dividend and the overflowing division gives the dividend
+static uint32_t riscv_mulh  (uint32_t a, uint32_t b) { return (uint32_t)(((int64_t)(int32_t)a * (int32_t)b) >> 32); }
+static uint32_t riscv_mulhsu(uint32_t a, uint32_t b) { return (uint32_t)(((int64_t)(int32_t)a * (int64_t)b) >> 32); }
+static uint32_t riscv_div   (uint32_t a, uint32_t b) { return !b ? 0xffffffff : (a == 0x80000000 && b == 0xffffffff) ? a : (uint32_t)((int32_t)a / (int32_t)b); }
+static uint32_t riscv_divu  (uint32_t a, uint32_t b) { return !b ? 0xffffffff : a / b; }
+static uint32_t riscv_rem   (uint32_t a, uint32_t b) { return !b ? a : (a == 0x80000000 && b == 0xffffffff) ? 0 : (uint32_t)((int32_t)a % (int32_t)b); }
+static uint32_t riscv_remu  (uint32_t a, uint32_t b) { return !b ? a : a % b; }
+
+// the zbb results on the host builtins, which leave clz and ctz of 0 undefined
+static uint32_t riscv_clz (uint32_t a) { return a ? __builtin_clz(a) : 32; }
+static uint32_t riscv_ctz (uint32_t a) { return a ? __builtin_ctz(a) : 32; }
+static uint32_t riscv_cpop(uint32_t a) { return __builtin_popcount(a); }
+static uint32_t riscv_orcb(uint32_t a) { return ((((a & 0x7f7f7f7f) + 0x7f7f7f7f) | a) >> 7 & 0x01010101) * 0xff; } // bytes that are not 0 become 0xff
+static inline uint32_t riscv_rol(uint32_t a, uint32_t b) { return (a << (b & 0x1f)) | (a >> (-b & 0x1f)); }
+static inline uint32_t riscv_ror(uint32_t a, uint32_t b) { return (a >> (b & 0x1f)) | (a << (-b & 0x1f)); }
+
+#define FP_BOX    0xffffffff00000000ull
+#define FP_NAN_S  0x7fc00000u
+#define FP_NAN_D  0x7ff8000000000000ull
+#define FP_SNAN_S(u) (((u) & 0x7fc00000u) == 0x7f800000u && ((u) & 0x003fffffu))
+#define FP_SNAN_D(u) (((u) & 0x7ff8000000000000ull) == 0x7ff0000000000000ull && ((u) & 0x0007ffffffffffffull))
+
+static float    riscv_f32 (uint32_t u) { float    f; memcpy(&f, &u, 4); return f; }
+static double   riscv_f64 (uint64_t u) { double   d; memcpy(&d, &u, 8); return d; }
+static uint32_t riscv_u32 (float    f) { uint32_t u; memcpy(&u, &f, 4); return u; }
+static uint64_t riscv_u64 (double   d) { uint64_t u; memcpy(&u, &d, 8); return u; }
+
+// single precision operand, a value that is not nan-boxed reads as the canonical nan
+static uint32_t riscv_fp_gets(RISCV *riscv, uint32_t r)
+{
+    return (riscv->f[r] >> 32) == 0xffffffff ? (uint32_t)riscv->f[r] : FP_NAN_S;
+}
+
+// arithmetic results, every nan becomes the canonical one
+static void riscv_fp_sets(RISCV *riscv, uint32_t r, float f)
+{
+    uint32_t u = riscv_u32(f);
+    riscv->f[r] = FP_BOX | (isnan(f) ? FP_NAN_S : u);
+}
+
+static void riscv_fp_setd(RISCV *riscv, uint32_t r, double d)
+{
+    riscv->f[r] = isnan(d) ? FP_NAN_D : riscv_u64(d);
+}
+
+// host rounding mode by rm from 0 to 3 and cleared exception flags for one instruction, x86-64 does all float math
+// in sse and mxcsr is far cheaper to go through than fenv, which saves and restores the x87 environment as well
+#if defined(__x86_64__)
+static void riscv_fp_enter(uint32_t rm)
+{
+    static const uint32_t rc[4] = { 0 << 13, 3 << 13, 1 << 13, 2 << 13 };
+    __builtin_ia32_ldmxcsr((__builtin_ia32_stmxcsr() & ~(0x3f | (3 << 13))) | rc[rm]);
+}
+
+// the fflags the instruction raised, puts back round to nearest
+static uint32_t riscv_fp_leave(uint32_t rm)
+{
+    uint32_t mxcsr = __builtin_ia32_stmxcsr();
+    if (rm) __builtin_ia32_ldmxcsr(mxcsr & ~(3 << 13));
+    return (mxcsr & 0x01 ? FFLAGS_NV : 0) | (mxcsr & 0x04 ? FFLAGS_DZ : 0) | (mxcsr & 0x08 ? FFLAGS_OF : 0)
+         | (mxcsr & 0x10 ? FFLAGS_UF : 0) | (mxcsr & 0x20 ? FFLAGS_NX : 0);
+}
+#else
+static void riscv_fp_enter(uint32_t rm)
+{
+    static const int rounding[4] = { FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD };
+    if (rm) fesetround(rounding[rm]);
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+static uint32_t riscv_fp_leave(uint32_t rm)
+{
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    if (rm) fesetround(FE_TONEAREST);
+    return (raised & FE_INVALID   ? FFLAGS_NV : 0) | (raised & FE_DIVBYZERO ? FFLAGS_DZ : 0) | (raised & FE_OVERFLOW ? FFLAGS_OF : 0)
+         | (raised & FE_UNDERFLOW ? FFLAGS_UF : 0) | (raised & FE_INEXACT   ? FFLAGS_NX : 0);
+}
+#endif
+
+// fclass mask of a value by its sign, exponent and mantissa fields
+static uint32_t riscv_fp_class(int sign, int expmax, int expzero, int manzero, int quiet)
+{
+    if (expmax ) return manzero ? (sign ? 1 << 0 : 1 << 7) : quiet ? 1 << 9 : 1 << 8;
+    if (expzero) return manzero ? (sign ? 1 << 3 : 1 << 4) : (sign ? 1 << 2 : 1 << 5);
+    return sign ? 1 << 1 : 1 << 6;
+}
+
+// fcvt.w and fcvt.wu round by rm themselves, nan and values out of range saturate and raise invalid
+static uint32_t riscv_fp_toint(double v, uint32_t rm, int sign, uint32_t *fflags)
+{
+    double r  = rm == 1 ? trunc(v) : rm == 2 ? floor(v) : rm == 3 ? ceil(v) : rm == 4 ? round(v) : nearbyint(v);
+    double lo = sign ? -2147483648.0 : 0.0, hi = sign ? 2147483647.0 : 4294967295.0;
+    if (isnan(v) || r > hi) { *fflags |= FFLAGS_NV; return sign ? 0x7fffffff : 0xffffffff; }
+    if (r < lo)             { *fflags |= FFLAGS_NV; return sign ? 0x80000000 : 0; }
+    if (r != v) *fflags |= FFLAGS_NX;
+    return sign ? (uint32_t)(int32_t)r : (uint32_t)r;
+}
+
+// fmin and fmax, a nan operand yields the other one and -0 is below +0
+static uint64_t riscv_fp_minmax(uint64_t ua, uint64_t ub, double a, double b, int max)
+{
+    if (isnan(a)) return ub;
+    if (isnan(b) || a == b) return a != b ? ua : max ? ua & ub : ua | ub;
+    return (max ? isgreater(a, b) : isless(a, b)) ? ua : ub;
+}
+
+// the f and d encodings, funct3 picks the operation where it is not a rounding mode and rs2 the conversion
+static int riscv_fp_legal(uint32_t instruction)
+{
+    const uint32_t opcode = instruction & 0x7f, funct3 = (instruction >> 12) & 7, rs2 = (instruction >> 20) & 0x1f, funct7 = instruction >> 25;
+    if (opcode == 0x07 || opcode == 0x27) return funct3 == 2 || funct3 == 3;
+    if (opcode != 0x53) return (funct7 & 3) < 2; // fused ops in single or double
+    switch (funct7) {
+    case 0x00: case 0x01: case 0x04: case 0x05: case 0x08: case 0x09: case 0x0c: case 0x0d: return 1;
+    case 0x2c: case 0x2d: return rs2 == 0;
+    case 0x10: case 0x11: case 0x50: case 0x51: return funct3 < 3;
+    case 0x14: case 0x15: return funct3 < 2;
+    case 0x20: return rs2 == 1;
+    case 0x21: return rs2 == 0;
+    case 0x60: case 0x61: case 0x68: case 0x69: return rs2 < 2;
+    case 0x70: return rs2 == 0 && funct3 < 2;
+    case 0x71: return rs2 == 0 && funct3 == 1;
+    case 0x78: return rs2 == 0 && funct3 == 0;
+    }
+    return 0;
+}
+
+// the f and d extensions on the host fpu, a static or dynamic rounding mode other than round to nearest is set on the
+// host around the instruction and the host exception flags it raised accumulate in fflags, the host has no rounding
+// to nearest with ties to max magnitude so rmm rounds ties to even but in fcvt.w, the reserved rounding modes 5 and 6
+// and a dynamic one with frm above 4 are illegal
+static void riscv_execute_fp(RISCV *riscv, uint32_t instruction)
+{
+    const uint32_t inst_opcode = (instruction >> 0) & 0x7f;
+    const uint32_t inst_rd     = (instruction >> 7) & 0x1f;
+    const uint32_t inst_funct3 = (instruction >>12) & 0x07;
+    const uint32_t inst_rs1    = (instruction >>15) & 0x1f;
+    const uint32_t inst_rs2    = (instruction >>20) & 0x1f;
+    const uint32_t inst_rs3    = (instruction >>27) & 0x1f;
+    const uint32_t inst_funct7 = (instruction >>25) & 0x7f;
+    const uint32_t inst_fmt    = (instruction >>25) & 0x03; // 0 single, 1 double
+    const uint32_t rm          = inst_funct3 == 7 ? (riscv->csr[CSR_FCSR] >> 5) & 7 : inst_funct3;
+    const uint32_t s1 = riscv_fp_gets(riscv, inst_rs1), s2 = riscv_fp_gets(riscv, inst_rs2), s3 = riscv_fp_gets(riscv, inst_rs3);
+    const uint64_t d1 = riscv->f[inst_rs1], d2 = riscv->f[inst_rs2], d3 = riscv->f[inst_rs3];
+    const float    fa = riscv_f32(s1), fb = riscv_f32(s2), fc = riscv_f32(s3);
+    const double   da = riscv_f64(d1), db = riscv_f64(d2), dc = riscv_f64(d3);
+    const int      group = inst_opcode != 0x53 ? 0 : inst_funct7 >> 4; // of the 0x53 ops, groups 0, 2 and 6 round by rm
+    const int      by_rm = group == 0 || group == 2 || group == 6;
+    const uint32_t round = by_rm && rm <= 3 ? rm : 0;
+    uint32_t maddr, fflags = 0, sign, nan, host = 1, raised, to_x;
+
+    if (!(riscv->csr[CSR_MSTATUS] & MSTATUS_FS) || !riscv_fp_legal(instruction) || (by_rm && rm > 4)) {
+        riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+        return;
+    }
+    switch (inst_opcode) {
+    case 0x07: // i-type flw & fld
+        maddr = riscv->x[inst_rs1] + signed_extend(instruction >> 20, 12);
+        if (inst_funct3 == 2) riscv_setf(riscv, inst_rd, FP_BOX | riscv_memr32(riscv, maddr));
+        if (inst_funct3 == 3) riscv_setf(riscv, inst_rd, riscv_memr64(riscv, maddr));
+        return;
+    case 0x27: // s-type fsw & fsd
+        maddr = riscv->x[inst_rs1] + signed_extend(((instruction >> 20) & (0x7f << 5)) | ((instruction >> 7) & 0x1f), 12);
+        if (inst_funct3 == 2) riscv_memw32(riscv, maddr, (uint32_t)d2);
+        if (inst_funct3 == 3) { riscv_memw32(riscv, maddr, (uint32_t)d2); riscv_memw32(riscv, maddr + 4, (uint32_t)(d2 >> 32)); }
+        return;
+    }
+
+    // inf * 0 is invalid even with a quiet nan addend, the host fma does not raise it then
+    if ((inst_opcode & 0x73) == 0x43 && (inst_fmt == 0 ? (isinf(fa) && fb == 0) || (fa == 0 && isinf(fb)) : (isinf(da) && db == 0) || (da == 0 && isinf(db)))) {
+        fflags |= FFLAGS_NV;
+    }
+    riscv_fp_enter(round);
+    switch (inst_opcode) {
+    case 0x43: // fmadd
+        if (inst_fmt == 0) riscv_fp_sets(riscv, inst_rd, fmaf( fa, fb,  fc));
+        else               riscv_fp_setd(riscv, inst_rd, fma ( da, db,  dc));
+        break;
+    case 0x47: // fmsub
+        if (inst_fmt == 0) riscv_fp_sets(riscv, inst_rd, fmaf( fa, fb, -fc));
+        else               riscv_fp_setd(riscv, inst_rd, fma ( da, db, -dc));
+        break;
+    case 0x4b: // fnmsub
+        if (inst_fmt == 0) riscv_fp_sets(riscv, inst_rd, fmaf(-fa, fb,  fc));
+        else               riscv_fp_setd(riscv, inst_rd, fma (-da, db,  dc));
+        break;
+    case 0x4f: // fnmadd
+        if (inst_fmt == 0) riscv_fp_sets(riscv, inst_rd, fmaf(-fa, fb, -fc));
+        else               riscv_fp_setd(riscv, inst_rd, fma (-da, db, -dc));
+        break;
+    case 0x53:
+        switch (inst_funct7) {
+        case 0x00: riscv_fp_sets(riscv, inst_rd, fa + fb); break; // fadd.s
+        case 0x01: riscv_fp_setd(riscv, inst_rd, da + db); break; // fadd.d
+        case 0x04: riscv_fp_sets(riscv, inst_rd, fa - fb); break; // fsub.s
+        case 0x05: riscv_fp_setd(riscv, inst_rd, da - db); break; // fsub.d
+        case 0x08: riscv_fp_sets(riscv, inst_rd, fa * fb); break; // fmul.s
+        case 0x09: riscv_fp_setd(riscv, inst_rd, da * db); break; // fmul.d
+        case 0x0c: riscv_fp_sets(riscv, inst_rd, fa / fb); break; // fdiv.s
+        case 0x0d: riscv_fp_setd(riscv, inst_rd, da / db); break; // fdiv.d
+        case 0x2c: riscv_fp_sets(riscv, inst_rd, sqrtf(fa)); break; // fsqrt.s
+        case 0x2d: riscv_fp_setd(riscv, inst_rd, sqrt (da)); break; // fsqrt.d
+        case 0x10: // fsgnj.s, fsgnjn.s & fsgnjx.s
+            sign = inst_funct3 == 0 ? s2 : inst_funct3 == 1 ? ~s2 : s1 ^ s2;
+            riscv->f[inst_rd] = FP_BOX | (s1 & 0x7fffffff) | (sign & 0x80000000);
+            break;
+        case 0x11: // fsgnj.d, fsgnjn.d & fsgnjx.d
+            sign = inst_funct3 == 0 ? d2 >> 32 : inst_funct3 == 1 ? ~d2 >> 32 : (d1 ^ d2) >> 32;
+            riscv->f[inst_rd] = (d1 & ~(1ull << 63)) | (uint64_t)(sign & 0x80000000) << 32;
+            break;
+        case 0x14: // fmin.s & fmax.s, these and the compares and fcvt.w raise their flags themselves
+            host = 0;
+            if (FP_SNAN_S(s1) || FP_SNAN_S(s2)) fflags |= FFLAGS_NV;
+            nan = isnan(fa) && isnan(fb);
+            riscv->f[inst_rd] = FP_BOX | (nan ? FP_NAN_S : (uint32_t)riscv_fp_minmax(s1, s2, fa, fb, inst_funct3));
+            break;
+        case 0x15: // fmin.d & fmax.d
+            host = 0;
+            if (FP_SNAN_D(d1) || FP_SNAN_D(d2)) fflags |= FFLAGS_NV;
+            nan = isnan(da) && isnan(db);
+            riscv->f[inst_rd] = nan ? FP_NAN_D : riscv_fp_minmax(d1, d2, da, db, inst_funct3);
+            break;
+        case 0x20: riscv_fp_sets(riscv, inst_rd, (float )da); break; // fcvt.s.d
+        case 0x21: riscv_fp_setd(riscv, inst_rd, (double)fa); break; // fcvt.d.s
+        case 0x50: // feq.s, flt.s & fle.s, only feq is quiet
+            host = 0;
+            if (inst_funct3 == 2 ? FP_SNAN_S(s1) || FP_SNAN_S(s2) : isnan(fa) || isnan(fb)) fflags |= FFLAGS_NV;
+            riscv->x[inst_rd] = inst_funct3 == 2 ? fa == fb : inst_funct3 == 1 ? isless(fa, fb) : islessequal(fa, fb);
+            break;
+        case 0x51: // feq.d, flt.d & fle.d
+            host = 0;
+            if (inst_funct3 == 2 ? FP_SNAN_D(d1) || FP_SNAN_D(d2) : isnan(da) || isnan(db)) fflags |= FFLAGS_NV;
+            riscv->x[inst_rd] = inst_funct3 == 2 ? da == db : inst_funct3 == 1 ? isless(da, db) : islessequal(da, db);
+            break;
+        case 0x60: riscv->x[inst_rd] = riscv_fp_toint(fa, rm, inst_rs2 == 0, &fflags); host = 0; break; // fcvt.w.s & fcvt.wu.s
+        case 0x61: riscv->x[inst_rd] = riscv_fp_toint(da, rm, inst_rs2 == 0, &fflags); host = 0; break; // fcvt.w.d & fcvt.wu.d
+        case 0x68: riscv_fp_sets(riscv, inst_rd, inst_rs2 ? (float )riscv->x[inst_rs1] : (float )(int32_t)riscv->x[inst_rs1]); break; // fcvt.s.w & fcvt.s.wu
+        case 0x69: riscv_fp_setd(riscv, inst_rd, inst_rs2 ? (double)riscv->x[inst_rs1] : (double)(int32_t)riscv->x[inst_rs1]); break; // fcvt.d.w & fcvt.d.wu
+        case 0x70: // fmv.x.w & fclass.s
+            riscv->x[inst_rd] = inst_funct3 == 0 ? (uint32_t)d1 : riscv_fp_class(s1 >> 31, (s1 & 0x7f800000) == 0x7f800000,
+                (s1 & 0x7f800000) == 0, (s1 & 0x7fffff) == 0, (s1 >> 22) & 1);
+            break;
+        case 0x71: // fclass.d
+            riscv->x[inst_rd] = riscv_fp_class(d1 >> 63, (d1 & 0x7ff0000000000000ull) == 0x7ff0000000000000ull,
+                (d1 & 0x7ff0000000000000ull) == 0, (d1 & 0xfffffffffffffull) == 0, (d1 >> 51) & 1);
+            break;
+        case 0x78: riscv->f[inst_rd] = FP_BOX | riscv->x[inst_rs1]; break; // fmv.w.x
+        }
+        break;
+    }
+    raised = riscv_fp_leave(round);
+    riscv->csr[CSR_FCSR] |= fflags | (host ? raised : 0);
+    // the compares, fcvt.w, fmv.x.w and fclass only write x
+    to_x = inst_opcode == 0x53 && ((inst_funct7 | 1) == 0x51 || (inst_funct7 | 1) == 0x61 || (inst_funct7 | 1) == 0x71);
+    if (!to_x || fflags || (host && raised)) riscv_fp_dirty(riscv);
+}
+
+// encodings rv32c reserves: c.addi4spn, c.addi16sp and c.lui with a zero immediate, which takes in the all-zero
+// halfword, c.lwsp to x0, c.jr of x0, shifts by 32 and more and the c.subw group of rv64
+static int riscv_rv16_reserved(uint16_t instruction)
+{
+    const uint32_t rd = (instruction >> 7) & 0x1f, rs2 = (instruction >> 2) & 0x1f, bit12 = (instruction >> 12) & 1;
+    switch (((instruction & 0x3) << 3) | (instruction >> 13)) {
+    case 0x00: return (instruction & 0x1fe0) == 0; // c.addi4spn
+    case 0x04: return 1;
+    case 0x0b: return rd != 0 && !bit12 && rs2 == 0; // c.addi16sp & c.lui
+    case 0x0c: return bit12 && ((instruction >> 10) & 3) != 2; // c.srli, c.srai & c.sub to c.and
+    case 0x10: return bit12; // c.slli
+    case 0x12: return rd == 0; // c.lwsp
+    case 0x14: return !bit12 && rd == 0 && rs2 == 0; // c.jr
+    }
+    return 0;
+}
+
+static void riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
+{
+    const uint16_t inst_opcode = (instruction >> 0) & 0x3;
+    const uint16_t inst_rd     = (instruction >> 7) & 0x1f;
+    const uint16_t inst_rs1    = (instruction >> 7) & 0x1f;
+    const uint16_t inst_rs2    = (instruction >> 2) & 0x1f;
+    const uint16_t inst_rs1s   = (instruction >> 7) & 0x7;
+    const uint16_t inst_rs2s   = (instruction >> 2) & 0x7;
+    const uint16_t inst_rds    = (instruction >> 2) & 0x7;
+    const uint16_t inst_imm6   =((instruction >> 2) & 0x1f) | ((instruction >> 7) & (1 << 5));
+    const uint16_t inst_imm7   =((instruction >> 4) & (1 << 2)) | ((instruction >> 7) & (0x7 << 3)) | ((instruction << 1) & (1 << 6));
+    const uint16_t inst_imm8   =((instruction >> 7) & (0x7 << 3)) | ((instruction << 1) & (0x3 << 6));
+    const uint16_t inst_imm9   =((instruction >> 2) & (0x3 << 3)) | ((instruction >> 7) & (1 << 5)) | ((instruction << 4) & (0x7 << 6));
+    const uint16_t inst_imm10  =((instruction >> 4) & (1 << 2)) | ((instruction >> 2) & (1 << 3)) | ((instruction >> 7) & (0x3 << 4)) | ((instruction >> 1) & (0x7 << 6));
+    const uint16_t inst_imm12  =((instruction >> 2) & (0x7 << 1)) | ((instruction >> 7) & (1 << 4)) | ((instruction << 3) & (1 << 5))
+                               |((instruction >> 1) & (0x2d << 6)) | ((instruction << 1) & (1 << 7)) | ((instruction << 2) & (1 << 10));
+    const uint32_t inst_imm18  =((instruction << 5) & (1 << 17)) | ((instruction << 10) & (0x1f << 12));
+    const uint16_t inst_funct2 = (instruction >>10) & 0x3;
+    const uint16_t inst_funct3 = (instruction >>13) & 0x7;
+    uint32_t bflag = 0, temp;
+
+    // odd funct3 of quadrants 0 and 2 are the fp loads and stores
+    if (riscv_rv16_reserved(instruction) || (inst_opcode != 1 && (inst_funct3 & 1) && !(riscv->csr[CSR_MSTATUS] & MSTATUS_FS))) {
+        riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+        return;
+    }
+    switch (inst_opcode) {
+    case 0:
+        switch (inst_funct3) {
+        case 0: riscv->x[8 + inst_rds] = riscv->x[2] + inst_imm10; break; // c.addi4spn
+        case 1: riscv_setf(riscv, 8 + inst_rds, riscv_memr64(riscv, riscv->x[8 + inst_rs1s] + inst_imm8)); break; // c.fld
+        case 2: riscv_setx(riscv, riscv->x + 8 + inst_rds, riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7)); break; // c.lw
+        case 3: riscv_setf(riscv, 8 + inst_rds, FP_BOX | riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7)); break; // c.flw
+        case 5: // c.fsd
+            riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 0, (uint32_t)(riscv->f[8 + inst_rs2s] >> 0 ));
+            riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 4, (uint32_t)(riscv->f[8 + inst_rs2s] >> 32));
+            break;
+        case 6: riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7, riscv->x[8 + inst_rs2s]); break; // c.sw
+        case 7: riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7, (uint32_t)riscv->f[8 + inst_rs2s]); break; // c.fsw
+        }
+        break;
+    case 1:
+        switch (inst_funct3) {
+        case 0: riscv->x[inst_rd] += signed_extend(inst_imm6, 6); break; // c.addi
+        case 1: // c.jal
+            riscv->x[1] = riscv->pc + 2;
+            riscv->pc  += signed_extend(inst_imm12, 12);
+            bflag = 1;
+            break;
+        case 2: riscv->x[inst_rd] = signed_extend(inst_imm6, 6); break; // c.li
+        case 3:
+            if (inst_rd == 2) { // c.addi16sp
+                temp = ((instruction >> 2) & (1 << 4)) | ((instruction << 3) & (1 << 5)) | ((instruction << 1) & (1 << 6))
+                     | ((instruction << 4) & (0x3 << 7)) | ((instruction >> 3) & (1 << 9));
+                riscv->x[inst_rd] += signed_extend(temp, 10);
+            } else { // c.lui
+                riscv->x[inst_rd]  = signed_extend(inst_imm18, 18);
+            }
+            break;
+        case 4:
+            switch (inst_funct2) {
+            case 0: riscv->x[8 + inst_rs1s] = (uint32_t)riscv->x[8 + inst_rs1s] >> inst_imm6; break; // c.srli
+            case 1: riscv->x[8 + inst_rs1s] = (int32_t )riscv->x[8 + inst_rs1s] >> inst_imm6; break; // c.srai
+            case 2: riscv->x[8 + inst_rs1s]&= signed_extend(inst_imm6, 6); break; // c.andi
+            case 3:
+                switch ((instruction >> 5) & 3) {
+                case 0: riscv->x[8 + inst_rs1s] -= riscv->x[8 + inst_rs2s]; break; // c.sub
+                case 1: riscv->x[8 + inst_rs1s] ^= riscv->x[8 + inst_rs2s]; break; // c.xor
+                case 2: riscv->x[8 + inst_rs1s] |= riscv->x[8 + inst_rs2s]; break; // c.or
+                case 3: riscv->x[8 + inst_rs1s] &= riscv->x[8 + inst_rs2s]; break; // c.and
+                }
+                break;
+            }
+            break;
+        case 5: riscv->pc += signed_extend(inst_imm12, 12); bflag = 1; break; // c.j
+        case 6: // c.beqz
+        case 7: // c.bnez
+            if ((inst_funct3 == 6 && riscv->x[8 + inst_rs1s] == 0) || (inst_funct3 == 7 && riscv->x[8 + inst_rs1s] != 0)) {
+                temp = ((instruction >> 2) & (0x3 << 1)) | ((instruction >> 7) & (0x3 << 3)) | ((instruction << 3) & (1 << 5))
+                     | ((instruction << 1) & (0x3 << 6)) | ((instruction >> 4) & (1 << 8));
+                riscv->pc += signed_extend(temp, 9);
+                bflag = 1;
+            }
+            break;
+        }
+        break;
+    case 2:
+        switch (inst_funct3) {
+        case 0: riscv->x[inst_rd] <<= inst_imm6; break; // c.slli
+        case 1: riscv_setf(riscv, inst_rd, riscv_memr64(riscv, riscv->x[2] + inst_imm9)); break; // c.fldsp
+        case 2: // c.lwsp
+        case 3: // c.flwsp
+            temp = ((instruction >> 2) & (0x7 << 2)) | ((instruction >> 7) & (1 << 5)) | ((instruction << 4) & (0x3 << 6));
+            if (inst_funct3 == 2) riscv_setx(riscv, riscv->x + inst_rd, riscv_memr32(riscv, riscv->x[2] + temp)); // c.lwsp
+            else                  riscv_setf(riscv, inst_rd, FP_BOX | riscv_memr32(riscv, riscv->x[2] + temp)); // c.flwsp
+            break;
+        case 4:
+            if ((instruction & (1 << 12)) == 0) {
+                if (inst_rs2 == 0) { // c.jr
+                    riscv->pc = riscv->x[inst_rs1]; bflag = 1;
+                } else { // c.mv
+                    riscv->x[inst_rd] = riscv->x[inst_rs2];
+                }
+            } else {
+                if (inst_rs1 == 0 && inst_rs2 == 0) { // c.ebreak
+                    riscv_raise(riscv, CAUSE_BREAKPOINT, riscv->pc);
+                } else if (inst_rs2 == 0) { // c.jalr
+                    temp        = riscv->pc + 2;
+                    riscv->pc   = riscv->x[inst_rs1];
+                    riscv->x[1] = temp;
+                    bflag       = 1;
+                } else { // c.add
+                    riscv->x[inst_rd] += riscv->x[inst_rs2];
+                }
+            }
+            break;
+        case 5: // c.fsdsp
+            temp = ((instruction >> 7) & (0x7 << 3)) | ((instruction >> 1) & (0x7 << 6));
+            riscv_memw32(riscv, riscv->x[2] + temp + 0, (uint32_t)(riscv->f[inst_rs2] >> 0 ));
+            riscv_memw32(riscv, riscv->x[2] + temp + 4, (uint32_t)(riscv->f[inst_rs2] >> 32));
+            break;
+        case 6: // c.swsp
+        case 7: // c.fswsp
+            temp = ((instruction >> 7) & (0xf << 2)) | ((instruction >> 1) & (0x3 << 6));
+            riscv_memw32(riscv, riscv->x[2] + temp, inst_funct3 == 6 ? riscv->x[inst_rs2] : (uint32_t)riscv->f[inst_rs2]);
+            break;
+        }
+        break;
+    }
+    riscv->pc += bflag ? 0 : 2;
+}
+
+static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
+{
+    const uint32_t inst_opcode = (instruction >> 0) & 0x7f;
+    const uint32_t inst_rd     = (instruction >> 7) & 0x1f;
+    const uint32_t inst_funct3 = (instruction >>12) & 0x07;
+    const uint32_t inst_rs1    = (instruction >>15) & 0x1f;
+    const uint32_t inst_rs2    = (instruction >>20) & 0x1f;
+    const uint32_t inst_funct7 = (instruction >>25) & 0x7f;
+    const uint32_t inst_imm12i = (instruction >>20) & 0xfff;
+    const uint32_t inst_imm12s =((instruction >>20) & (0x7f << 5)) | ((instruction >> 7) & 0x1f);
+    const uint32_t inst_imm13b =((instruction >>19) & (0x1  <<12)) | ((instruction << 4) & (0x1 << 11))
+                               |((instruction >>20) & (0x3f << 5)) | ((instruction >> 7) & (0xf <<  1));
+    const uint32_t inst_imm20u = instruction & (0xfffff << 12);
+    const uint32_t inst_imm21j =((instruction >> 11) & (1 << 20)) | (instruction & (0xff << 12))
+                               |((instruction >> 9 ) & (1 << 11)) | ((instruction >> 20) & (0x3ff << 1));
+    const uint32_t inst_csr    = (instruction >> 20);
+    uint32_t bflag = 0, maddr, temp, status;
+    int64_t  mult64res;
+
+    switch (inst_opcode) {
+    case 0x37: riscv->x[inst_rd] = inst_imm20u; break; // u-type lui
+    case 0x17: riscv->x[inst_rd] = riscv->pc + (int32_t)inst_imm20u; break; // u-type auipc
+    case 0x6f: // j-type jal
+        riscv->x[inst_rd] = riscv->pc + 4;
+        riscv->pc += signed_extend(inst_imm21j, 21);
+        bflag = 1;
+        break;
+    case 0x67: // i-type
+        switch (inst_funct3) {
+        case 0x0: // jalr
+            temp = riscv->pc + 4;
+            riscv->pc = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12);
+            riscv->pc&=~(1 << 0);
+            riscv->x[inst_rd] = temp;
+            bflag = 1;
+            break;
+        default: riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+        }
+        break;
+    case 0x63: // b-type
         switch (inst_funct3) {
         case 0x0: bflag = riscv->x[inst_rs1] == riscv->x[inst_rs2]; break; // beq
         case 0x1: bflag = riscv->x[inst_rs1] != riscv->x[inst_rs2]; break; // bne
@@ -391,212 +3320,2993 @@ static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
         case 0x5: bflag = (int32_t)riscv->x[inst_rs1] >= (int32_t)riscv->x[inst_rs2]; break; // bge
         case 0x6: bflag = riscv->x[inst_rs1] <  riscv->x[inst_rs2]; break; // bltu
         case 0x7: bflag = riscv->x[inst_rs1] >= riscv->x[inst_rs2]; break; // bgeu
+        default : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+        }
+        if (bflag) riscv->pc += signed_extend(inst_imm13b, 13);
+        break;
+    case 0x03: // i-type
+        maddr = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12);
+        switch (inst_funct3) {
+        case 0x0: riscv_setx(riscv, riscv->x + inst_rd, (int8_t )riscv_memr8 (riscv, maddr)); break; // lb
+        case 0x1: riscv_setx(riscv, riscv->x + inst_rd, (int16_t)riscv_memr16(riscv, maddr)); break; // lh
+        case 0x2: riscv_setx(riscv, riscv->x + inst_rd, riscv_memr32(riscv, maddr)); break; // lw
+        case 0x4: riscv_setx(riscv, riscv->x + inst_rd, riscv_memr8 (riscv, maddr)); break; // lbu
+        case 0x5: riscv_setx(riscv, riscv->x + inst_rd, riscv_memr16(riscv, maddr)); break; // lhu
+        default : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+        }
+        break;
+    case 0x23: // s-type
+        maddr = riscv->x[inst_rs1] + signed_extend(inst_imm12s, 12);
+        switch (inst_funct3) {
+        case 0x0: riscv_memw8 (riscv, maddr, (uint8_t )riscv->x[inst_rs2]); break; // sb
+        case 0x1: riscv_memw16(riscv, maddr, (uint16_t)riscv->x[inst_rs2]); break; // sh
+        case 0x2: riscv_memw32(riscv, maddr, riscv->x[inst_rs2]); break; // sw
+        default : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+        }
+        break;
+    case 0x13: // i-type
+        switch (inst_funct3) {
+        case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12); break; // addi
+        case 0x2: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] < signed_extend(inst_imm12i, 12);  break; // slti
+        case 0x3: riscv->x[inst_rd] = riscv->x[inst_rs1] < (uint32_t)signed_extend(inst_imm12i, 12); break; // sltiu
+        case 0x4: riscv->x[inst_rd] = riscv->x[inst_rs1] ^ (signed_extend(inst_imm12i, 12)); break; // xori
+        case 0x6: riscv->x[inst_rd] = riscv->x[inst_rs1] | (signed_extend(inst_imm12i, 12)); break; // ori
+        case 0x7: riscv->x[inst_rd] = riscv->x[inst_rs1] & (signed_extend(inst_imm12i, 12)); break; // andi
+        case 0x1: // slli, zbb unary ops, bclri, bseti & binvi
+            switch (inst_funct7) {
+            case 0x00: riscv->x[inst_rd] = riscv->x[inst_rs1] << inst_rs2; break; // slli
+            case 0x24: riscv->x[inst_rd] = riscv->x[inst_rs1] & ~(1u << inst_rs2); break; // bclri
+            case 0x14: riscv->x[inst_rd] = riscv->x[inst_rs1] |  (1u << inst_rs2); break; // bseti
+            case 0x34: riscv->x[inst_rd] = riscv->x[inst_rs1] ^  (1u << inst_rs2); break; // binvi
+            case 0x30:
+                switch (inst_rs2) {
+                case 0x0: riscv->x[inst_rd] = riscv_clz (riscv->x[inst_rs1]); break; // clz
+                case 0x1: riscv->x[inst_rd] = riscv_ctz (riscv->x[inst_rs1]); break; // ctz
+                case 0x2: riscv->x[inst_rd] = riscv_cpop(riscv->x[inst_rs1]); break; // cpop
+                case 0x4: riscv->x[inst_rd] = (int8_t )riscv->x[inst_rs1]; break; // sext.b
+                case 0x5: riscv->x[inst_rd] = (int16_t)riscv->x[inst_rs1]; break; // sext.h
+                default : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+                }
+                break;
+            default: riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+            }
+            break;
+        case 0x5: // srli, srai, rori, bexti, orc.b & rev8
+            switch (inst_funct7) {
+            case 0x00: riscv->x[inst_rd] = riscv->x[inst_rs1] >> inst_rs2; break; // srli
+            case 0x20: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] >> inst_rs2; break; // srai
+            case 0x30: riscv->x[inst_rd] = riscv_ror(riscv->x[inst_rs1], inst_rs2); break; // rori
+            case 0x24: riscv->x[inst_rd] = (riscv->x[inst_rs1] >> inst_rs2) & 1; break; // bexti
+            case 0x14: if (inst_rs2 == 0x07) riscv->x[inst_rd] = riscv_orcb(riscv->x[inst_rs1]); else riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; // orc.b
+            case 0x34: if (inst_rs2 == 0x18) riscv->x[inst_rd] = __builtin_bswap32(riscv->x[inst_rs1]); else riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; // rev8
+            default  : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+            }
+            break;
+        }
+        break;
+    case 0x33: // r-type
+        switch (inst_funct7) {
+        case 0x00:
+            switch (inst_funct3) {
+            case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] + riscv->x[inst_rs2]; break; // add
+            case 0x1: riscv->x[inst_rd] = riscv->x[inst_rs1] << (riscv->x[inst_rs2] & 0x1f); break; // sll
+            case 0x2: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] < (int32_t)riscv->x[inst_rs2]; break; // slt
+            case 0x3: riscv->x[inst_rd] = riscv->x[inst_rs1] < riscv->x[inst_rs2]; break; // sltu
+            case 0x4: riscv->x[inst_rd] = riscv->x[inst_rs1] ^ riscv->x[inst_rs2]; break; // xor
+            case 0x5: riscv->x[inst_rd] = riscv->x[inst_rs1] >> (riscv->x[inst_rs2] & 0x1f); break; // srl
+            case 0x6: riscv->x[inst_rd] = riscv->x[inst_rs1] | riscv->x[inst_rs2]; break; // or
+            case 0x7: riscv->x[inst_rd] = riscv->x[inst_rs1] & riscv->x[inst_rs2]; break; // and
+            }
+            break;
+        case 0x20:
+            switch (inst_funct3) {
+            case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] - riscv->x[inst_rs2]; break; // sub
+            case 0x5: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] >> (riscv->x[inst_rs2] & 0x1f); break; // sra
+            case 0x4: riscv->x[inst_rd] = ~(riscv->x[inst_rs1] ^ riscv->x[inst_rs2]); break; // xnor
+            case 0x6: riscv->x[inst_rd] = riscv->x[inst_rs1] | ~riscv->x[inst_rs2]; break; // orn
+            case 0x7: riscv->x[inst_rd] = riscv->x[inst_rs1] & ~riscv->x[inst_rs2]; break; // andn
+            default : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+            }
+            break;
+        case 0x10: // sh1add, sh2add & sh3add
+            if (inst_funct3 == 0x2 || inst_funct3 == 0x4 || inst_funct3 == 0x6) riscv->x[inst_rd] = (riscv->x[inst_rs1] << (inst_funct3 >> 1)) + riscv->x[inst_rs2];
+            else riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+            break;
+        case 0x05:
+            switch (inst_funct3) {
+            case 0x4: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] < (int32_t)riscv->x[inst_rs2] ? riscv->x[inst_rs1] : riscv->x[inst_rs2]; break; // min
+            case 0x5: riscv->x[inst_rd] = riscv->x[inst_rs1] < riscv->x[inst_rs2] ? riscv->x[inst_rs1] : riscv->x[inst_rs2]; break; // minu
+            case 0x6: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] > (int32_t)riscv->x[inst_rs2] ? riscv->x[inst_rs1] : riscv->x[inst_rs2]; break; // max
+            case 0x7: riscv->x[inst_rd] = riscv->x[inst_rs1] > riscv->x[inst_rs2] ? riscv->x[inst_rs1] : riscv->x[inst_rs2]; break; // maxu
+            default : riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+            }
+            break;
+        case 0x30:
+            if      (inst_funct3 == 0x1) riscv->x[inst_rd] = riscv_rol(riscv->x[inst_rs1], riscv->x[inst_rs2]); // rol
+            else if (inst_funct3 == 0x5) riscv->x[inst_rd] = riscv_ror(riscv->x[inst_rs1], riscv->x[inst_rs2]); // ror
+            else riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+            break;
+        case 0x04: if (inst_funct3 == 0x4 && inst_rs2 == 0) riscv->x[inst_rd] = (uint16_t)riscv->x[inst_rs1]; else riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; // zext.h
+        case 0x24:
+            if      (inst_funct3 == 0x1) riscv->x[inst_rd] = riscv->x[inst_rs1] & ~(1u << (riscv->x[inst_rs2] & 0x1f)); // bclr
+            else if (inst_funct3 == 0x5) riscv->x[inst_rd] = (riscv->x[inst_rs1] >> (riscv->x[inst_rs2] & 0x1f)) & 1;   // bext
+            else riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+            break;
+        case 0x14: if (inst_funct3 == 0x1) riscv->x[inst_rd] = riscv->x[inst_rs1] | (1u << (riscv->x[inst_rs2] & 0x1f)); else riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; // bset
+        case 0x34: if (inst_funct3 == 0x1) riscv->x[inst_rd] = riscv->x[inst_rs1] ^ (1u << (riscv->x[inst_rs2] & 0x1f)); else riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; // binv
+        case 0x01:
+            switch (inst_funct3) {
+            case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] * riscv->x[inst_rs2]; break; // mul
+            case 0x1: riscv->x[inst_rd] = riscv_mulh  (riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // mulh
+            case 0x2: riscv->x[inst_rd] = riscv_mulhsu(riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // mulhsu
+            case 0x3: // mulhu
+                mult64res = (uint64_t)riscv->x[inst_rs1] * (uint64_t)riscv->x[inst_rs2];
+                riscv->x[inst_rd] = (uint32_t)(mult64res >> 32);
+                break;
+            case 0x4: riscv->x[inst_rd] = riscv_div (riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // div
+            case 0x5: riscv->x[inst_rd] = riscv_divu(riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // divu
+            case 0x6: riscv->x[inst_rd] = riscv_rem (riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // rem
+            case 0x7: riscv->x[inst_rd] = riscv_remu(riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // remu
+            }
+            break;
+        default: riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+        }
+        break;
+    case 0x73:
+        switch (inst_funct3) {
+        case 0:
+            status = riscv->csr[CSR_MSTATUS];
+            if (inst_funct7 == 0x09) { // sfence.vma, drops the translations of one page or all of them
+                if (riscv->priv == PRIV_U || (riscv->priv == PRIV_S && (status & MSTATUS_TVM))) { riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; }
+                if (inst_rs1) riscv_tlb_flush_page(riscv, riscv->x[inst_rs1]);
+                else riscv_tlb_flush(riscv);
+                break;
+            }
+            switch (inst_imm12i) {
+            case 0x000: // ecall, the host syscalls in machine mode, a trap below it
+                if (riscv->priv == PRIV_M) riscv->x[10] = handle_ecall(riscv);
+                else riscv_raise(riscv, riscv->priv == PRIV_U ? CAUSE_ECALL_U : CAUSE_ECALL_S, 0);
+                break;
+            case 0x001: riscv_raise(riscv, CAUSE_BREAKPOINT, riscv->pc); break; // ebreak
+            case 0x302: // mret
+                if (riscv->priv != PRIV_M) { riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; }
+                riscv_mret(riscv); bflag = 1;
+                break;
+            case 0x102: // sret
+                if (riscv->priv == PRIV_U || (riscv->priv == PRIV_S && (status & MSTATUS_TSR))) { riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; }
+                riscv_sret(riscv); bflag = 1;
+                break;
+            case 0x105: // wfi, riscv_run_n parks the hart
+                if (riscv->priv == PRIV_U) { riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break; }
+                riscv->wfi = 1; riscv->status |= TS_IRQ;
+                break;
+            default: riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+            }
+            break;
+        case 1: case 2: case 3: riscv_setx(riscv, riscv->x + inst_rd, riscv_csr_op(riscv, inst_funct3, inst_csr, riscv->x[inst_rs1])); break; // csrrw, csrrs, csrrc
+        case 5: case 6: case 7: riscv_setx(riscv, riscv->x + inst_rd, riscv_csr_op(riscv, inst_funct3, inst_csr, inst_rs1)); break;          // csrrwi, csrrsi, csrrci
+        default: riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+        }
+        break;
+    case 0x2f: // lr.w, sc.w and the amos by funct5 0 to 4 and 8 to 28 in steps of 4
+        if (inst_funct3 == 0x2 && ((0x1111111fu >> (instruction >> 27)) & 1)) riscv_setx(riscv, riscv->x + inst_rd, riscv_amo32(riscv, instruction >> 27, riscv->x[inst_rs1], riscv->x[inst_rs2]));
+        else riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+        break;
+    case 0x07: case 0x27: case 0x43: case 0x47: case 0x4b: case 0x4f: case 0x53: // f and d extensions
+        riscv_execute_fp(riscv, instruction);
+        break;
+    case 0x0f:
+        if (instruction == 0x0000100f) { // fence.i, also picks up code stored by the other harts
+            riscv->codegen = atomic_load(&riscv->mach->codegen);
+            riscv_dcache_flush(riscv);
+        } else if ((instruction & 0xf00fff80) == 0) { // fence
+            atomic_thread_fence(memory_order_seq_cst);
+        } else if (inst_funct3 > 1) {
+            riscv_raise(riscv, CAUSE_ILLEGAL, instruction);
+        }
+        break;
+    default: riscv_raise(riscv, CAUSE_ILLEGAL, instruction); break;
+    }
+    riscv->pc += bflag ? 0 : 4;
+}
+
+static void riscv_decode_rv16(RVDECODED *d, uint16_t instruction)
+{
+    const uint16_t inst_rd     = (instruction >> 7) & 0x1f;
+    const uint16_t inst_rs2    = (instruction >> 2) & 0x1f;
+    const uint16_t inst_rs1s   = (instruction >> 7) & 0x7;
+    const uint16_t inst_rs2s   = (instruction >> 2) & 0x7;
+    const uint16_t inst_imm6   =((instruction >> 2) & 0x1f) | ((instruction >> 7) & (1 << 5));
+    const uint16_t inst_imm7   =((instruction >> 4) & (1 << 2)) | ((instruction >> 7) & (0x7 << 3)) | ((instruction << 1) & (1 << 6));
+    const uint16_t inst_imm10  =((instruction >> 4) & (1 << 2)) | ((instruction >> 2) & (1 << 3)) | ((instruction >> 7) & (0x3 << 4)) | ((instruction >> 1) & (0x7 << 6));
+    const uint16_t inst_imm12  =((instruction >> 2) & (0x7 << 1)) | ((instruction >> 7) & (1 << 4)) | ((instruction << 3) & (1 << 5))
+                               |((instruction >> 1) & (0x2d << 6)) | ((instruction << 1) & (1 << 7)) | ((instruction << 2) & (1 << 10));
+    const uint32_t inst_imm18  =((instruction << 5) & (1 << 17)) | ((instruction << 10) & (0x1f << 12));
+    const uint16_t inst_funct2 = (instruction >>10) & 0x3;
+    const uint16_t inst_funct3 = (instruction >>13) & 0x7;
+    uint32_t temp;
+
+    if (riscv_rv16_reserved(instruction)) {
+        d->op = OP_SLOW;
+        return;
+    }
+    switch (((instruction & 0x3) << 3) | inst_funct3) {
+    case 0x00: d->op = OP_ADDI; d->rd = 8 + inst_rs2s; d->rs1 = 2; d->imm = inst_imm10; break; // c.addi4spn
+    case 0x02: d->op = OP_LW; d->rd  = 8 + inst_rs2s; d->rs1 = 8 + inst_rs1s; d->imm = inst_imm7; break; // c.lw
+    case 0x06: d->op = OP_SW; d->rs2 = 8 + inst_rs2s; d->rs1 = 8 + inst_rs1s; d->imm = inst_imm7; break; // c.sw
+    case 0x08: d->op = OP_ADDI; d->rd = d->rs1 = inst_rd; d->imm = signed_extend(inst_imm6, 6); break; // c.addi
+    case 0x09: d->op = OP_JAL ; d->rd = 1; d->imm = signed_extend(inst_imm12, 12); break; // c.jal
+    case 0x0a: d->op = OP_ADDI; d->rd = inst_rd; d->rs1 = 0; d->imm = signed_extend(inst_imm6, 6); break; // c.li
+    case 0x0b:
+        if (inst_rd == 2) { // c.addi16sp
+            temp = ((instruction >> 2) & (1 << 4)) | ((instruction << 3) & (1 << 5)) | ((instruction << 1) & (1 << 6))
+                 | ((instruction << 4) & (0x3 << 7)) | ((instruction >> 3) & (1 << 9));
+            d->op = OP_ADDI; d->rd = d->rs1 = 2; d->imm = signed_extend(temp, 10);
+        } else { // c.lui
+            d->op = OP_LUI ; d->rd = inst_rd; d->imm = signed_extend(inst_imm18, 18);
+        }
+        break;
+    case 0x0c:
+        d->rd = d->rs1 = 8 + inst_rs1s; d->rs2 = 8 + inst_rs2s;
+        switch (inst_funct2) {
+        case 0: d->op = OP_SRLI; d->imm = inst_imm6; break; // c.srli
+        case 1: d->op = OP_SRAI; d->imm = inst_imm6; break; // c.srai
+        case 2: d->op = OP_ANDI; d->imm = signed_extend(inst_imm6, 6); break; // c.andi
+        case 3:
+            switch ((instruction >> 5) & 3) {
+            case 0: d->op = OP_SUB; break; // c.sub
+            case 1: d->op = OP_XOR; break; // c.xor
+            case 2: d->op = OP_OR ; break; // c.or
+            case 3: d->op = OP_AND; break; // c.and
+            }
+            break;
+        }
+        break;
+    case 0x0d: d->op = OP_JAL; d->rd = 0; d->imm = signed_extend(inst_imm12, 12); break; // c.j
+    case 0x0e: // c.beqz
+    case 0x0f: // c.bnez
+        temp = ((instruction >> 2) & (0x3 << 1)) | ((instruction >> 7) & (0x3 << 3)) | ((instruction << 3) & (1 << 5))
+             | ((instruction << 1) & (0x3 << 6)) | ((instruction >> 4) & (1 << 8));
+        d->op  = inst_funct3 == 6 ? OP_BEQ : OP_BNE;
+        d->rs1 = 8 + inst_rs1s; d->rs2 = 0; d->imm = signed_extend(temp, 9);
+        break;
+    case 0x10: d->op = OP_SLLI; d->rd = d->rs1 = inst_rd; d->imm = inst_imm6; break; // c.slli
+    case 0x12: // c.lwsp
+        d->op  = OP_LW; d->rd = inst_rd; d->rs1 = 2;
+        d->imm = ((instruction >> 2) & (0x7 << 2)) | ((instruction >> 7) & (1 << 5)) | ((instruction << 4) & (0x3 << 6));
+        break;
+    case 0x14:
+        if ((instruction & (1 << 12)) == 0) {
+            if (inst_rs2 == 0) { // c.jr
+                d->op = OP_JALR; d->rd = 0; d->rs1 = inst_rd; d->imm = 0;
+            } else { // c.mv
+                d->op = OP_ADD ; d->rd = inst_rd; d->rs1 = 0; d->rs2 = inst_rs2;
+            }
+        } else {
+            if (inst_rd == 0 && inst_rs2 == 0) { // c.ebreak
+                d->op = OP_SLOW;
+            } else if (inst_rs2 == 0) { // c.jalr
+                d->op = OP_JALR; d->rd = 1; d->rs1 = inst_rd; d->imm = 0;
+            } else { // c.add
+                d->op = OP_ADD ; d->rd = d->rs1 = inst_rd; d->rs2 = inst_rs2;
+            }
+        }
+        break;
+    case 0x16: // c.swsp
+        d->op  = OP_SW; d->rs1 = 2; d->rs2 = inst_rs2;
+        d->imm = ((instruction >> 7) & (0xf << 2)) | ((instruction >> 1) & (0x3 << 6));
+        break;
+    default: d->op = OP_SLOW; break; // compressed fp load/store & reserved encodings
+    }
+}
+
+static void riscv_decode_rv32(RVDECODED *d, uint32_t instruction)
+{
+    static const uint8_t ops_load [8] = { OP_LB, OP_LH, OP_LW, OP_SLOW, OP_LBU, OP_LHU, OP_SLOW, OP_SLOW };
+    static const uint8_t ops_store[8] = { OP_SB, OP_SH, OP_SW, OP_SLOW, OP_SLOW, OP_SLOW, OP_SLOW, OP_SLOW };
+    static const uint8_t ops_br   [8] = { OP_BEQ, OP_BNE, OP_SLOW, OP_SLOW, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU };
+    static const uint8_t ops_imm  [8] = { OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI };
+    static const uint8_t ops_reg  [8] = { OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND };
+    static const uint8_t ops_mul  [8] = { OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU };
+    static const uint8_t ops_alt  [8] = { OP_SUB, OP_SLOW, OP_SLOW, OP_SLOW, OP_XNOR, OP_SRA, OP_ORN, OP_ANDN };
+    static const uint8_t ops_shadd[8] = { OP_SLOW, OP_SLOW, OP_SH1ADD, OP_SLOW, OP_SH2ADD, OP_SLOW, OP_SH3ADD, OP_SLOW };
+    static const uint8_t ops_minmax[8]= { OP_SLOW, OP_SLOW, OP_SLOW, OP_SLOW, OP_MIN, OP_MINU, OP_MAX, OP_MAXU };
+    static const uint8_t ops_unary[8] = { OP_CLZ, OP_CTZ, OP_CPOP, OP_SLOW, OP_SEXTB, OP_SEXTH, OP_SLOW, OP_SLOW };
+    const uint32_t inst_opcode = (instruction >> 0) & 0x7f;
+    const uint32_t inst_funct3 = (instruction >>12) & 0x07;
+    const uint32_t inst_funct7 = (instruction >>25) & 0x7f;
+    const uint32_t inst_imm12i = (instruction >>20) & 0xfff;
+    const uint32_t inst_imm12s =((instruction >>20) & (0x7f << 5)) | ((instruction >> 7) & 0x1f);
+    const uint32_t inst_imm13b =((instruction >>19) & (0x1  <<12)) | ((instruction << 4) & (0x1 << 11))
+                               |((instruction >>20) & (0x3f << 5)) | ((instruction >> 7) & (0xf <<  1));
+    const uint32_t inst_imm21j =((instruction >> 11) & (1 << 20)) | (instruction & (0xff << 12))
+                               |((instruction >> 9 ) & (1 << 11)) | ((instruction >> 20) & (0x3ff << 1));
+
+    d->rd  = (instruction >> 7) & 0x1f;
+    d->rs1 = (instruction >>15) & 0x1f;
+    d->rs2 = (instruction >>20) & 0x1f;
+    switch (inst_opcode) {
+    case 0x37: d->op = OP_LUI  ; d->imm = instruction & (0xfffff << 12); break;
+    case 0x17: d->op = OP_AUIPC; d->imm = instruction & (0xfffff << 12); break;
+    case 0x6f: d->op = OP_JAL  ; d->imm = signed_extend(inst_imm21j, 21); break;
+    case 0x67: d->op = inst_funct3 == 0 ? OP_JALR : OP_SLOW; d->imm = signed_extend(inst_imm12i, 12); break;
+    case 0x63: d->op = ops_br   [inst_funct3]; d->imm = signed_extend(inst_imm13b, 13); break;
+    case 0x03: d->op = ops_load [inst_funct3]; d->imm = signed_extend(inst_imm12i, 12); break;
+    case 0x23: d->op = ops_store[inst_funct3]; d->imm = signed_extend(inst_imm12s, 12); break;
+    case 0x13:
+        d->op  = ops_imm[inst_funct3];
+        d->imm = signed_extend(inst_imm12i, 12);
+        if (d->op != OP_SLLI && d->op != OP_SRLI) break;
+        d->imm &= 0x1f; // shift amount or zbb/zbs selector
+        switch (inst_funct7) {
+        case 0x00: break;
+        case 0x20: d->op = d->op == OP_SRLI ? OP_SRAI : OP_SLOW; break;
+        case 0x30: d->op = d->op == OP_SRLI ? OP_RORI : d->imm < 8 ? ops_unary[d->imm] : OP_SLOW; break;
+        case 0x24: d->op = d->op == OP_SRLI ? OP_BEXTI : OP_BCLRI; break;
+        case 0x14: d->op = d->op == OP_SLLI ? OP_BSETI : d->imm == 0x07 ? OP_ORCB : OP_SLOW; break;
+        case 0x34: d->op = d->op == OP_SLLI ? OP_BINVI : d->imm == 0x18 ? OP_REV8 : OP_SLOW; break;
+        default  : d->op = OP_SLOW; break;
+        }
+        break;
+    case 0x33:
+        switch (inst_funct7) {
+        case 0x00: d->op = ops_reg   [inst_funct3]; break;
+        case 0x01: d->op = ops_mul   [inst_funct3]; break;
+        case 0x20: d->op = ops_alt   [inst_funct3]; break;
+        case 0x10: d->op = ops_shadd [inst_funct3]; break;
+        case 0x05: d->op = ops_minmax[inst_funct3]; break;
+        case 0x30: d->op = inst_funct3 == 1 ? OP_ROL  : inst_funct3 == 5 ? OP_ROR  : OP_SLOW; break;
+        case 0x24: d->op = inst_funct3 == 1 ? OP_BCLR : inst_funct3 == 5 ? OP_BEXT : OP_SLOW; break;
+        case 0x14: d->op = inst_funct3 == 1 ? OP_BSET : OP_SLOW; break;
+        case 0x34: d->op = inst_funct3 == 1 ? OP_BINV : OP_SLOW; break;
+        case 0x04: d->op = inst_funct3 == 4 && d->rs2 == 0 ? OP_ZEXTH : OP_SLOW; break;
+        default  : d->op = OP_SLOW; break;
+        }
+        break;
+    default: d->op = OP_SLOW; break; // system, atomic and fence instructions
+    }
+}
+
+// decodes the instruction at pc, which translates to ppc, only code in ram is cached and with translation on only
+// instructions within a page
+static int riscv_decode(RISCV *riscv, uint32_t pc, uint32_t ppc, RVDECODED *d)
+{
+    uint32_t instruction, a;
+    if (!riscv_bus_ram(riscv, ppc, &a) || a > riscv->mem_size - 4) return 0;
+
+    memcpy(&instruction, riscv->mem + a, 4);
+    if ((riscv->vm & VM_FETCH) && (pc & 0xfff) == 0xffe && (instruction & 0x3) == 0x3) return 0;
+    d->inst = instruction;
+    d->imm  = d->rd = d->rs1 = d->rs2 = 0;
+    if ((instruction & 0x3) != 0x3) {
+        d->len = 2; riscv_decode_rv16(d, (uint16_t)instruction);
+    } else {
+        d->len = 4; riscv_decode_rv32(d, instruction);
+    }
+    __atomic_fetch_or(&riscv->codemap[(a + 0         ) >> CODEMAP_SHIFT], CODEMAP_CODE, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&riscv->codemap[(a + d->len - 1) >> CODEMAP_SHIFT], CODEMAP_CODE, __ATOMIC_RELAXED);
+    d->pc  = pc;
+    d->ppc = ppc;
+    return 1;
+}
+
+// the decoded instruction at pc, NULL if it cannot be decoded or its fetch faulted, which raised the fault
+static inline RVDECODED* riscv_dcache_get(RISCV *riscv, uint32_t pc)
+{
+    RVDECODED *d = riscv->dcache + ((pc >> 1) & (DCACHE_SIZE - 1));
+    uint32_t   ppc;
+    if (d->pc == pc && d->ppc == pc && !(riscv->vm & VM_FETCH)) return d;
+    if (riscv_vm_fetch(riscv, pc, &ppc) < 0) return NULL;
+    d = riscv->dcache + ((ppc >> 1) & (DCACHE_SIZE - 1));
+    if ((d->pc != pc || d->ppc != ppc) && !riscv_decode(riscv, pc, ppc, d)) return NULL;
+    return d;
+}
+
+static void riscv_execute_decoded(RISCV *riscv, const RVDECODED *d)
+{
+    uint32_t *x = riscv->x, temp;
+
+    switch (d->op) {
+    case OP_LUI  : x[d->rd] = d->imm; break;
+    case OP_AUIPC: x[d->rd] = riscv->pc + d->imm; break;
+    case OP_JAL  : x[d->rd] = riscv->pc + d->len; riscv->pc += d->imm; return;
+    case OP_JALR :
+        temp      = riscv->pc + d->len;
+        riscv->pc = (x[d->rs1] + d->imm) & ~1;
+        x[d->rd]  = temp;
+        return;
+    case OP_BEQ  : if (x[d->rs1] == x[d->rs2]) { riscv->pc += d->imm; return; } break;
+    case OP_BNE  : if (x[d->rs1] != x[d->rs2]) { riscv->pc += d->imm; return; } break;
+    case OP_BLT  : if ((int32_t)x[d->rs1] <  (int32_t)x[d->rs2]) { riscv->pc += d->imm; return; } break;
+    case OP_BGE  : if ((int32_t)x[d->rs1] >= (int32_t)x[d->rs2]) { riscv->pc += d->imm; return; } break;
+    case OP_BLTU : if (x[d->rs1] <  x[d->rs2]) { riscv->pc += d->imm; return; } break;
+    case OP_BGEU : if (x[d->rs1] >= x[d->rs2]) { riscv->pc += d->imm; return; } break;
+    case OP_LB   : riscv_setx(riscv, x + d->rd, (int8_t )riscv_memr8 (riscv, x[d->rs1] + d->imm)); break;
+    case OP_LH   : riscv_setx(riscv, x + d->rd, (int16_t)riscv_memr16(riscv, x[d->rs1] + d->imm)); break;
+    case OP_LW   : riscv_setx(riscv, x + d->rd, riscv_memr32(riscv, x[d->rs1] + d->imm)); break;
+    case OP_LBU  : riscv_setx(riscv, x + d->rd, riscv_memr8 (riscv, x[d->rs1] + d->imm)); break;
+    case OP_LHU  : riscv_setx(riscv, x + d->rd, riscv_memr16(riscv, x[d->rs1] + d->imm)); break;
+    case OP_SB   : riscv_memw8 (riscv, x[d->rs1] + d->imm, (uint8_t )x[d->rs2]); break;
+    case OP_SH   : riscv_memw16(riscv, x[d->rs1] + d->imm, (uint16_t)x[d->rs2]); break;
+    case OP_SW   : riscv_memw32(riscv, x[d->rs1] + d->imm, x[d->rs2]); break;
+    case OP_ADDI : x[d->rd] = x[d->rs1] + d->imm; break;
+    case OP_SLTI : x[d->rd] = (int32_t)x[d->rs1] < d->imm; break;
+    case OP_SLTIU: x[d->rd] = x[d->rs1] < (uint32_t)d->imm; break;
+    case OP_XORI : x[d->rd] = x[d->rs1] ^ d->imm; break;
+    case OP_ORI  : x[d->rd] = x[d->rs1] | d->imm; break;
+    case OP_ANDI : x[d->rd] = x[d->rs1] & d->imm; break;
+    case OP_SLLI : x[d->rd] = x[d->rs1] << (d->imm & 0x1f); break;
+    case OP_SRLI : x[d->rd] = x[d->rs1] >> (d->imm & 0x1f); break;
+    case OP_SRAI : x[d->rd] = (int32_t)x[d->rs1] >> (d->imm & 0x1f); break;
+    case OP_ADD  : x[d->rd] = x[d->rs1] + x[d->rs2]; break;
+    case OP_SUB  : x[d->rd] = x[d->rs1] - x[d->rs2]; break;
+    case OP_SLL  : x[d->rd] = x[d->rs1] << (x[d->rs2] & 0x1f); break;
+    case OP_SLT  : x[d->rd] = (int32_t)x[d->rs1] < (int32_t)x[d->rs2]; break;
+    case OP_SLTU : x[d->rd] = x[d->rs1] < x[d->rs2]; break;
+    case OP_XOR  : x[d->rd] = x[d->rs1] ^ x[d->rs2]; break;
+    case OP_SRL  : x[d->rd] = x[d->rs1] >> (x[d->rs2] & 0x1f); break;
+    case OP_SRA  : x[d->rd] = (int32_t)x[d->rs1] >> (x[d->rs2] & 0x1f); break;
+    case OP_OR   : x[d->rd] = x[d->rs1] | x[d->rs2]; break;
+    case OP_AND  : x[d->rd] = x[d->rs1] & x[d->rs2]; break;
+    case OP_MUL  : x[d->rd] = x[d->rs1] * x[d->rs2]; break;
+    case OP_MULH : x[d->rd] = riscv_mulh  (x[d->rs1], x[d->rs2]); break;
+    case OP_MULHSU:x[d->rd] = riscv_mulhsu(x[d->rs1], x[d->rs2]); break;
+    case OP_MULHU: x[d->rd] = (uint32_t)(((uint64_t)x[d->rs1] * (uint64_t)x[d->rs2]) >> 32); break;
+    case OP_DIV  : x[d->rd] = riscv_div (x[d->rs1], x[d->rs2]); break;
+    case OP_DIVU : x[d->rd] = riscv_divu(x[d->rs1], x[d->rs2]); break;
+    case OP_REM  : x[d->rd] = riscv_rem (x[d->rs1], x[d->rs2]); break;
+    case OP_REMU : x[d->rd] = riscv_remu(x[d->rs1], x[d->rs2]); break;
+    case OP_SH1ADD:x[d->rd] = (x[d->rs1] << 1) + x[d->rs2]; break;
+    case OP_SH2ADD:x[d->rd] = (x[d->rs1] << 2) + x[d->rs2]; break;
+    case OP_SH3ADD:x[d->rd] = (x[d->rs1] << 3) + x[d->rs2]; break;
+    case OP_ANDN : x[d->rd] = x[d->rs1] & ~x[d->rs2]; break;
+    case OP_ORN  : x[d->rd] = x[d->rs1] | ~x[d->rs2]; break;
+    case OP_XNOR : x[d->rd] = ~(x[d->rs1] ^ x[d->rs2]); break;
+    case OP_MIN  : x[d->rd] = (int32_t)x[d->rs1] < (int32_t)x[d->rs2] ? x[d->rs1] : x[d->rs2]; break;
+    case OP_MINU : x[d->rd] = x[d->rs1] < x[d->rs2] ? x[d->rs1] : x[d->rs2]; break;
+    case OP_MAX  : x[d->rd] = (int32_t)x[d->rs1] > (int32_t)x[d->rs2] ? x[d->rs1] : x[d->rs2]; break;
+    case OP_MAXU : x[d->rd] = x[d->rs1] > x[d->rs2] ? x[d->rs1] : x[d->rs2]; break;
+    case OP_ROL  : x[d->rd] = riscv_rol(x[d->rs1], x[d->rs2]); break;
+    case OP_ROR  : x[d->rd] = riscv_ror(x[d->rs1], x[d->rs2]); break;
+    case OP_BCLR : x[d->rd] = x[d->rs1] & ~(1u << (x[d->rs2] & 0x1f)); break;
+    case OP_BSET : x[d->rd] = x[d->rs1] |  (1u << (x[d->rs2] & 0x1f)); break;
+    case OP_BINV : x[d->rd] = x[d->rs1] ^  (1u << (x[d->rs2] & 0x1f)); break;
+    case OP_BEXT : x[d->rd] = (x[d->rs1] >> (x[d->rs2] & 0x1f)) & 1; break;
+    case OP_CLZ  : x[d->rd] = riscv_clz (x[d->rs1]); break;
+    case OP_CTZ  : x[d->rd] = riscv_ctz (x[d->rs1]); break;
+    case OP_CPOP : x[d->rd] = riscv_cpop(x[d->rs1]); break;
+    case OP_SEXTB: x[d->rd] = (int8_t  )x[d->rs1]; break;
+    case OP_SEXTH: x[d->rd] = (int16_t )x[d->rs1]; break;
+    case OP_ZEXTH: x[d->rd] = (uint16_t)x[d->rs1]; break;
+    case OP_ORCB : x[d->rd] = riscv_orcb(x[d->rs1]); break;
+    case OP_REV8 : x[d->rd] = __builtin_bswap32(x[d->rs1]); break;
+    case OP_RORI : x[d->rd] = riscv_ror(x[d->rs1], d->imm); break;
+    case OP_BCLRI: x[d->rd] = x[d->rs1] & ~(1u << d->imm); break;
+    case OP_BSETI: x[d->rd] = x[d->rs1] |  (1u << d->imm); break;
+    case OP_BINVI: x[d->rd] = x[d->rs1] ^  (1u << d->imm); break;
+    case OP_BEXTI: x[d->rd] = (x[d->rs1] >> d->imm) & 1; break;
+    default: // OP_SLOW
+        if (d->len == 2) riscv_execute_rv16(riscv, (uint16_t)d->inst);
+        else             riscv_execute_rv32(riscv, d->inst);
+        return;
+    }
+    riscv->pc += d->len;
+}
+
+// the instruction at pc, 0 with the fetch fault raised if it has none, one straddling two pages is fetched in halves
+static uint32_t riscv_fetch(RISCV *riscv, uint32_t pc)
+{
+    uint32_t ppc, lo;
+    if (riscv_vm_fetch(riscv, pc, &ppc) < 0) return 0;
+    if (!(riscv->vm & VM_FETCH) || (pc & 0xfff) != 0xffe) return riscv_phys_read(riscv, ppc, 4);
+    lo = riscv_phys_read(riscv, ppc, 2);
+    if ((lo & 0x3) != 0x3) return lo;
+    if (riscv_vm_fetch(riscv, pc + 2, &ppc) < 0) return 0;
+    return lo | riscv_phys_read(riscv, ppc, 2) << 16;
+}
+
+// an instruction that raised an exception is not retired and leaves pc on itself
+static void riscv_step(RISCV *riscv)
+{
+    const uint32_t pc = riscv->pc, instruction = riscv_fetch(riscv, pc);
+    if (riscv->status & TS_TRAP) return;
+    if ((instruction & 0x3) != 0x3) {
+        riscv_execute_rv16(riscv, (uint16_t)instruction);
+    } else {
+        riscv_execute_rv32(riscv, (uint32_t)instruction);
+    }
+    riscv->x[0] = 0;
+    if (riscv->status & TS_TRAP) { riscv->pc = pc; return; }
+    riscv->icount++;
+}
+
+void riscv_run(RISCV *riscv)
+{
+    const uint32_t pc = riscv->pc;
+    RVDECODED     *d  = riscv_dcache_get(riscv, pc);
+    if (!d) {
+        if (!(riscv->status & TS_TRAP)) riscv_step(riscv);
+        return;
+    }
+    riscv_execute_decoded(riscv, d);
+    riscv->x[0] = 0;
+    if (riscv->status & TS_TRAP) { riscv->pc = pc; return; }
+    riscv->icount++;
+}
+
+void riscv_symtab_free(RVSYMTAB *t)
+{
+    free(t->syms);
+    free(t->names);
+    memset(t, 0, sizeof(*t));
+}
+
+static int riscv_sym_cmp(const void *a, const void *b)
+{
+    const RVSYM *x = a, *y = b;
+    if (x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+    return x->size > y->size ? -1 : x->size < y->size; // the sized symbol first at equal addresses
+}
+
+// reads the function and label symbols of a 32-bit elf file, returns -1 if it has none
+int riscv_symtab_read(RVSYMTAB *t, int fd)
+{
+    Elf32_Ehdr  eh;
+    Elf32_Shdr *sh  = NULL;
+    Elf32_Sym  *sym = NULL;
+    uint32_t    i, j, n = 0, size = 0, type;
+
+    memset(t, 0, sizeof(*t));
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG) || eh.e_ident[EI_CLASS] != ELFCLASS32
+     || eh.e_shentsize != sizeof(Elf32_Shdr) || !eh.e_shnum || !(sh = malloc(eh.e_shnum * sizeof(Elf32_Shdr)))
+     || pread(fd, sh, eh.e_shnum * sizeof(Elf32_Shdr), eh.e_shoff) != (ssize_t)(eh.e_shnum * sizeof(Elf32_Shdr))) {
+        free(sh);
+        return -1;
+    }
+    for (i = 0; i < eh.e_shnum && (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh.e_shnum); i++);
+    if (i < eh.e_shnum) {
+        n        = sh[i].sh_size / sizeof(Elf32_Sym);
+        size     = sh[sh[i].sh_link].sh_size;
+        sym      = malloc(n * sizeof(Elf32_Sym) + 1);
+        t->syms  = malloc(n * sizeof(RVSYM) + 1);
+        t->names = malloc(size + 1);
+        if (!sym || !t->syms || !t->names || pread(fd, sym, n * sizeof(Elf32_Sym), sh[i].sh_offset) != (ssize_t)(n * sizeof(Elf32_Sym))
+         || pread(fd, t->names, size, sh[sh[i].sh_link].sh_offset) != (ssize_t)size) n = 0;
+        if (t->names) t->names[size] = '\0';
+    }
+    for (j = 0; j < n; j++) {
+        type = ELF32_ST_TYPE(sym[j].st_info);
+        if (type != STT_FUNC && type != STT_NOTYPE) continue;
+        if (sym[j].st_shndx == SHN_UNDEF || sym[j].st_shndx >= SHN_LORESERVE || !sym[j].st_name || sym[j].st_name >= size) continue;
+        t->syms[t->nsyms].name = t->names + sym[j].st_name;
+        if (!t->syms[t->nsyms].name[0] || t->syms[t->nsyms].name[0] == '.' || t->syms[t->nsyms].name[0] == '$') continue; // local and mapping labels
+        t->syms[t->nsyms].addr = sym[j].st_value;
+        t->syms[t->nsyms].size = sym[j].st_size;
+        t->nsyms++;
+    }
+    free(sym);
+    free(sh);
+    if (t->nsyms == 0) {
+        riscv_symtab_free(t);
+        return -1;
+    }
+    qsort(t->syms, t->nsyms, sizeof(RVSYM), riscv_sym_cmp);
+    for (i = j = 1; i < (uint32_t)t->nsyms; i++) if (t->syms[i].addr != t->syms[j - 1].addr) t->syms[j++] = t->syms[i];
+    t->nsyms = j;
+    return 0;
+}
+
+int riscv_symtab_load(RVSYMTAB *t, const char *file)
+{
+    int fd = open(file, O_RDONLY), ret;
+    if (fd < 0) { memset(t, 0, sizeof(*t)); return -1; }
+    ret = riscv_symtab_read(t, fd);
+    close(fd);
+    return ret;
+}
+
+// name of the symbol holding pc, with the offset into it unless pc is its start
+static const char* riscv_sym_name(const RVSYMTAB *t, uint32_t pc, char *buf, int len)
+{
+    int lo = 0, hi = t ? t->nsyms - 1 : -1, mid;
+    while (lo <= hi) { // last symbol at or below pc
+        mid = (lo + hi) / 2;
+        if (t->syms[mid].addr <= pc) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    if (hi < 0 || (t->syms[hi].size && pc - t->syms[hi].addr >= t->syms[hi].size)) snprintf(buf, len, "0x%08x", pc);
+    else if (pc == t->syms[hi].addr) snprintf(buf, len, "%s", t->syms[hi].name);
+    else snprintf(buf, len, "%s+0x%x", t->syms[hi].name, pc - t->syms[hi].addr);
+    return buf;
+}
+
+static const char *prof_op_names[PROF_OP_NUM] = {
+    [OP_LUI ] = "lui" , [OP_AUIPC] = "auipc", [OP_JAL ] = "jal" , [OP_JALR] = "jalr",
+    [OP_BEQ ] = "beq" , [OP_BNE  ] = "bne"  , [OP_BLT ] = "blt" , [OP_BGE ] = "bge" , [OP_BLTU] = "bltu", [OP_BGEU] = "bgeu",
+    [OP_LB  ] = "lb"  , [OP_LH   ] = "lh"   , [OP_LW  ] = "lw"  , [OP_LBU ] = "lbu" , [OP_LHU ] = "lhu" ,
+    [OP_SB  ] = "sb"  , [OP_SH   ] = "sh"   , [OP_SW  ] = "sw"  ,
+    [OP_ADDI] = "addi", [OP_SLTI ] = "slti" , [OP_SLTIU] = "sltiu", [OP_XORI] = "xori", [OP_ORI] = "ori", [OP_ANDI] = "andi",
+    [OP_SLLI] = "slli", [OP_SRLI ] = "srli" , [OP_SRAI] = "srai",
+    [OP_ADD ] = "add" , [OP_SUB  ] = "sub"  , [OP_SLL ] = "sll" , [OP_SLT ] = "slt" , [OP_SLTU] = "sltu", [OP_XOR] = "xor",
+    [OP_SRL ] = "srl" , [OP_SRA  ] = "sra"  , [OP_OR  ] = "or"  , [OP_AND ] = "and" ,
+    [OP_MUL ] = "mul" , [OP_MULH ] = "mulh" , [OP_MULHSU] = "mulhsu", [OP_MULHU] = "mulhu",
+    [OP_DIV ] = "div" , [OP_DIVU ] = "divu" , [OP_REM ] = "rem" , [OP_REMU] = "remu",
+    [OP_SH1ADD] = "sh1add", [OP_SH2ADD] = "sh2add", [OP_SH3ADD] = "sh3add", [OP_ANDN] = "andn", [OP_ORN] = "orn", [OP_XNOR] = "xnor",
+    [OP_MIN ] = "min" , [OP_MINU ] = "minu" , [OP_MAX ] = "max" , [OP_MAXU] = "maxu", [OP_ROL] = "rol", [OP_ROR] = "ror",
+    [OP_BCLR] = "bclr", [OP_BSET ] = "bset" , [OP_BINV] = "binv", [OP_BEXT] = "bext",
+    [OP_CLZ ] = "clz" , [OP_CTZ  ] = "ctz"  , [OP_CPOP] = "cpop", [OP_SEXTB] = "sext.b", [OP_SEXTH] = "sext.h", [OP_ZEXTH] = "zext.h",
+    [OP_ORCB] = "orc.b", [OP_REV8] = "rev8" , [OP_RORI] = "rori", [OP_BCLRI] = "bclri", [OP_BSETI] = "bseti", [OP_BINVI] = "binvi",
+    [OP_BEXTI] = "bexti",
+    [PROF_OP_AMO] = "amo", [PROF_OP_FENCE] = "fence", [PROF_OP_SYSTEM] = "system", [PROF_OP_FP] = "fp", [PROF_OP_OTHER] = "other",
+};
+
+static int riscv_prof_slow_op(const RVDECODED *d)
+{
+    if (!d) return PROF_OP_OTHER;
+    if (d->len == 2) return PROF_OP_FP; // compressed fp loads and stores
+    switch (d->inst & 0x7f) {
+    case 0x2f: return PROF_OP_AMO;
+    case 0x0f: return PROF_OP_FENCE;
+    case 0x73: return PROF_OP_SYSTEM;
+    case 0x07: case 0x27: case 0x43: case 0x47: case 0x4b: case 0x4f: case 0x53: return PROF_OP_FP;
+    }
+    return PROF_OP_OTHER;
+}
+
+static RVPROFPC* riscv_prof_pc(RVPROF *p, uint32_t pc)
+{
+    static RVPROFPC sink;
+    RVPROFPC **page = &p->pages[pc >> PROF_PAGE_SHIFT];
+    if (!*page && !(*page = calloc(1 << (PROF_PAGE_SHIFT - 1), sizeof(RVPROFPC)))) return &sink;
+    return *page + ((pc & ((1 << PROF_PAGE_SHIFT) - 1)) >> 1);
+}
+
+// child of the current call path for a call to func
+static int32_t riscv_prof_child(RVPROF *p, int32_t parent, uint32_t func)
+{
+    RVPROFNODE *nodes;
+    uint32_t    mask = 2 * p->cap - 1, h, i;
+    int32_t    *index;
+
+    for (h = (func * 0x9E3779B1u ^ (uint32_t)parent * 0x85EBCA6Bu) & mask; p->index[h] >= 0; h = (h + 1) & mask) {
+        if (p->nodes[p->index[h]].parent == parent && p->nodes[p->index[h]].func == func) return p->index[h];
+    }
+    if (p->nnodes == p->cap) { // grow and rehash
+        nodes = realloc(p->nodes, 2 * p->cap * sizeof(RVPROFNODE));
+        index = malloc(4 * p->cap * sizeof(int32_t));
+        if (!nodes || !index) { free(index); if (nodes) p->nodes = nodes; return parent; }
+        p->nodes = nodes;
+        free(p->index);
+        p->index = index;
+        p->cap  *= 2;
+        mask     = 2 * p->cap - 1;
+        memset(index, -1, 2 * p->cap * sizeof(int32_t));
+        for (i = 0; i < p->nnodes; i++) {
+            for (h = (nodes[i].func * 0x9E3779B1u ^ (uint32_t)nodes[i].parent * 0x85EBCA6Bu) & mask; index[h] >= 0; h = (h + 1) & mask);
+            index[h] = i;
+        }
+        for (h = (func * 0x9E3779B1u ^ (uint32_t)parent * 0x85EBCA6Bu) & mask; index[h] >= 0; h = (h + 1) & mask);
+    }
+    p->nodes[p->nnodes].func   = func;
+    p->nodes[p->nnodes].parent = parent;
+    p->nodes[p->nnodes].self   = 0;
+    p->index[h] = p->nnodes;
+    return p->nnodes++;
+}
+
+// accounts one executed instruction, next is the pc it left for
+static void riscv_prof_count(RVPROF *p, uint32_t pc, const RVDECODED *d, uint32_t next)
+{
+    RVPROFPC *c  = riscv_prof_pc(p, pc);
+    int       op = d ? d->op : OP_SLOW;
+
+    c->hits++;
+    if (!p->block || pc != p->next) { p->block = c; c->entries++; }
+    p->block->insts++;
+    p->next = pc + (d ? d->len : 4);
+    p->nodes[p->node].self++;
+    p->ops[op != OP_SLOW ? op : riscv_prof_slow_op(d)]++;
+    if (op == OP_SLOW || (op >= OP_JAL && op <= OP_BGEU)) p->block = NULL;
+
+    if ((op == OP_JAL || op == OP_JALR) && d->rd == 1) { // call, c.jal and c.jalr link through ra as well
+        if (p->depth == PROF_MAX_DEPTH) p->overflow++;
+        else { p->node = riscv_prof_child(p, p->node, next); p->depth++; }
+    } else if (op == OP_JALR && d->rd == 0 && d->rs1 == 1) { // ret
+        if (p->overflow) p->overflow--;
+        else if (p->depth) { p->node = p->nodes[p->node].parent; p->depth--; }
+    }
+}
+
+// records the branch or jump of an executed instruction, next is the pc it left for
+static void riscv_trace_step(RVTRACE *tr, uint32_t pc, const RVDECODED *d, uint32_t next)
+{
+    int link;
+    if (!d) return;
+    if (d->op >= OP_BEQ && d->op <= OP_BGEU) {
+        riscv_trace_control(tr, next != pc + d->len ? TRACE_CTL_TAKEN : TRACE_CTL_NOT_TAKEN, pc + d->imm);
+    } else if (d->op == OP_JAL) {
+        riscv_trace_control(tr, d->rd == 1 || d->rd == 5 ? TRACE_CTL_CALL : TRACE_CTL_JUMP, next);
+    } else if (d->op == OP_JALR) {
+        link = d->rd == 1 || d->rd == 5;
+        riscv_trace_control(tr, link ? TRACE_CTL_CALL_IND : d->rd == 0 && (d->rs1 == 1 || d->rs1 == 5) ? TRACE_CTL_RET : TRACE_CTL_JUMP_IND, next);
+    }
+}
+
+// profiling and tracing single step through the predecoded instructions whatever engine is selected
+static void riscv_observe_step(RISCV *riscv)
+{
+    uint32_t   pc = riscv->pc;
+    RVDECODED *d  = riscv_dcache_get(riscv, pc), inst;
+    uint64_t   icount = riscv->icount;
+    if (riscv->status & TS_TRAP) return;
+    if (d) inst = *d; // a store into the code may drop the cache entry
+    if (riscv->trace) riscv_trace_fetch(riscv->trace, pc, d ? d->len : 4);
+    riscv_run(riscv);
+    if (riscv->icount == icount) return;
+    if (riscv->prof ) riscv_prof_count(riscv->prof, pc, d ? &inst : NULL, riscv->pc);
+    if (riscv->trace) riscv_trace_step(riscv->trace, pc, d ? &inst : NULL, riscv->pc);
+}
+
+// starts profiling a hart from its current pc
+int riscv_prof_start(RISCV *riscv)
+{
+    RVPROF *p;
+    if (riscv->prof) return 0;
+    if (!(p = calloc(1, sizeof(RVPROF)))) return -1;
+    p->cap   = 1024;
+    p->nodes = malloc(p->cap * sizeof(RVPROFNODE));
+    p->index = malloc(2 * p->cap * sizeof(int32_t));
+    if (!p->nodes || !p->index) { free(p->nodes); free(p->index); free(p); return -1; }
+    memset(p->index, -1, 2 * p->cap * sizeof(int32_t));
+    p->nodes[0].func   = riscv->pc;
+    p->nodes[0].parent = -1;
+    p->nodes[0].self   = 0;
+    p->nnodes = 1;
+    riscv->prof = p;
+    return 0;
+}
+
+static void riscv_prof_free(RVPROF *p)
+{
+    int i;
+    if (!p) return;
+    for (i = 0; i < 1 << (32 - PROF_PAGE_SHIFT); i++) free(p->pages[i]);
+    free(p->nodes);
+    free(p->index);
+    free(p);
+}
+
+typedef struct {
+    uint32_t pc;
+    uint64_t entries, insts;
+} RVPROFBLOCK;
+
+static int riscv_prof_block_cmp(const void *a, const void *b)
+{
+    const RVPROFBLOCK *x = a, *y = b;
+    return x->insts < y->insts ? 1 : x->insts > y->insts ? -1 : 0;
+}
+
+static int riscv_prof_op_cmp(const void *a, const void *b)
+{
+    const uint64_t *x = *(const uint64_t* const*)a, *y = *(const uint64_t* const*)b;
+    return *x < *y ? 1 : *x > *y ? -1 : 0;
+}
+
+static int riscv_prof_io_cmp(const void *a, const void *b)
+{
+    const RVPROFIO *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// writes file.txt with the opcode histogram, the hot blocks and the device accesses of all harts, and file.folded with
+// a line "caller;callee;... instructions" per call path for flamegraph tools
+int riscv_prof_write(RVMACHINE *mach, const char *file, const RVSYMTAB *syms)
+{
+    RVPROF      *p = mach->harts[0]->prof, *q;
+    RVPROFPC    *c, *d;
+    RVPROFBLOCK *blocks = NULL, *more;
+    RVPROFIO    *io, ios[PROF_IO_SIZE];
+    uint64_t     ops[PROF_OP_NUM] = {0}, *order[PROF_OP_NUM], total = 0;
+    uint32_t     nblocks = 0, i, j, n, path[PROF_MAX_DEPTH + 1];
+    char         name[FILENAME_MAX], sym[256];
+    int32_t      node;
+    FILE        *fp;
+    int          h;
+
+    if (!p) return -1;
+    for (h = 0; h < mach->nharts; h++) { // sums the flat counters of the other harts into hart 0
+        if (!(q = mach->harts[h]->prof)) continue;
+        for (i = 0; i < PROF_OP_NUM; i++) ops[i] += q->ops[i];
+        if (q == p) continue;
+        for (i = 0; i < 1 << (32 - PROF_PAGE_SHIFT); i++) {
+            if (!q->pages[i]) continue;
+            for (j = 0; j < 1 << (PROF_PAGE_SHIFT - 1); j++) {
+                if (!q->pages[i][j].hits && !q->pages[i][j].entries) continue;
+                c = riscv_prof_pc(p, (i << PROF_PAGE_SHIFT) + (j << 1));
+                c->hits += q->pages[i][j].hits; c->entries += q->pages[i][j].entries; c->insts += q->pages[i][j].insts;
+            }
+        }
+        for (i = 0; i < PROF_IO_SIZE; i++) {
+            if (!q->io[i].name || !(io = riscv_prof_io_slot(p->io, q->io[i].addr, q->io[i].offset, q->io[i].name))) continue;
+            io->reads  += q->io[i].reads;
+            io->writes += q->io[i].writes;
+        }
+    }
+    for (i = 0; i < PROF_OP_NUM; i++) { total += ops[i]; order[i] = ops + i; }
+    qsort(order, PROF_OP_NUM, sizeof(order[0]), riscv_prof_op_cmp);
+    for (i = 0; i < 1 << (32 - PROF_PAGE_SHIFT); i++) {
+        if (!p->pages[i]) continue;
+        for (j = 0; j < 1 << (PROF_PAGE_SHIFT - 1); j++) {
+            d = p->pages[i] + j;
+            if (!d->entries) continue;
+            if ((nblocks & 1023) == 0) {
+                if (!(more = realloc(blocks, (nblocks + 1024) * sizeof(RVPROFBLOCK)))) { free(blocks); return -1; }
+                blocks = more;
+            }
+            blocks[nblocks].pc      = (i << PROF_PAGE_SHIFT) + (j << 1);
+            blocks[nblocks].entries = d->entries;
+            blocks[nblocks].insts   = d->insts;
+            nblocks++;
+        }
+    }
+    if (blocks) qsort(blocks, nblocks, sizeof(RVPROFBLOCK), riscv_prof_block_cmp);
+
+    snprintf(name, sizeof(name), "%s.txt", file);
+    if (!(fp = fopen(name, "w"))) { free(blocks); return -1; }
+    fprintf(fp, "instructions: %llu, harts: %d\n\nopcodes:\n", (unsigned long long)total, mach->nharts);
+    for (i = 0; i < PROF_OP_NUM && *order[i]; i++) {
+        fprintf(fp, "%-8s %14llu %6.2f%%\n", prof_op_names[order[i] - ops], (unsigned long long)*order[i], total ? *order[i] * 100.0 / total : 0.0);
+    }
+    fprintf(fp, "\nhot blocks:\n%-10s %14s %7s %12s %6s  %s\n", "pc", "insts", "", "entries", "len", "symbol");
+    for (i = 0; i < nblocks && i < PROF_HOT_BLOCKS; i++) {
+        fprintf(fp, "0x%08x %14llu %6.2f%% %12llu %6.1f  %s\n", blocks[i].pc, (unsigned long long)blocks[i].insts,
+            total ? blocks[i].insts * 100.0 / total : 0.0, (unsigned long long)blocks[i].entries,
+            (double)blocks[i].insts / blocks[i].entries, riscv_sym_name(syms, blocks[i].pc, sym, sizeof(sym)));
+    }
+    fprintf(fp, "\ndevice registers:\n%-10s %-8s %8s %12s %12s\n", "address", "region", "offset", "reads", "writes");
+    for (i = n = 0; i < PROF_IO_SIZE; i++) if (p->io[i].name) ios[n++] = p->io[i];
+    qsort(ios, n, sizeof(RVPROFIO), riscv_prof_io_cmp);
+    for (i = 0; i < n; i++) {
+        if (ios[i].offset < 0) snprintf(sym, sizeof(sym), "*");
+        else snprintf(sym, sizeof(sym), "0x%x", ios[i].offset);
+        fprintf(fp, "0x%08x %-8s %8s %12llu %12llu\n", ios[i].addr, ios[i].name, sym, (unsigned long long)ios[i].reads, (unsigned long long)ios[i].writes);
+    }
+    fclose(fp);
+    free(blocks);
+
+    snprintf(name, sizeof(name), "%s.folded", file);
+    if (!(fp = fopen(name, "w"))) return -1;
+    for (h = 0; h < mach->nharts; h++) {
+        if (!(q = mach->harts[h]->prof)) continue;
+        for (i = 0; i < q->nnodes; i++) {
+            if (!q->nodes[i].self) continue;
+            for (n = 0, node = i; node >= 0 && n <= PROF_MAX_DEPTH; node = q->nodes[node].parent) path[n++] = q->nodes[node].func;
+            if (mach->nharts > 1) fprintf(fp, "hart%d;", h);
+            while (n--) fprintf(fp, "%s%c", riscv_sym_name(syms, path[n], sym, sizeof(sym)), n ? ';' : ' ');
+            fprintf(fp, "%llu\n", (unsigned long long)q->nodes[i].self);
+        }
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+static const void **riscv_block_labels;
+
+// runs a translated block, returns the number of guest instructions retired
+static int riscv_block_exec(RISCV *riscv, const RVBLOCK *block)
+{
+    static const void *labels[OP_NUM] = {
+        [OP_SLOW ] = &&do_slow , [OP_LUI  ] = &&do_lui  , [OP_AUIPC] = &&do_auipc, [OP_JAL  ] = &&do_jal  , [OP_JALR ] = &&do_jalr,
+        [OP_BEQ  ] = &&do_beq  , [OP_BNE  ] = &&do_bne  , [OP_BLT  ] = &&do_blt  , [OP_BGE  ] = &&do_bge  ,
+        [OP_BLTU ] = &&do_bltu , [OP_BGEU ] = &&do_bgeu , [OP_LB   ] = &&do_lb   , [OP_LH   ] = &&do_lh   ,
+        [OP_LW   ] = &&do_lw   , [OP_LBU  ] = &&do_lbu  , [OP_LHU  ] = &&do_lhu  , [OP_SB   ] = &&do_sb   ,
+        [OP_SH   ] = &&do_sh   , [OP_SW   ] = &&do_sw   , [OP_ADDI ] = &&do_addi , [OP_SLTI ] = &&do_slti ,
+        [OP_SLTIU] = &&do_sltiu, [OP_XORI ] = &&do_xori , [OP_ORI  ] = &&do_ori  , [OP_ANDI ] = &&do_andi ,
+        [OP_SLLI ] = &&do_slli , [OP_SRLI ] = &&do_srli , [OP_SRAI ] = &&do_srai , [OP_ADD  ] = &&do_add  ,
+        [OP_SUB  ] = &&do_sub  , [OP_SLL  ] = &&do_sll  , [OP_SLT  ] = &&do_slt  , [OP_SLTU ] = &&do_sltu ,
+        [OP_XOR  ] = &&do_xor  , [OP_SRL  ] = &&do_srl  , [OP_SRA  ] = &&do_sra  , [OP_OR   ] = &&do_or   ,
+        [OP_AND  ] = &&do_and  , [OP_MUL  ] = &&do_mul  , [OP_MULH ] = &&do_mulh , [OP_MULHSU] = &&do_mulhsu,
+        [OP_MULHU] = &&do_mulhu, [OP_DIV  ] = &&do_div  , [OP_DIVU ] = &&do_divu , [OP_REM  ] = &&do_rem  ,
+        [OP_REMU ] = &&do_remu , [OP_SH1ADD] = &&do_sh1add, [OP_SH2ADD] = &&do_sh2add, [OP_SH3ADD] = &&do_sh3add,
+        [OP_ANDN ] = &&do_andn , [OP_ORN  ] = &&do_orn  , [OP_XNOR ] = &&do_xnor , [OP_MIN  ] = &&do_min  ,
+        [OP_MINU ] = &&do_minu , [OP_MAX  ] = &&do_max  , [OP_MAXU ] = &&do_maxu , [OP_ROL  ] = &&do_rol  ,
+        [OP_ROR  ] = &&do_ror  , [OP_BCLR ] = &&do_bclr , [OP_BSET ] = &&do_bset , [OP_BINV ] = &&do_binv ,
+        [OP_BEXT ] = &&do_bext , [OP_CLZ  ] = &&do_clz  , [OP_CTZ  ] = &&do_ctz  , [OP_CPOP ] = &&do_cpop ,
+        [OP_SEXTB] = &&do_sextb, [OP_SEXTH] = &&do_sexth, [OP_ZEXTH] = &&do_zexth, [OP_ORCB ] = &&do_orcb ,
+        [OP_REV8 ] = &&do_rev8 , [OP_RORI ] = &&do_rori , [OP_BCLRI] = &&do_bclri, [OP_BSETI] = &&do_bseti,
+        [OP_BINVI] = &&do_binvi, [OP_BEXTI] = &&do_bexti, [OP_EXIT ] = &&do_exit , [OP_FUSE_LI] = &&do_fuse_li, [OP_FUSE_CALL] = &&do_fuse_call,
+        [OP_FUSE_SLT_BEQZ ] = &&do_fuse_slt_beqz , [OP_FUSE_SLT_BNEZ ] = &&do_fuse_slt_bnez ,
+        [OP_FUSE_SLTU_BEQZ] = &&do_fuse_sltu_beqz, [OP_FUSE_SLTU_BNEZ] = &&do_fuse_sltu_bnez,
+        [OP_FUSE_SLTI_BEQZ ] = &&do_fuse_slti_beqz , [OP_FUSE_SLTI_BNEZ ] = &&do_fuse_slti_bnez ,
+        [OP_FUSE_SLTIU_BEQZ] = &&do_fuse_sltiu_beqz, [OP_FUSE_SLTIU_BNEZ] = &&do_fuse_sltiu_bnez,
+    };
+    const RVTHREADED *t;
+    uint32_t temp;
+
+    if (!block) { riscv_block_labels = labels; return 0; }
+    t = block->ops;
+    goto *t->handler;
+
+    #define NEXT()           goto *(++t)->handler
+    #define LEAVE(to)        do { riscv->pc = (to); return t->n; } while (0)
+    #define FAULT()          do { riscv->pc = t->pc; return t->n - 1; } while (0) // the op raised an exception, it did not retire
+    #define MEMCHECK()       if (riscv->status & TS_BREAK) { if (riscv->status & TS_TRAP) FAULT(); LEAVE(t->pc + t->len); }
+    #define LOAD(expr)       temp = (expr); if (riscv->status & TS_BREAK) { if (riscv->status & TS_TRAP) FAULT(); *t->rd = temp; LEAVE(t->pc + t->len); } *t->rd = temp; NEXT()
+    #define IOPOS()          riscv->io_retired = t->n - 1 // the op may read a device
+    #define BRANCH(cond)     if (cond) LEAVE(t->pc + t->imm); NEXT()
+    #define FUSE_CMPB(cond)  temp = (cond); *t->rd = temp; if (!temp) LEAVE(t->pc + t->imm2); NEXT()
+    #define FUSE_CMPBN(cond) temp = (cond); *t->rd = temp; if ( temp) LEAVE(t->pc + t->imm2); NEXT()
+do_lui  : *t->rd = t->imm; NEXT();
+do_auipc: *t->rd = t->pc + t->imm; NEXT();
+do_jal  : *t->rd = t->pc + t->len; LEAVE(t->pc + t->imm);
+do_jalr : temp = *t->rs1 + t->imm; *t->rd = t->pc + t->len; LEAVE(temp & ~1);
+do_beq  : BRANCH(*t->rs1 == *t->rs2);
+do_bne  : BRANCH(*t->rs1 != *t->rs2);
+do_blt  : BRANCH((int32_t)*t->rs1 <  (int32_t)*t->rs2);
+do_bge  : BRANCH((int32_t)*t->rs1 >= (int32_t)*t->rs2);
+do_bltu : BRANCH(*t->rs1 <  *t->rs2);
+do_bgeu : BRANCH(*t->rs1 >= *t->rs2);
+do_lb   : IOPOS(); LOAD((int8_t )riscv_memr8 (riscv, *t->rs1 + t->imm));
+do_lh   : IOPOS(); LOAD((int16_t)riscv_memr16(riscv, *t->rs1 + t->imm));
+do_lw   : IOPOS(); LOAD(riscv_memr32(riscv, *t->rs1 + t->imm));
+do_lbu  : IOPOS(); LOAD(riscv_memr8 (riscv, *t->rs1 + t->imm));
+do_lhu  : IOPOS(); LOAD(riscv_memr16(riscv, *t->rs1 + t->imm));
+do_sb   : riscv_memw8 (riscv, *t->rs1 + t->imm, (uint8_t )*t->rs2); MEMCHECK(); NEXT();
+do_sh   : riscv_memw16(riscv, *t->rs1 + t->imm, (uint16_t)*t->rs2); MEMCHECK(); NEXT();
+do_sw   : riscv_memw32(riscv, *t->rs1 + t->imm, *t->rs2); MEMCHECK(); NEXT();
+do_addi : *t->rd = *t->rs1 + t->imm; NEXT();
+do_slti : *t->rd = (int32_t)*t->rs1 < t->imm; NEXT();
+do_sltiu: *t->rd = *t->rs1 < (uint32_t)t->imm; NEXT();
+do_xori : *t->rd = *t->rs1 ^ t->imm; NEXT();
+do_ori  : *t->rd = *t->rs1 | t->imm; NEXT();
+do_andi : *t->rd = *t->rs1 & t->imm; NEXT();
+do_slli : *t->rd = *t->rs1 << (t->imm & 0x1f); NEXT();
+do_srli : *t->rd = *t->rs1 >> (t->imm & 0x1f); NEXT();
+do_srai : *t->rd = (int32_t)*t->rs1 >> (t->imm & 0x1f); NEXT();
+do_add  : *t->rd = *t->rs1 + *t->rs2; NEXT();
+do_sub  : *t->rd = *t->rs1 - *t->rs2; NEXT();
+do_sll  : *t->rd = *t->rs1 << (*t->rs2 & 0x1f); NEXT();
+do_slt  : *t->rd = (int32_t)*t->rs1 < (int32_t)*t->rs2; NEXT();
+do_sltu : *t->rd = *t->rs1 < *t->rs2; NEXT();
+do_xor  : *t->rd = *t->rs1 ^ *t->rs2; NEXT();
+do_srl  : *t->rd = *t->rs1 >> (*t->rs2 & 0x1f); NEXT();
+do_sra  : *t->rd = (int32_t)*t->rs1 >> (*t->rs2 & 0x1f); NEXT();
+do_or   : *t->rd = *t->rs1 | *t->rs2; NEXT();
+do_and  : *t->rd = *t->rs1 & *t->rs2; NEXT();
+do_mul  : *t->rd = *t->rs1 * *t->rs2; NEXT();
+do_mulh : *t->rd = riscv_mulh  (*t->rs1, *t->rs2); NEXT();
+do_mulhsu:*t->rd = riscv_mulhsu(*t->rs1, *t->rs2); NEXT();
+do_mulhu: *t->rd = (uint32_t)(((uint64_t)*t->rs1 * (uint64_t)*t->rs2) >> 32); NEXT();
+do_div  : *t->rd = riscv_div (*t->rs1, *t->rs2); NEXT();
+do_divu : *t->rd = riscv_divu(*t->rs1, *t->rs2); NEXT();
+do_rem  : *t->rd = riscv_rem (*t->rs1, *t->rs2); NEXT();
+do_remu : *t->rd = riscv_remu(*t->rs1, *t->rs2); NEXT();
+do_sh1add:*t->rd = (*t->rs1 << 1) + *t->rs2; NEXT();
+do_sh2add:*t->rd = (*t->rs1 << 2) + *t->rs2; NEXT();
+do_sh3add:*t->rd = (*t->rs1 << 3) + *t->rs2; NEXT();
+do_andn : *t->rd = *t->rs1 & ~*t->rs2; NEXT();
+do_orn  : *t->rd = *t->rs1 | ~*t->rs2; NEXT();
+do_xnor : *t->rd = ~(*t->rs1 ^ *t->rs2); NEXT();
+do_min  : *t->rd = (int32_t)*t->rs1 < (int32_t)*t->rs2 ? *t->rs1 : *t->rs2; NEXT();
+do_minu : *t->rd = *t->rs1 < *t->rs2 ? *t->rs1 : *t->rs2; NEXT();
+do_max  : *t->rd = (int32_t)*t->rs1 > (int32_t)*t->rs2 ? *t->rs1 : *t->rs2; NEXT();
+do_maxu : *t->rd = *t->rs1 > *t->rs2 ? *t->rs1 : *t->rs2; NEXT();
+do_rol  : *t->rd = riscv_rol(*t->rs1, *t->rs2); NEXT();
+do_ror  : *t->rd = riscv_ror(*t->rs1, *t->rs2); NEXT();
+do_bclr : *t->rd = *t->rs1 & ~(1u << (*t->rs2 & 0x1f)); NEXT();
+do_bset : *t->rd = *t->rs1 |  (1u << (*t->rs2 & 0x1f)); NEXT();
+do_binv : *t->rd = *t->rs1 ^  (1u << (*t->rs2 & 0x1f)); NEXT();
+do_bext : *t->rd = (*t->rs1 >> (*t->rs2 & 0x1f)) & 1; NEXT();
+do_clz  : *t->rd = riscv_clz (*t->rs1); NEXT();
+do_ctz  : *t->rd = riscv_ctz (*t->rs1); NEXT();
+do_cpop : *t->rd = riscv_cpop(*t->rs1); NEXT();
+do_sextb: *t->rd = (int8_t  )*t->rs1; NEXT();
+do_sexth: *t->rd = (int16_t )*t->rs1; NEXT();
+do_zexth: *t->rd = (uint16_t)*t->rs1; NEXT();
+do_orcb : *t->rd = riscv_orcb(*t->rs1); NEXT();
+do_rev8 : *t->rd = __builtin_bswap32(*t->rs1); NEXT();
+do_rori : *t->rd = riscv_ror(*t->rs1, t->imm); NEXT();
+do_bclri: *t->rd = *t->rs1 & ~(1u << t->imm); NEXT();
+do_bseti: *t->rd = *t->rs1 |  (1u << t->imm); NEXT();
+do_binvi: *t->rd = *t->rs1 ^  (1u << t->imm); NEXT();
+do_bexti: *t->rd = (*t->rs1 >> t->imm) & 1; NEXT();
+do_exit : LEAVE(t->pc);
+do_slow :
+    IOPOS();
+    riscv->pc = t->pc;
+    if (t->len == 2) riscv_execute_rv16(riscv, (uint16_t)t->imm);
+    else             riscv_execute_rv32(riscv, (uint32_t)t->imm);
+    riscv->x[0] = 0;
+    if (riscv->status & TS_TRAP) FAULT();
+    return t->n;
+do_fuse_li  : *t->rd = t->imm; NEXT();
+do_fuse_call: temp = t->pc + t->imm; *t->rd = temp; *t->rs2 = t->pc + t->len; LEAVE((temp + t->imm2) & ~1);
+do_fuse_slt_beqz  : FUSE_CMPB ((int32_t)*t->rs1 < (int32_t)*t->rs2);
+do_fuse_slt_bnez  : FUSE_CMPBN((int32_t)*t->rs1 < (int32_t)*t->rs2);
+do_fuse_sltu_beqz : FUSE_CMPB (*t->rs1 < *t->rs2);
+do_fuse_sltu_bnez : FUSE_CMPBN(*t->rs1 < *t->rs2);
+do_fuse_slti_beqz : FUSE_CMPB ((int32_t)*t->rs1 < t->imm);
+do_fuse_slti_bnez : FUSE_CMPBN((int32_t)*t->rs1 < t->imm);
+do_fuse_sltiu_beqz: FUSE_CMPB (*t->rs1 < (uint32_t)t->imm);
+do_fuse_sltiu_bnez: FUSE_CMPBN(*t->rs1 < (uint32_t)t->imm);
+    #undef NEXT
+    #undef LEAVE
+    #undef FAULT
+    #undef MEMCHECK
+    #undef LOAD
+    #undef BRANCH
+    #undef FUSE_CMPB
+    #undef FUSE_CMPBN
+}
+
+// decodes the instruction at pc of a block, which stays in the page it starts in while fetches are translated
+static int riscv_block_decode(RISCV *riscv, const RVBLOCK *block, uint32_t pc, RVDECODED *d)
+{
+    uint32_t   ppc = block->ppc + (pc - block->pc);
+    RVDECODED *c   = riscv->dcache + ((ppc >> 1) & (DCACHE_SIZE - 1));
+    if ((block->vm & VM_FETCH) && ((pc ^ block->pc) >> 12)) return 0;
+    if ((c->pc != pc || c->ppc != ppc) && !riscv_decode(riscv, pc, ppc, c)) return 0;
+    *d = *c;
+    return 1;
+}
+
+static void riscv_block_emit(RISCV *riscv, RVTHREADED *t, int op, const RVDECODED *d)
+{
+    t->handler = riscv_block_labels[op];
+    t->rd      = d->rd ? riscv->x + d->rd : &riscv->xsink;
+    t->rs1     = riscv->x + d->rs1;
+    t->rs2     = riscv->x + d->rs2;
+    t->imm     = op == OP_SLOW ? (int32_t)d->inst : d->imm;
+    t->imm2    = 0;
+    t->pc      = d->pc;
+    t->len     = d->len;
+}
+
+// tries to fuse d with the following instruction n, returns the fused op or 0
+static int riscv_block_fuse(const RVDECODED *d, const RVDECODED *n)
+{
+    static const uint8_t ops_cmpb[4][2] = {
+        { OP_FUSE_SLT_BEQZ , OP_FUSE_SLT_BNEZ  }, { OP_FUSE_SLTU_BEQZ , OP_FUSE_SLTU_BNEZ  },
+        { OP_FUSE_SLTI_BEQZ, OP_FUSE_SLTI_BNEZ }, { OP_FUSE_SLTIU_BEQZ, OP_FUSE_SLTIU_BNEZ },
+    };
+    if (d->rd == 0) return 0;
+    switch (d->op) {
+    case OP_LUI  : return n->op == OP_ADDI && n->rd == d->rd && n->rs1 == d->rd ? OP_FUSE_LI : 0;
+    case OP_AUIPC: return n->op == OP_JALR && n->rs1 == d->rd ? OP_FUSE_CALL : 0;
+    case OP_SLT  : case OP_SLTU: case OP_SLTI: case OP_SLTIU:
+        if ((n->op != OP_BEQ && n->op != OP_BNE) || n->rs1 != d->rd || n->rs2 != 0) return 0;
+        return ops_cmpb[d->op == OP_SLT ? 0 : d->op == OP_SLTU ? 1 : d->op == OP_SLTI ? 2 : 3][n->op == OP_BNE];
+    }
+    return 0;
+}
+
+// a block starting with nops, one addi stepping a counter and a branch back to the block that compares the counter
+// with x0 or another register is a counting loop, returns the instructions per iteration or 0 if it is none
+static int riscv_block_loop(RISCV *riscv, RVBLOCK *block)
+{
+    RVDECODED d;
+    uint32_t  pc  = block->pc;
+    int       reg = 0, n;
+    for (n = 1; n < BLOCK_MAX_INSTS && riscv_block_decode(riscv, block, pc, &d); n++, pc += d.len) {
+        if (d.op >= OP_BEQ && d.op <= OP_BGEU) break;
+        if (d.op == OP_SLOW || d.op == OP_JAL || d.op == OP_JALR || (d.op >= OP_LB && d.op <= OP_SW)) return 0;
+        if (d.rd == 0) continue;
+        if (d.op != OP_ADDI || d.rs1 != d.rd || !d.imm || reg) return 0;
+        reg              = d.rd;
+        block->loop_step = d.imm;
+    }
+    if (!reg || d.op < OP_BNE || d.op > OP_BGEU || d.pc + d.imm != block->pc) return 0;
+    if (d.rs1 == d.rs2 || (d.rs1 != reg && d.rs2 != reg)) return 0;
+    block->loop_reg  = reg;
+    block->loop_swap = d.rs2 == reg;
+    block->loop_cmp  = block->loop_swap ? d.rs1 : d.rs2;
+    block->loop_op   = d.op;
+    return n;
+}
+
+// whether the branch back of a counting loop is taken in iteration j, a counter that would wrap around first counts
+// as leaving the loop
+static int riscv_loop_taken(const RVBLOCK *block, uint32_t r, uint32_t s, uint64_t j)
+{
+    int     sign = block->loop_op == OP_BLT || block->loop_op == OP_BGE;
+    int64_t a    = (sign ? (int64_t)(int32_t)r : (int64_t)r) + (int64_t)j * block->loop_step;
+    int64_t b    =  sign ? (int64_t)(int32_t)s : (int64_t)s, t;
+    if (sign ? a != (int32_t)a : a != (uint32_t)a) return 0;
+    if (block->loop_swap) { t = a; a = b; b = t; }
+    return block->loop_op == OP_BLT || block->loop_op == OP_BLTU ? a < b : a >= b;
+}
+
+// fast-forwards the counting loop a block starts with to its last iteration or as far as stop allows, the skipped
+// iterations would only have stepped the counter
+static void riscv_loop_skip(RISCV *riscv, const RVBLOCK *block, uint64_t stop)
+{
+    uint32_t r = riscv->x[block->loop_reg], s = riscv->x[block->loop_cmp], c = block->loop_step, d = s - r, inv;
+    uint64_t max = (stop - riscv->icount - 1) / block->loop_len, lo = 0, hi, mid; // the engine runs one instruction after
+    int      t, i;
+    if (block->loop_op == OP_BNE) { // the first j with r + j * c == s mod 2^32, c = odd << t
+        t = __builtin_ctz(c);
+        if (d & ((1u << t) - 1)) {
+            lo = max;
+        } else {
+            c >>= t;
+            for (inv = c, i = 0; i < 4; i++) inv *= 2 - c * inv;
+            d  = (d >> t) * inv;
+            if (t) d &= (1u << (32 - t)) - 1;
+            lo = (d ? d : 1ull << (32 - t)) - 1;
+            if (lo > max) lo = max;
+        }
+    } else if (riscv_loop_taken(block, r, s, 1)) { // taken in a run of iterations from the first one
+        hi = ((1ull << 33) / (block->loop_step < 0 ? -(int64_t)block->loop_step : block->loop_step)) + 1;
+        if (hi > max) hi = max;
+        while (lo < hi) {
+            mid = hi - (hi - lo) / 2;
+            if (riscv_loop_taken(block, r, s, mid)) lo = mid; else hi = mid - 1;
+        }
+    }
+    riscv->x[block->loop_reg] += (uint32_t)(lo * (uint32_t)block->loop_step);
+    riscv->icount  += lo * block->loop_len;
+    riscv->skipped += lo * block->loop_len;
+}
+
+static RVBLOCK* riscv_block_translate(RISCV *riscv, uint32_t pc, uint32_t ppc)
+{
+    RVDECODED   d, n;
+    RVBLOCK    *block;
+    RVTHREADED *t;
+    int         op, end = 0;
+
+    if (!riscv_block_labels) riscv_block_exec(riscv, NULL);
+    if (!riscv->bcache) {
+        riscv->bcache = calloc(BCACHE_SIZE, sizeof(RVBLOCK*));
+        riscv->bpage  = calloc(BPAGE_SIZE , sizeof(RVBLOCK*));
+        riscv->bpool  = malloc(BPOOL_SIZE * sizeof(RVBLOCK));
+        if (!riscv->bcache || !riscv->bpage || !riscv->bpool) return NULL;
+    }
+    if (riscv->bpool_used == BPOOL_SIZE) riscv_block_flush(riscv);
+
+    block = riscv->bpool + riscv->bpool_used;
+    block->pc    = pc;
+    block->ppc   = ppc;
+    block->vm    = riscv->vm;
+    if (!riscv_block_decode(riscv, block, pc, &d)) return NULL;
+    riscv->bpool_used++;
+    block->ninst = 0;
+    block->hits  = 0;
+    block->jit   = NULL;
+    for (t = block->ops; !end; t++) {
+        if (block->ninst + 2 > BLOCK_MAX_INSTS) {
+            t->handler = riscv_block_labels[OP_EXIT];
+            t->pc      = pc;
+            t->n       = block->ninst;
+            break;
+        }
+        op = d.op;
+        if (op != OP_SLOW && riscv_block_decode(riscv, block, pc + d.len, &n) && (op = riscv_block_fuse(&d, &n))) {
+            riscv_block_emit(riscv, t, op, &d);
+            switch (op) {
+            case OP_FUSE_LI  : t->imm  = d.imm + n.imm; break;
+            case OP_FUSE_CALL: t->imm2 = n.imm; t->rs2 = n.rd ? riscv->x + n.rd : &riscv->xsink; break;
+            default          : t->imm2 = d.len + n.imm; break; // compare and branch, imm2 is relative to the compare
+            }
+            t->len += n.len;
+            block->ninst += 2;
+            d = n;
+        } else {
+            riscv_block_emit(riscv, t, d.op, &d);
+            block->ninst++;
+        }
+        t->n = block->ninst;
+        pc   = d.pc + d.len;
+        end  = d.op == OP_JAL || d.op == OP_JALR || d.op == OP_SLOW;
+        if (!end && !riscv_block_decode(riscv, block, pc, &d)) {
+            (++t)->handler = riscv_block_labels[OP_EXIT];
+            t->pc = pc;
+            t->n  = block->ninst;
+            break;
+        }
+    }
+    block->loop_len  = riscv_block_loop(riscv, block);
+    block->len       = pc - block->pc;
+    block->page_next = riscv->bpage[((ppc & (riscv->mem_size - 1)) >> 12) & (BPAGE_SIZE - 1)];
+    riscv->bpage[((ppc & (riscv->mem_size - 1)) >> 12) & (BPAGE_SIZE - 1)] = block;
+    riscv->bcache[(block->pc >> 1) & (BCACHE_SIZE - 1)] = block;
+    return block;
+}
+
+#if FFVM_JIT
+// x86-64 host registers
+#define HR_RAX 0
+#define HR_RCX 1
+#define HR_RDX 2
+#define HR_RBX 3
+#define HR_RBP 5
+#define HR_RSI 6
+#define HR_RDI 7
+#define HR_R12 12
+#define HR_R13 13
+#define HR_R14 14
+#define HR_R15 15
+
+// condition codes for jcc, setcc and cmovcc
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_G  0xf
+
+#define JIT_MAX_INSTS     64
+#define JIT_MAX_INST_SIZE 384 // worst case host bytes emitted for one guest instruction
+#define JOFF(field)       ((int32_t)offsetof(RISCV, field))
+
+typedef struct {
+    RISCV   *riscv;
+    const RVBLOCK *block;
+    uint8_t *p;         // emit cursor
+    int8_t   hreg[32];  // host register caching a guest register, -1 if it lives in x[]
+    uint32_t dirty;     // guest registers modified in their host register
+    uint32_t ninst;     // guest instructions in the compiled block
+} JITCTX;
+
+// callee-saved registers survive the helper calls, rbp holds the RISCV pointer
+static const int jit_alloc_regs[] = { HR_RBX, HR_R12, HR_R13, HR_R14, HR_R15 };
+
+static void jit_b(JITCTX *c, uint8_t b ) { *c->p++ = b; }
+static void jit_d(JITCTX *c, uint32_t d) { memcpy(c->p, &d, 4); c->p += 4; }
+static void jit_q(JITCTX *c, uint64_t q) { memcpy(c->p, &q, 8); c->p += 8; }
+
+static void jit_rex(JITCTX *c, int w, int reg, int rm)
+{
+    const uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40) jit_b(c, rex);
+}
+
+// op reg, [rbp + disp32]
+static void jit_mem(JITCTX *c, int w, uint8_t op, int reg, int32_t disp)
+{
+    jit_rex(c, w, reg, 0);
+    jit_b(c, op);
+    jit_b(c, 0x80 | ((reg & 7) << 3) | 5);
+    jit_d(c, disp);
+}
+
+// op reg, [base + index] on the low registers, base not rbp, prefix 0x66 for 16-bit, op2 for two byte opcodes
+static void jit_mem_idx(JITCTX *c, int prefix, uint8_t op, uint8_t op2, int reg, int base, int index)
+{
+    if (prefix) jit_b(c, (uint8_t)prefix);
+    jit_b(c, op);
+    if (op == 0x0f) jit_b(c, op2);
+    jit_b(c, 0x04 | ((reg & 7) << 3));
+    jit_b(c, (uint8_t)((index << 3) | base));
+}
+
+// op dst, src with dst in the r/m field
+static void jit_rr(JITCTX *c, int w, uint8_t op, int dst, int src)
+{
+    jit_rex(c, w, src, dst);
+    jit_b(c, op);
+    jit_b(c, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// group 1 alu with imm32: ext 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp
+static void jit_ri(JITCTX *c, int ext, int dst, int32_t imm)
+{
+    jit_rex(c, 0, 0, dst);
+    jit_b(c, 0x81);
+    jit_b(c, 0xc0 | (ext << 3) | (dst & 7));
+    jit_d(c, imm);
+}
+
+// group 2 shift of eax: ext 0 rol, 1 ror, 4 shl, 5 shr, 7 sar, by imm or cl if imm < 0
+static void jit_shift(JITCTX *c, int ext, int imm)
+{
+    if (imm < 0) { jit_b(c, 0xd3); jit_b(c, 0xc0 | (ext << 3)); }
+    else         { jit_b(c, 0xc1); jit_b(c, 0xc0 | (ext << 3)); jit_b(c, (uint8_t)imm); }
+}
+
+static void jit_mov_ri(JITCTX *c, int reg, uint32_t imm)
+{
+    jit_rex(c, 0, 0, reg);
+    jit_b(c, 0xb8 | (reg & 7));
+    jit_d(c, imm);
+}
+
+// setcc al, movzx eax, al
+static void jit_setcc(JITCTX *c, int cc)
+{
+    jit_b(c, 0x0f); jit_b(c, 0x90 | cc); jit_b(c, 0xc0);
+    jit_b(c, 0x0f); jit_b(c, 0xb6); jit_b(c, 0xc0);
+}
+
+// jcc rel32 / jmp rel32, returns the rel32 to patch
+static uint8_t* jit_jcc(JITCTX *c, int cc)
+{
+    if (cc < 0) jit_b(c, 0xe9);
+    else { jit_b(c, 0x0f); jit_b(c, 0x80 | cc); }
+    jit_d(c, 0);
+    return c->p - 4;
+}
+
+static void jit_patch(uint8_t *rel, const uint8_t *target)
+{
+    const int32_t d = (int32_t)(target - (rel + 4));
+    memcpy(rel, &d, 4);
+}
+
+static void jit_call(JITCTX *c, const void *fn)
+{
+    jit_b(c, 0x48); jit_b(c, 0xb8); jit_q(c, (uint64_t)(uintptr_t)fn); // mov rax, fn
+    jit_b(c, 0xff); jit_b(c, 0xd0);                                       // call rax
+}
+
+static void jit_get(JITCTX *c, int hr, int g)
+{
+    if (g == 0) jit_rr(c, 0, 0x31, hr, hr);
+    else if (c->hreg[g] >= 0) jit_rr(c, 0, 0x89, hr, c->hreg[g]);
+    else jit_mem(c, 0, 0x8b, hr, JOFF(x) + 4 * g);
+}
+
+static void jit_put(JITCTX *c, int g, int hr)
+{
+    if (g == 0) return;
+    if (c->hreg[g] >= 0) {
+        jit_rr(c, 0, 0x89, c->hreg[g], hr);
+        c->dirty |= 1u << g;
+    } else {
+        jit_mem(c, 0, 0x89, hr, JOFF(x) + 4 * g);
+    }
+}
+
+static void jit_writeback(JITCTX *c)
+{
+    int g;
+    for (g = 1; g < 32; g++) {
+        if (c->dirty & (1u << g)) jit_mem(c, 0, 0x89, c->hreg[g], JOFF(x) + 4 * g);
+    }
+}
+
+// leaves the block with the guest pc in eax (pc == 0) or constant pc, chain allows patching the jmp to the next block
+static void jit_exit(JITCTX *c, uint32_t retired, int chain, int dynamic, uint32_t pc)
+{
+    RISCV *riscv = c->riscv;
+    jit_writeback(c);
+    if (retired < c->ninst) { // give back the budget of the instructions not executed
+        jit_b(c, 0x48); jit_b(c, 0x81); jit_b(c, 0x85); jit_d(c, JOFF(jit_budget)); jit_d(c, c->ninst - retired);
+    }
+    if (dynamic) jit_mem(c, 0, 0x89, HR_RAX, JOFF(pc));
+    else { jit_b(c, 0xc7); jit_b(c, 0x85); jit_d(c, JOFF(pc)); jit_d(c, pc); }
+    if (chain) {
+        jit_b(c, 0x48); jit_b(c, 0x8d); jit_b(c, 0x05); jit_d(c, 8);   // lea rax, [rip + 8], the rel32 of the jmp below
+        jit_mem(c, 1, 0x89, HR_RAX, JOFF(jit_patch));
+    } else {
+        jit_b(c, 0x48); jit_b(c, 0xc7); jit_b(c, 0x85); jit_d(c, JOFF(jit_patch)); jit_d(c, 0);
+    }
+    jit_patch(jit_jcc(c, -1), riscv->jit_code + riscv->jit_exit);
+}
+
+// whether an exit to pc may be patched into a jmp to the block there, with fetches translated only within the page of
+// the block, which riscv_run_n translated
+static int jit_chainable(JITCTX *c, uint32_t pc)
+{
+    return !(c->block->vm & VM_FETCH) || !((pc ^ c->block->pc) >> 12);
+}
+
+// after a helper call of a block with translated loads and stores: leave the block at a faulting access without
+// retiring it
+static void jit_check_trap(JITCTX *c, uint32_t retired, uint32_t pc)
+{
+    uint8_t *skip;
+    if (!(c->block->vm & VM_DATA)) return;
+    jit_b(c, 0xf7); jit_b(c, 0x85); jit_d(c, JOFF(status)); jit_d(c, TS_TRAP);
+    skip = jit_jcc(c, CC_E);
+    jit_exit(c, retired - 1, 0, 0, pc);
+    jit_patch(skip, c->p);
+}
+
+// after a helper call: leave the block if the access asked the engine to stop
+static void jit_check_status(JITCTX *c, uint32_t retired, uint32_t next_pc)
+{
+    uint8_t *skip;
+    jit_b(c, 0xf7); jit_b(c, 0x85); jit_d(c, JOFF(status)); jit_d(c, TS_BREAK);
+    skip = jit_jcc(c, CC_E);
+    jit_exit(c, retired, 0, 0, next_pc);
+    jit_patch(skip, c->p);
+}
+
+// loads get the instructions of the entered block not retired before them to place device reads
+#define JIT_IOPOS(pending) riscv->io_retired = (uint32_t)(riscv->jit_start - riscv->jit_budget) - pending
+static uint32_t jit_memr8 (RISCV *riscv, uint32_t addr, uint32_t pending) { JIT_IOPOS(pending); return riscv_memr8 (riscv, addr); }
+static uint32_t jit_memr16(RISCV *riscv, uint32_t addr, uint32_t pending) { JIT_IOPOS(pending); return riscv_memr16(riscv, addr); }
+static uint32_t jit_memr32(RISCV *riscv, uint32_t addr, uint32_t pending) { JIT_IOPOS(pending); return riscv_memr32(riscv, addr); }
+static void jit_memw8 (RISCV *riscv, uint32_t addr, uint32_t data) { riscv_memw8 (riscv, addr, (uint8_t )data); }
+static void jit_memw16(RISCV *riscv, uint32_t addr, uint32_t data) { riscv_memw16(riscv, addr, (uint16_t)data); }
+static void jit_memw32(RISCV *riscv, uint32_t addr, uint32_t data) { riscv_memw32(riscv, addr, data); }
+
+// tlb probe of a load or store of a block with translated loads and stores, address in eax: an aligned access that
+// hits leaves the host page in rdx and the offset in it in rsi, returns the jcc to patch to the miss path
+static uint8_t* jit_tlb_probe(JITCTX *c, int size, int tag)
+{
+    uint8_t *miss;
+    jit_rr(c, 0, 0x89, HR_RDX, HR_RAX);
+    jit_b(c, 0xc1); jit_b(c, 0xea); jit_b(c, 12);                               // shr edx, 12
+    jit_ri(c, 4, HR_RDX, TLB_SIZE - 1);
+    jit_b(c, 0x69); jit_b(c, 0xd2); jit_d(c, sizeof(RVTLB));                    // imul edx, edx, sizeof(RVTLB)
+    jit_mem(c, 1, 0x03, HR_RDX, JOFF(dtlb));                                    // add rdx, [rbp + dtlb]
+    jit_rr(c, 0, 0x89, HR_RSI, HR_RAX);
+    jit_ri(c, 4, HR_RSI, (int32_t)(~0xfffu | (size - 1)));
+    jit_b(c, 0x3b); jit_b(c, 0x72); jit_b(c, (uint8_t)tag);                     // cmp esi, [rdx + tag]
+    miss = jit_jcc(c, CC_NE);
+    jit_b(c, 0x48); jit_b(c, 0x8b); jit_b(c, 0x52); jit_b(c, offsetof(RVTLB, host)); // mov rdx, [rdx + host]
+    jit_rr(c, 0, 0x89, HR_RSI, HR_RAX);
+    jit_ri(c, 4, HR_RSI, 0xfff);
+    return miss;
+}
+
+// load of size 1, 2 or 4 into guest rd, ram at address 0 or a page the tlb holds is accessed inline and everything
+// else goes through riscv_memr*, lb and lh sign extend
+static void jit_load(JITCTX *c, const RVDECODED *d, int size, uint32_t retired)
+{
+    static const void *helpers[] = { NULL, jit_memr8, jit_memr16, NULL, jit_memr32 };
+    int      sx = d->op == OP_LB || d->op == OP_LH, index = HR_RAX;
+    uint8_t *slow, *done;
+
+    jit_get(c, HR_RAX, d->rs1);
+    if (d->imm) jit_ri(c, 0, HR_RAX, d->imm);
+    if (c->block->vm & VM_DATA) {
+        slow  = jit_tlb_probe(c, size, offsetof(RVTLB, tag_r));
+        index = HR_RSI;
+    } else {
+        jit_ri(c, 7, HR_RAX, c->riscv->mem_size - size + 1);
+        slow = jit_jcc(c, CC_AE);
+        jit_mem(c, 1, 0x8b, HR_RDX, JOFF(mem));                               // mov rdx, [rbp + mem]
+    }
+    switch (size) {
+    case 1: jit_mem_idx(c, 0, 0x0f, sx ? 0xbe : 0xb6, HR_RCX, HR_RDX, index); break; // movsx/movzx ecx, byte
+    case 2: jit_mem_idx(c, 0, 0x0f, sx ? 0xbf : 0xb7, HR_RCX, HR_RDX, index); break; // movsx/movzx ecx, word
+    case 4: jit_mem_idx(c, 0, 0x8b, 0   , HR_RCX, HR_RDX, index); break; // mov ecx, dword
+    }
+    jit_put(c, d->rd, HR_RCX);
+    done = jit_jcc(c, -1);
+
+    jit_patch(slow, c->p);
+    jit_rr(c, 1, 0x89, HR_RDI, HR_RBP);
+    jit_rr(c, 0, 0x89, HR_RSI, HR_RAX);
+    jit_mov_ri(c, HR_RDX, c->ninst - retired + 1);
+    jit_call(c, helpers[size]);
+    if (sx) { jit_b(c, 0x0f); jit_b(c, size == 1 ? 0xbe : 0xbf); jit_b(c, 0xc0); } // movsx eax, al/ax
+    jit_check_trap(c, retired, d->pc);
+    jit_put(c, d->rd, HR_RAX);
+    jit_check_status(c, retired, d->pc + d->len);
+    jit_patch(done, c->p);
+}
+
+// store of size 1, 2 or 4, stores outside ram at address 0 or the pages the tlb holds writable, unaligned or into
+// flagged codemap granules go through riscv_memw*
+static void jit_store(JITCTX *c, const RVDECODED *d, int size, uint32_t retired)
+{
+    static const void *helpers[] = { NULL, jit_memw8, jit_memw16, NULL, jit_memw32 };
+    uint8_t *slow_ram, *slow_align = NULL, *slow_code, *done;
+    int      index = HR_RAX;
+
+    jit_get(c, HR_RAX, d->rs1);
+    if (d->imm) jit_ri(c, 0, HR_RAX, d->imm);
+    jit_get(c, HR_RCX, d->rs2);
+    if (c->block->vm & VM_DATA) {
+        slow_ram = jit_tlb_probe(c, size, offsetof(RVTLB, tag_w));
+        jit_b(c, 0x48); jit_b(c, 0x8d); jit_b(c, 0x3c); jit_b(c, 0x32);         // lea rdi, [rdx + rsi]
+        jit_mem(c, 1, 0x2b, HR_RDI, JOFF(mem));                                  // sub rdi, [rbp + mem]
+        jit_b(c, 0x48); jit_b(c, 0xc1); jit_b(c, 0xef); jit_b(c, CODEMAP_SHIFT); // shr rdi, CODEMAP_SHIFT
+        jit_mem(c, 1, 0x03, HR_RDI, JOFF(codemap));                              // add rdi, [rbp + codemap]
+        jit_b(c, 0x80); jit_b(c, 0x3f); jit_b(c, 0);                             // cmp byte [rdi], 0
+        slow_code = jit_jcc(c, CC_NE);
+        index     = HR_RSI;
+    } else {
+        jit_ri(c, 7, HR_RAX, c->riscv->mem_size - size + 1);
+        slow_ram = jit_jcc(c, CC_AE);
+        if (size >= 2) { jit_b(c, 0xa8); jit_b(c, (uint8_t)(size - 1)); slow_align = jit_jcc(c, CC_NE); } // aligned stores never straddle a codemap granule
+        jit_rr(c, 0, 0x89, HR_RDX, HR_RAX);
+        jit_b(c, 0xc1); jit_b(c, 0xea); jit_b(c, CODEMAP_SHIFT);                // shr edx, CODEMAP_SHIFT
+        jit_mem(c, 1, 0x8b, HR_RSI, JOFF(codemap));                              // mov rsi, [rbp + codemap]
+        jit_mem_idx(c, 0, 0x80, 0, 7, HR_RSI, HR_RDX); jit_b(c, 0);              // cmp byte [rsi + rdx], 0
+        slow_code = jit_jcc(c, CC_NE);
+        jit_mem(c, 1, 0x8b, HR_RDX, JOFF(mem));                                  // mov rdx, [rbp + mem]
+    }
+    switch (size) {
+    case 1: jit_mem_idx(c, 0   , 0x88, 0, HR_RCX, HR_RDX, index); break;
+    case 2: jit_mem_idx(c, 0x66, 0x89, 0, HR_RCX, HR_RDX, index); break;
+    case 4: jit_mem_idx(c, 0   , 0x89, 0, HR_RCX, HR_RDX, index); break;
+    }
+    done = jit_jcc(c, -1);
+
+    jit_patch(slow_ram, c->p);
+    if (slow_align) jit_patch(slow_align, c->p);
+    jit_patch(slow_code, c->p);
+    jit_rr(c, 1, 0x89, HR_RDI, HR_RBP);
+    jit_rr(c, 0, 0x89, HR_RSI, HR_RAX);
+    jit_rr(c, 0, 0x89, HR_RDX, HR_RCX);
+    jit_call(c, helpers[size]);
+    jit_check_trap(c, retired, d->pc);
+    jit_check_status(c, retired, d->pc + d->len);
+    jit_patch(done, c->p);
+}
+
+static void jit_branch(JITCTX *c, const RVDECODED *d, int skip_cc, uint32_t retired)
+{
+    uint8_t *skip;
+    jit_get(c, HR_RAX, d->rs1);
+    jit_get(c, HR_RCX, d->rs2);
+    jit_rr(c, 0, 0x39, HR_RAX, HR_RCX);
+    skip = jit_jcc(c, skip_cc);
+    jit_exit(c, retired, jit_chainable(c, d->pc + d->imm), 0, d->pc + d->imm);
+    jit_patch(skip, c->p);
+}
+
+static void jit_alu(JITCTX *c, const RVDECODED *d)
+{
+    static const void *helpers[] = { riscv_mulh, riscv_mulhsu, NULL, riscv_div, riscv_divu, riscv_rem, riscv_remu };
+
+    switch (d->op) {
+    case OP_LUI  : jit_mov_ri(c, HR_RAX, d->imm); break;
+    case OP_AUIPC: jit_mov_ri(c, HR_RAX, d->pc + d->imm); break;
+    case OP_ADDI : case OP_XORI: case OP_ORI: case OP_ANDI:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_ri(c, d->op == OP_ADDI ? 0 : d->op == OP_XORI ? 6 : d->op == OP_ORI ? 1 : 4, HR_RAX, d->imm);
+        break;
+    case OP_SLTI : case OP_SLTIU:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_ri(c, 7, HR_RAX, d->imm);
+        jit_setcc(c, d->op == OP_SLTI ? CC_L : CC_B);
+        break;
+    case OP_SLLI : case OP_SRLI: case OP_SRAI:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_shift(c, d->op == OP_SLLI ? 4 : d->op == OP_SRLI ? 5 : 7, d->imm & 0x1f);
+        break;
+    case OP_SLL  : case OP_SRL: case OP_SRA:
+        jit_get(c, HR_RCX, d->rs2);
+        jit_get(c, HR_RAX, d->rs1);
+        jit_shift(c, d->op == OP_SLL ? 4 : d->op == OP_SRL ? 5 : 7, -1);
+        break;
+    case OP_SLT  : case OP_SLTU:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_rr(c, 0, 0x39, HR_RAX, HR_RCX);
+        jit_setcc(c, d->op == OP_SLT ? CC_L : CC_B);
+        break;
+    case OP_ADD  : case OP_SUB: case OP_XOR: case OP_OR: case OP_AND:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_rr(c, 0, d->op == OP_ADD ? 0x01 : d->op == OP_SUB ? 0x29 : d->op == OP_XOR ? 0x31 : d->op == OP_OR ? 0x09 : 0x21, HR_RAX, HR_RCX);
+        break;
+    case OP_MUL  :
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_b(c, 0x0f); jit_b(c, 0xaf); jit_b(c, 0xc1);                          // imul eax, ecx
+        break;
+    case OP_MULHU:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_b(c, 0x48); jit_b(c, 0x0f); jit_b(c, 0xaf); jit_b(c, 0xc1);          // imul rax, rcx
+        jit_b(c, 0x48); jit_b(c, 0xc1); jit_b(c, 0xe8); jit_b(c, 32);            // shr rax, 32
+        break;
+    case OP_SH1ADD: case OP_SH2ADD: case OP_SH3ADD:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_shift(c, 4, d->op - OP_SH1ADD + 1);
+        jit_rr(c, 0, 0x01, HR_RAX, HR_RCX);
+        break;
+    case OP_ANDN : case OP_ORN: case OP_XNOR:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        if (d->op != OP_XNOR) { jit_b(c, 0xf7); jit_b(c, 0xd1); }             // not ecx
+        jit_rr(c, 0, d->op == OP_ANDN ? 0x21 : d->op == OP_ORN ? 0x09 : 0x31, HR_RAX, HR_RCX);
+        if (d->op == OP_XNOR) { jit_b(c, 0xf7); jit_b(c, 0xd0); }             // not eax
+        break;
+    case OP_MIN  : case OP_MINU: case OP_MAX: case OP_MAXU:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_rr(c, 0, 0x39, HR_RAX, HR_RCX);
+        jit_b(c, 0x0f); jit_b(c, 0x40 | (d->op == OP_MIN ? CC_G : d->op == OP_MINU ? CC_A : d->op == OP_MAX ? CC_L : CC_B));
+        jit_b(c, 0xc1);                                                          // cmovcc eax, ecx
+        break;
+    case OP_ROL  : case OP_ROR:
+        jit_get(c, HR_RCX, d->rs2);
+        jit_get(c, HR_RAX, d->rs1);
+        jit_shift(c, d->op == OP_ROL ? 0 : 1, -1);
+        break;
+    case OP_BCLR : case OP_BSET: case OP_BINV:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_get(c, HR_RCX, d->rs2);
+        jit_b(c, 0x0f); jit_b(c, d->op == OP_BCLR ? 0xb3 : d->op == OP_BSET ? 0xab : 0xbb); jit_b(c, 0xc8); // btr/bts/btc eax, ecx
+        break;
+    case OP_BEXT :
+        jit_get(c, HR_RCX, d->rs2);
+        jit_get(c, HR_RAX, d->rs1);
+        jit_shift(c, 5, -1);
+        jit_ri(c, 4, HR_RAX, 1);
+        break;
+    case OP_SEXTB: case OP_SEXTH: case OP_ZEXTH:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_b(c, 0x0f); jit_b(c, d->op == OP_SEXTB ? 0xbe : d->op == OP_SEXTH ? 0xbf : 0xb7); jit_b(c, 0xc0); // movsx/movzx eax, al/ax
+        break;
+    case OP_REV8 :
+        jit_get(c, HR_RAX, d->rs1);
+        jit_b(c, 0x0f); jit_b(c, 0xc8);                                          // bswap eax
+        break;
+    case OP_RORI :
+        jit_get(c, HR_RAX, d->rs1);
+        jit_shift(c, 1, d->imm);
+        break;
+    case OP_BCLRI: case OP_BSETI: case OP_BINVI:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_ri(c, d->op == OP_BCLRI ? 4 : d->op == OP_BSETI ? 1 : 6, HR_RAX, d->op == OP_BCLRI ? ~(1u << d->imm) : 1u << d->imm);
+        break;
+    case OP_BEXTI:
+        jit_get(c, HR_RAX, d->rs1);
+        jit_shift(c, 5, d->imm);
+        jit_ri(c, 4, HR_RAX, 1);
+        break;
+    case OP_CLZ  : case OP_CTZ: case OP_CPOP: case OP_ORCB:
+        jit_get(c, HR_RDI, d->rs1);
+        jit_call(c, d->op == OP_CLZ ? riscv_clz : d->op == OP_CTZ ? riscv_ctz : d->op == OP_CPOP ? riscv_cpop : riscv_orcb);
+        break;
+    default: // mulh, mulhsu, div, divu, rem, remu
+        jit_get(c, HR_RDI, d->rs1);
+        jit_get(c, HR_RSI, d->rs2);
+        jit_call(c, helpers[d->op - OP_MULH]);
+        break;
+    }
+    jit_put(c, d->rd, HR_RAX);
+}
+
+static void riscv_jit_init(RISCV *riscv)
+{
+    JITCTX c;
+    void  *code = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return;
+    memset(&c, 0, sizeof(c));
+    c.p = riscv->jit_code = code;
+    // entry: riscv in rdi, block code in rsi
+    jit_b(&c, 0x55); jit_b(&c, 0x53);                                   // push rbp, push rbx
+    jit_b(&c, 0x41); jit_b(&c, 0x54); jit_b(&c, 0x41); jit_b(&c, 0x55); // push r12, push r13
+    jit_b(&c, 0x41); jit_b(&c, 0x56); jit_b(&c, 0x41); jit_b(&c, 0x57); // push r14, push r15
+    jit_b(&c, 0x48); jit_b(&c, 0x83); jit_b(&c, 0xec); jit_b(&c, 8);    // sub rsp, 8
+    jit_rr(&c, 1, 0x89, HR_RBP, HR_RDI);                                // mov rbp, rdi
+    jit_b(&c, 0xff); jit_b(&c, 0xe6);                                   // jmp rsi
+    riscv->jit_exit = (uint32_t)(c.p - riscv->jit_code);
+    jit_b(&c, 0x48); jit_b(&c, 0x83); jit_b(&c, 0xc4); jit_b(&c, 8);    // add rsp, 8
+    jit_b(&c, 0x41); jit_b(&c, 0x5f); jit_b(&c, 0x41); jit_b(&c, 0x5e); // pop r15, pop r14
+    jit_b(&c, 0x41); jit_b(&c, 0x5d); jit_b(&c, 0x41); jit_b(&c, 0x5c); // pop r13, pop r12
+    jit_b(&c, 0x5b); jit_b(&c, 0x5d); jit_b(&c, 0xc3);                  // pop rbx, pop rbp, ret
+    riscv->jit_used = riscv->jit_stubs = (uint32_t)(c.p - riscv->jit_code);
+}
+
+static void riscv_jit_free(RISCV *riscv)
+{
+    if (riscv->jit_code) munmap(riscv->jit_code, JIT_CACHE_SIZE);
+    riscv->jit_code = NULL;
+}
+
+// compiles a hot block, returns 1 on success, 0 if it can't be compiled, -1 if the caches had to be flushed
+static int riscv_jit_compile(RISCV *riscv, RVBLOCK *block)
+{
+    RVDECODED insts[JIT_MAX_INSTS];
+    JITCTX    c;
+    uint8_t  *skip, *entry;
+    int       n = 0, i, g, uses[32] = {0}, best;
+    uint32_t  pc = block->pc;
+
+    while (n < JIT_MAX_INSTS && riscv_block_decode(riscv, block, pc, &insts[n]) && insts[n].op != OP_SLOW) {
+        uses[insts[n].rd]++; uses[insts[n].rs1]++; uses[insts[n].rs2]++;
+        pc += insts[n].len;
+        if (insts[n++].op == OP_JAL || insts[n - 1].op == OP_JALR) break;
+    }
+    if (n == 0) return 0;
+    if (riscv->jit_used + (uint32_t)n * JIT_MAX_INST_SIZE + 256 > JIT_CACHE_SIZE) {
+        riscv_block_flush(riscv);
+        return -1;
+    }
+
+    memset(&c, 0, sizeof(c));
+    memset(c.hreg, -1, sizeof(c.hreg));
+    c.riscv = riscv;
+    c.block = block;
+    c.ninst = n;
+    c.p     = entry = riscv->jit_code + riscv->jit_used;
+    for (i = 0; i < (int)(sizeof(jit_alloc_regs) / sizeof(jit_alloc_regs[0])); i++) {
+        for (best = 0, g = 1; g < 32; g++) if (uses[g] > uses[best] && c.hreg[g] < 0) best = g;
+        if (uses[best] < 2) break;
+        c.hreg[best] = jit_alloc_regs[i];
+        uses  [best] = 0;
+    }
+
+    // prologue: leave without executing anything if the budget can't cover the block
+    jit_b(&c, 0x48); jit_b(&c, 0x81); jit_b(&c, 0xbd); jit_d(&c, JOFF(jit_budget)); jit_d(&c, n);  // cmp qword [budget], n
+    skip = jit_jcc(&c, CC_GE);
+    c.ninst = 0;
+    jit_exit(&c, 0, 0, 0, block->pc);
+    c.ninst = n;
+    jit_patch(skip, c.p);
+    jit_b(&c, 0x48); jit_b(&c, 0x81); jit_b(&c, 0xad); jit_d(&c, JOFF(jit_budget)); jit_d(&c, n);  // sub qword [budget], n
+    for (g = 1; g < 32; g++) if (c.hreg[g] >= 0) jit_mem(&c, 0, 0x8b, c.hreg[g], JOFF(x) + 4 * g);
+
+    for (i = 0; i < n; i++) {
+        const RVDECODED *d = &insts[i];
+        switch (d->op) {
+        case OP_JAL :
+            jit_mov_ri(&c, HR_RAX, d->pc + d->len);
+            jit_put(&c, d->rd, HR_RAX);
+            jit_exit(&c, i + 1, jit_chainable(&c, d->pc + d->imm), 0, d->pc + d->imm);
+            break;
+        case OP_JALR:
+            jit_get(&c, HR_RAX, d->rs1);
+            if (d->imm) jit_ri(&c, 0, HR_RAX, d->imm);
+            jit_ri(&c, 4, HR_RAX, ~1);
+            jit_mov_ri(&c, HR_RCX, d->pc + d->len);
+            jit_put(&c, d->rd, HR_RCX);
+            jit_exit(&c, i + 1, 0, 1, 0);
+            break;
+        case OP_BEQ : jit_branch(&c, d, CC_NE, i + 1); break;
+        case OP_BNE : jit_branch(&c, d, CC_E , i + 1); break;
+        case OP_BLT : jit_branch(&c, d, CC_GE, i + 1); break;
+        case OP_BGE : jit_branch(&c, d, CC_L , i + 1); break;
+        case OP_BLTU: jit_branch(&c, d, CC_AE, i + 1); break;
+        case OP_BGEU: jit_branch(&c, d, CC_B , i + 1); break;
+        case OP_LB  : case OP_LBU: jit_load (&c, d, 1, i + 1); break;
+        case OP_LH  : case OP_LHU: jit_load (&c, d, 2, i + 1); break;
+        case OP_LW  : jit_load (&c, d, 4, i + 1); break;
+        case OP_SB  : jit_store(&c, d, 1, i + 1); break;
+        case OP_SH  : jit_store(&c, d, 2, i + 1); break;
+        case OP_SW  : jit_store(&c, d, 4, i + 1); break;
+        default     : jit_alu  (&c, d); break;
+        }
+    }
+    if (insts[n - 1].op != OP_JAL && insts[n - 1].op != OP_JALR) jit_exit(&c, n, jit_chainable(&c, pc), 0, pc);
+
+    riscv->jit_used  = (uint32_t)(c.p - riscv->jit_code + 15) & ~15;
+    block->jit       = entry;
+    block->jit_skip  = skip;
+    block->jit_ninst = n;
+    if (pc - block->pc > block->len) block->len = pc - block->pc;
+    return 1;
+}
+
+// runs a compiled block and whatever it chains into, returns the number of guest instructions retired
+static uint32_t riscv_jit_exec(RISCV *riscv, RVBLOCK *block, uint64_t budget)
+{
+    void (*enter)(RISCV*, uint8_t*) = (void (*)(RISCV*, uint8_t*))(void*)riscv->jit_code;
+    RVBLOCK *next;
+
+    riscv->jit_budget = (int64_t)(budget < 0x7fffffff ? budget : 0x7fffffff);
+    budget            = riscv->jit_budget;
+    riscv->jit_start  = budget;
+    riscv->jit_patch  = NULL;
+    enter(riscv, block->jit);
+    riscv->x[0] = 0;
+
+    // chain the exit that was taken to its target if that is compiled already, chained exits stay in the page of the
+    // entered block while fetches translate so the target is valid if it maps the same way
+    next = riscv->bcache[(riscv->pc >> 1) & (BCACHE_SIZE - 1)];
+    // counting loops are entered through riscv_run_n, which fast-forwards them
+    if (riscv->jit_patch && next && next->pc == riscv->pc && next->jit && !next->loop_len && next->vm == block->vm
+     && next->ppc - next->pc == block->ppc - block->pc) jit_patch(riscv->jit_patch, next->jit);
+    return (uint32_t)(budget - riscv->jit_budget);
+}
+#endif
+
+// a poll of an idle device that comes back to the pc and registers of the one before within a few instructions may be
+// an idle poll loop, steps it once more to see it does nothing but loads and register ops on the way, the loop then
+// only ends once a device, another hart or an interrupt changes something, returns the instructions per iteration or 0
+static uint32_t riscv_poll_idle(RISCV *riscv, uint64_t stop)
+{
+    RVDECODED *d;
+    uint32_t   pc = riscv->pc, n = 0;
+    if (!riscv->prof && !riscv->trace && !riscv->mach->iolog && pc == riscv->poll_pc && riscv->icount - riscv->poll_icount <= POLL_MAX_INSTS
+     && !memcmp(riscv->x, riscv->poll_x, sizeof(riscv->x))) {
+        riscv->io_retired = 0;
+        while (n < POLL_MAX_INSTS && riscv->icount < stop && !(riscv->status & (TS_EXIT | TS_TRAP)) && (!n || riscv->pc != pc)) {
+            if (!(d = riscv_dcache_get(riscv, riscv->pc))) break;
+            if (d->op == OP_SLOW || (d->op >= OP_SB && d->op <= OP_SW)) break;
+            riscv_run(riscv);
+            n++;
+        }
+        if (riscv->pc == pc && !(riscv->status & (TS_EXIT | TS_TRAP)) && !memcmp(riscv->x, riscv->poll_x, sizeof(riscv->x))) {
+            riscv->poll_icount = riscv->icount;
+            return n;
+        }
+    }
+    riscv->poll_pc     = riscv->pc;
+    riscv->poll_icount = riscv->icount;
+    memcpy(riscv->poll_x, riscv->x, sizeof(riscv->x));
+    return 0;
+}
+
+// runs up to budget instructions with the selected engine, returns why it stopped
+#define RUN_EXIT   0
+#define RUN_BUDGET 1
+#define RUN_WAIT   2
+#define RUN_IDLE   3 // the hart waits in wfi, riscv_wfi_wait lets the time pass
+#define RUN_POLL   4 // the hart spins in an idle poll loop, riscv_poll_wait skips it
+int riscv_run_n(RISCV *riscv, uint32_t budget)
+{
+    const uint64_t end  = riscv->icount + budget;
+    uint64_t       stop = end; // the engines stop here to look at the pending interrupts
+    RVBLOCK *block;
+    uint32_t ppc;
+
+#if FFVM_JIT
+    if (riscv->engine == ENGINE_JIT && !riscv->jit_code) {
+        riscv_jit_init(riscv);
+        if (!riscv->jit_code) riscv->engine = ENGINE_BLOCK;
+    }
+#else
+    if (riscv->engine == ENGINE_JIT) riscv->engine = ENGINE_BLOCK;
+#endif
+    if (atomic_load_explicit(&riscv->mach->exited, memory_order_relaxed)) riscv->status |= TS_EXIT;
+    if (riscv->mach->nharts > 1) riscv_code_sync(riscv);
+    riscv->status = (riscv->status & ~(TS_WAIT | TS_CODEMOD)) | TS_IRQ;
+    riscv->io_retired = 0;
+    while (riscv->icount < end && !(riscv->status & (TS_EXIT | TS_WAIT))) {
+        if (riscv->icount >= stop || (riscv->status & TS_IRQ)) {
+            if (riscv->status & TS_TRAP) riscv_trap(riscv, riscv->trap_cause, riscv->trap_tval);
+            riscv->status &= ~TS_IRQ;
+            if (riscv->wfi && riscv_wfi_cycles(riscv)) return RUN_IDLE;
+            riscv->wfi = 0;
+            stop = riscv_irq_check(riscv, end);
+        }
+        if (riscv->prof || riscv->trace) {
+            riscv_observe_step(riscv);
+            continue;
+        }
+        switch (riscv->engine) {
+        case ENGINE_SWITCH: riscv_step(riscv); break;
+        case ENGINE_DCACHE: riscv_run (riscv); break;
+        default:
+            if (riscv_vm_fetch(riscv, riscv->pc, &ppc) < 0) break;
+            block = riscv->bcache ? riscv->bcache[(riscv->pc >> 1) & (BCACHE_SIZE - 1)] : NULL;
+            if (!block || block->pc != riscv->pc || block->ppc != ppc || block->vm != riscv->vm) {
+                block = riscv_block_translate(riscv, riscv->pc, ppc);
+            }
+            if (block && block->loop_len) riscv_loop_skip(riscv, block, stop);
+#if FFVM_JIT
+            if (block && riscv->engine == ENGINE_JIT) {
+                if (++block->hits == JIT_THRESHOLD && riscv_jit_compile(riscv, block) < 0) break;
+                if (block->jit && block->jit_ninst <= stop - riscv->icount) {
+                    riscv->icount += riscv_jit_exec(riscv, block, stop - riscv->icount);
+                    riscv->status &= ~TS_CODEMOD;
+                    break;
+                }
+            }
+#endif
+            if (block && block->ninst <= stop - riscv->icount) {
+                riscv->icount += riscv_block_exec(riscv, block);
+                riscv->status &= ~TS_CODEMOD;
+            } else {
+                riscv->io_retired = 0;
+                riscv_run(riscv);
+            }
+            break;
+        }
+    }
+    if ((riscv->status & (TS_EXIT | TS_WAIT)) == TS_WAIT) {
+        riscv->status    &= ~TS_WAIT;
+        riscv->poll_insts = riscv_poll_idle(riscv, stop);
+        riscv->status    &= ~TS_WAIT;
+        if (!(riscv->status & TS_EXIT)) return riscv->poll_insts ? RUN_POLL : RUN_WAIT;
+    }
+    if (riscv->status & TS_EXIT) return RUN_EXIT;
+    return RUN_BUDGET;
+}
+
+// host side of wfi for a hart riscv_run_n left idle: up to cycles pass on the clock of the hart but not past its timer
+// deadline, without real time UINT64_MAX jumps straight there, a hart only input or another hart can wake sleeps on
+// the keyboard for a while instead
+void riscv_wfi_wait(RISCV *riscv, uint64_t cycles)
+{
+    RVMACHINE      *mach = riscv->mach;
+    uint64_t        n    = riscv_wfi_cycles(riscv);
+    struct timespec ts;
+    if (n != UINT64_MAX || cycles != UINT64_MAX) {
+        riscv->idle += n < cycles ? n : cycles;
+        return;
+    }
+    if (atomic_load(&mach->kbd.eof) && mach->nharts == 1 && !riscv_dma_busy(&mach->dma)) { // nothing can wake the hart, go on as after a spurious wake up
+        riscv->wfi = 0;
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 10 * 1000000;
+    if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+    pthread_mutex_lock(&mach->kbd.lock);
+    if (riscv_wfi_cycles(riscv) && !atomic_load(&mach->exited)) pthread_cond_timedwait(&mach->kbd.cond, &mach->kbd.lock, &ts);
+    pthread_mutex_unlock(&mach->kbd.lock);
+}
+
+// host side of an idle poll loop riscv_run_n found: whole iterations of up to insts instructions are credited to the
+// hart as if it ran them, but not past its timer interrupt or the audio fifo running low, without real time that is
+// the only limit and a hart only input or another hart can get out of the loop sleeps on the keyboard for a while instead
+void riscv_poll_wait(RISCV *riscv, uint64_t insts)
+{
+    RVMACHINE      *mach = riscv->mach;
+    uint64_t        time = riscv->icount + riscv->idle, n = UINT64_MAX, wait;
+    struct timespec ts;
+    if ((riscv->csr[CSR_MIE] & MIP_MTIP) && riscv_irq_enabled(riscv, MIP_MTIP)) n = riscv->mtimecmp > time ? riscv->mtimecmp - time : 0;
+    if ((wait = riscv_audio_wait(&mach->audio, time)) && wait < n) n = wait; // a fifo already low is not what the loop waits for
+    if (mach->headless && n == UINT64_MAX && (!(atomic_load(&mach->kbd.eof) && mach->nharts == 1) || riscv_dma_busy(&mach->dma))) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10 * 1000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        pthread_mutex_lock(&mach->kbd.lock);
+        if (!riscv_kbd_ready(&mach->kbd) && !atomic_load(&riscv->msip) && !atomic_load(&mach->exited)) {
+            pthread_cond_timedwait(&mach->kbd.cond, &mach->kbd.lock, &ts);
+        }
+        pthread_mutex_unlock(&mach->kbd.lock);
+        return;
+    }
+    if (n > insts) n = insts;
+    n -= n % riscv->poll_insts;
+    riscv->icount      += n;
+    riscv->skipped     += n;
+    riscv->poll_icount += n;
+}
+
+// adds a hart starting at the entry point with mhartid set to its index, harts are added before any of them runs
+RISCV* riscv_hart_add(RVMACHINE *mach)
+{
+    RISCV *riscv;
+    if (mach->nharts == MAX_HARTS || !(riscv = calloc(1, sizeof(RISCV)))) return NULL;
+    riscv->mach       = mach;
+    riscv->mem        = mach->mem;
+    riscv->mem_size   = mach->mem_size;
+    riscv->codemap    = mach->codemap;
+    riscv->hartid     = mach->nharts;
+    riscv->pc         = mach->entry;
+    riscv->mtimecmp   = UINT64_MAX;
+    riscv->priv       = PRIV_M;
+    riscv->csr[CSR_MISA   ] = (1 << 8) | (1 << 12) | (1 << 0) | (1 << 5) | (1 << 3) | (1 << 2) | (1 << 18) | (1 << 20) | (1 << 1); // rv32imafdcbsu, b is zba + zbb + zbs
+    riscv->csr[CSR_MHARTID] = riscv->hartid;
+    riscv->csr[CSR_MSTATUS] = MSTATUS_MPP | MSTATUS_FS_INITIAL; // an mret before anything set mpp stays in machine mode, fp is on
+    riscv_dcache_flush(riscv);
+    riscv_tlb_flush(riscv);
+    riscv_vm_update(riscv);
+    mach->harts[mach->nharts++] = riscv;
+    return riscv;
+}
+
+static void riscv_free_machine(RVMACHINE *mach)
+{
+    RISCV *riscv;
+    int    i;
+    riscv_kbd_free(&mach->kbd);
+    riscv_audio_free(&mach->audio);
+    riscv_dma_free(&mach->dma);
+    riscv_iolog_close(mach);
+    riscv_trace_close(mach);
+    for (i = 0; i < SYS_MAX_FILES; i++) if (mach->files[i]) close(mach->files[i] - 1);
+    for (i = 0; i < mach->nharts; i++) {
+        riscv = mach->harts[i];
+#if FFVM_JIT
+        riscv_jit_free(riscv);
+#endif
+        free(riscv->bcache);
+        free(riscv->bpage );
+        free(riscv->bpool );
+        riscv_prof_free(riscv->prof);
+        free(riscv);
+    }
+    pthread_mutex_destroy(&mach->iolock);
+    if (mach->mem    ) munmap(mach->mem    , mach->mem_size);
+    if (mach->codemap) munmap(mach->codemap, mach->mem_size >> CODEMAP_SHIFT);
+    free(mach->dirty);
+    riscv_symtab_free(&mach->syms);
+    free(mach);
+}
+
+// reserves zeroed memory the host only commits when a page is first touched
+static uint8_t* riscv_mem_reserve(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// maps the rom copy on write over the start of ram, pages the guest never writes stay shared with the page cache,
+// files that cannot be mapped are read instead
+static void riscv_map_rom(RVMACHINE *mach, int fd)
+{
+    struct stat st;
+    size_t  size;
+    ssize_t n;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size < mach->mem_size ? (size_t)st.st_size : mach->mem_size;
+        // the last page is zero filled past the end of the file, the ram after it stays anonymous
+        if (mmap(mach->mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            mach->heap = (size + 15) & ~15;
+            return;
         }
-        if (bflag) riscv->pc += signed_extend(inst_imm13b, 13);
-        break;
-    case 0x03: // i-type
-        maddr = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12);
-        switch (inst_funct3) {
-        case 0x0: riscv->x[inst_rd] = (int32_t)riscv_memr8 (riscv, maddr); break; // lb
-        case 0x1: riscv->x[inst_rd] = (int32_t)riscv_memr16(riscv, maddr); break; // lh
-        case 0x2: riscv->x[inst_rd] = riscv_memr32(riscv, maddr); break; // lw
-        case 0x4: riscv->x[inst_rd] = riscv_memr8 (riscv, maddr); break; // lbu
-        case 0x5: riscv->x[inst_rd] = riscv_memr16(riscv, maddr); break; // lhu
+    }
+    for (size = 0; size < mach->mem_size; size += n) {
+        n = pread(fd, mach->mem + size, mach->mem_size - size, size);
+        if (n < 0 && errno == EINTR) { n = 0; continue; }
+        if (n <= 0) break;
+    }
+    mach->heap = (size + 15) & ~15;
+}
+
+static int riscv_pread_full(int fd, uint8_t *buf, size_t size, off_t offset)
+{
+    ssize_t n;
+    while (size) {
+        n = pread(fd, buf, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n; size -= n; offset += n;
+    }
+    return 0;
+}
+
+// loads the PT_LOAD segments of a riscv elf32 executable, whole pages of file data whose offset agrees with their
+// address are mapped copy on write and the rest is read, .bss is left to the untouched anonymous ram
+static int riscv_load_elf(RVMACHINE *mach, int fd)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    Elf32_Ehdr  eh;
+    Elf32_Phdr  ph;
+    struct stat st;
+    uint32_t    off, lo, hi, end = 0;
+    int         i;
+
+    if (fstat(fd, &st) < 0 || pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || eh.e_ident[EI_CLASS] != ELFCLASS32
+     || eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_RISCV || eh.e_type != ET_EXEC || eh.e_phentsize != sizeof(Elf32_Phdr)) return -1;
+    for (i = 0; i < eh.e_phnum; i++) {
+        if (pread(fd, &ph, sizeof(ph), eh.e_phoff + i * sizeof(ph)) != sizeof(ph)) return -1;
+        if (ph.p_type != PT_LOAD || !ph.p_memsz) continue;
+        off = ph.p_vaddr >= 0x80000000 ? ph.p_vaddr - 0x80000000 : ph.p_vaddr; // linked at the dram base or at 0
+        if (off > mach->mem_size || ph.p_memsz > mach->mem_size - off || ph.p_filesz > ph.p_memsz
+         || ph.p_offset > (uint64_t)st.st_size || ph.p_filesz > (uint64_t)st.st_size - ph.p_offset) return -1;
+        lo = (off + page - 1) & ~(page - 1);
+        hi = (off + ph.p_filesz) & ~(page - 1);
+        if ((ph.p_offset - off) % page || lo >= hi
+         || mmap(mach->mem + lo, hi - lo, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, ph.p_offset + (lo - off)) == MAP_FAILED) {
+            lo = hi = off + ph.p_filesz;
         }
-        break;
-    case 0x23: // s-type
-        maddr = riscv->x[inst_rs1] + signed_extend(inst_imm12s, 12);
-        switch (inst_funct3) {
-        case 0x0: riscv_memw8 (riscv, maddr, (uint8_t )riscv->x[inst_rs2]); break; // sb
-        case 0x1: riscv_memw16(riscv, maddr, (uint16_t)riscv->x[inst_rs2]); break; // sh
-        case 0x2: riscv_memw32(riscv, maddr, riscv->x[inst_rs2]); break; // sw
+        if (riscv_pread_full(fd, mach->mem + off, lo - off, ph.p_offset) < 0
+         || riscv_pread_full(fd, mach->mem + hi, off + ph.p_filesz - hi, ph.p_offset + (hi - off)) < 0) return -1;
+        if (ph.p_vaddr + ph.p_memsz > end) end = ph.p_vaddr + ph.p_memsz;
+    }
+    mach->entry = eh.e_entry;
+    mach->heap  = (end + 15) & ~15;
+    return 0;
+}
+
+static pthread_once_t riscv_labels_once = PTHREAD_ONCE_INIT;
+static void riscv_labels_init(void) { riscv_block_exec(NULL, NULL); }
+
+// a machine with one hart and the rom image read from fd, which may be shared by many machines, fd < 0 for empty ram,
+// an elf executable is loaded at its addresses and starts at its entry point, a raw binary is loaded at 0 and starts
+// there, mem_size is rounded up to a power of 2, 0 for DEF_MEM_SIZE, returns NULL if the image cannot be loaded
+RISCV* riscv_init_image(int fd, uint32_t mem_size)
+{
+    RVREGION ram    = { .name = "ram"   , .base = 0x00000000, .ram = 0 };
+    RVREGION dram   = { .name = "dram"  , .base = 0x80000000, .ram = 0 }; // ram again at the usual riscv dram base, some roms are linked there
+    RVREGION stdio  = { .name = "stdio" , .base = 0xF0000000, .size = 0x100        , .ram = -1, .read = dev_stdio_read , .write = dev_stdio_write  };
+    RVREGION system = { .name = "system", .base = 0xF0000100, .size = 0x100        , .ram = -1, .read = NULL           , .write = dev_system_write };
+    RVREGION kbd    = { .name = "kbd"   , .base = 0xF0000200, .size = 0x100        , .ram = -1, .read = dev_kbd_read   , .write = dev_kbd_write    };
+    RVREGION con    = { .name = "con"   , .base = 0xF0000300, .size = 0x100        , .ram = -1, .read = dev_con_read   , .write = dev_con_write    };
+    RVREGION audio  = { .name = "audio" , .base = 0xF0000400, .size = 0x100        , .ram = -1, .read = dev_audio_read , .write = dev_audio_write  };
+    RVREGION dma    = { .name = "dma"   , .base = 0xF0000500, .size = 0x100        , .ram = -1, .read = dev_dma_read   , .write = dev_dma_write    };
+    RVREGION fbctl  = { .name = "fbctl" , .base = 0xF0000800, .size = 0x800        , .ram = -1, .read = dev_fbctl_read , .write = dev_fbctl_write  };
+    RVREGION vram   = { .name = "vram"  , .base = 0xF0100000, .size = CON_VRAM_SIZE, .ram = -1, .read = dev_vram_read  , .write = dev_vram_write   };
+    RVREGION fbmem  = { .name = "fb"    , .base = 0xF1000000, .size = FB_MEM_SIZE  , .ram = -1, .read = dev_fbmem_read , .write = dev_fbmem_write  };
+    RVREGION clint  = { .name = "clint" , .base = 0xF2000000, .size = 0x10000      , .ram = -1, .read = dev_clint_read , .write = dev_clint_write  };
+    RVMACHINE *mach = calloc(1, sizeof(RVMACHINE));
+    RISCV     *riscv;
+    char       magic[SELFMAG];
+    if (!mach) return NULL;
+    if (!mem_size) mem_size = DEF_MEM_SIZE;
+    for (mach->mem_size = MIN_MEM_SIZE; mach->mem_size < mem_size && mach->mem_size < MAX_MEM_SIZE; mach->mem_size <<= 1);
+    ram.size = dram.size = mach->mem_size;
+    mach->files_root = AT_FDCWD;
+    mach->mem     = riscv_mem_reserve(mach->mem_size);
+    mach->codemap = riscv_mem_reserve(mach->mem_size >> CODEMAP_SHIFT);
+    pthread_mutex_init(&mach->iolock, NULL);
+    riscv_kbd_init(&mach->kbd);
+    riscv_fb_init (&mach->fb );
+    riscv_con_init(&mach->con);
+    riscv_audio_init(&mach->audio);
+    riscv_dma_init(&mach->dma, &mach->kbd);
+    mach->kbd.iolock = &mach->iolock;
+    mach->out        = stdout;
+    if (!mach->mem || !mach->codemap) {
+        riscv_free_machine(mach);
+        return NULL;
+    }
+    stdio.opaque = system.opaque = kbd.opaque = con.opaque = audio.opaque = dma.opaque = vram.opaque = fbctl.opaque = fbmem.opaque = clint.opaque = mach;
+    riscv_bus_map(mach, &ram   );
+    riscv_bus_map(mach, &dram  );
+    riscv_bus_map(mach, &stdio );
+    riscv_bus_map(mach, &system);
+    riscv_bus_map(mach, &kbd   );
+    riscv_bus_map(mach, &con   );
+    riscv_bus_map(mach, &audio );
+    riscv_bus_map(mach, &dma   );
+    riscv_bus_map(mach, &fbctl );
+    riscv_bus_map(mach, &vram  );
+    riscv_bus_map(mach, &fbmem );
+    riscv_bus_map(mach, &clint );
+    if (fd >= 0 && pread(fd, magic, SELFMAG, 0) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0) {
+        if (riscv_load_elf(mach, fd) < 0) {
+            riscv_free_machine(mach);
+            errno = ENOEXEC;
+            return NULL;
         }
-        break;
-    case 0x13: // i-type
-        switch (inst_funct3) {
-        case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12); break; // addi
-        case 0x2: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] < signed_extend(inst_imm12i, 12);  break; // slti
-        case 0x3: riscv->x[inst_rd] = riscv->x[inst_rs1] < (uint32_t)signed_extend(inst_imm12i, 12); break; // sltiu
-        case 0x4: riscv->x[inst_rd] = riscv->x[inst_rs1] ^ (signed_extend(inst_imm12i, 12)); break; // xori
-        case 0x6: riscv->x[inst_rd] = riscv->x[inst_rs1] | (signed_extend(inst_imm12i, 12)); break; // ori
-        case 0x7: riscv->x[inst_rd] = riscv->x[inst_rs1] & (signed_extend(inst_imm12i, 12)); break; // andi
-        case 0x1: riscv->x[inst_rd] = riscv->x[inst_rs1] << (inst_imm12i & 0x1f); break; // slli
-        case 0x5: // srli & srai
-            if (inst_funct7 & (1 << 5)) { // srai
-                riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] >> (inst_imm12i & 0x1f);
-            } else { // srli
-                riscv->x[inst_rd] = riscv->x[inst_rs1] >> (inst_imm12i & 0x1f);
+        riscv_symtab_read(&mach->syms, fd);
+    } else if (fd >= 0) {
+        riscv_map_rom(mach, fd);
+    }
+    pthread_once(&riscv_labels_once, riscv_labels_init);
+    riscv = riscv_hart_add(mach);
+    if (!riscv) riscv_free_machine(mach);
+    return riscv;
+}
+
+RISCV* riscv_init(char *rom, uint32_t mem_size)
+{
+    int    fd = open(rom, O_RDONLY);
+    RISCV *riscv;
+    if (fd < 0) return NULL;
+    riscv = riscv_init_image(fd, mem_size);
+    close(fd);
+    return riscv;
+}
+
+// frees the machine of the hart with all of its harts
+void riscv_free(RISCV *riscv)
+{
+    if (riscv) riscv_free_machine(riscv->mach);
+}
+
+
+// snapshot files: header, hart states, page numbers, then the pages aligned to SNAP_PAGE_SIZE so a restore can map them
+#define SNAP_MAGIC     "FFVMSNAP"
+#define SNAP_VERSION   3
+#define SNAP_PAGE_SIZE (1 << SNAP_PAGE_SHIFT)
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t mem_size;
+    uint32_t nharts;
+    uint32_t npages;
+    uint32_t heap;
+    uint32_t exit_code;
+    uint32_t exited;
+    char     parent[256]; // checkpoint in the same directory this one adds its pages to, empty for a full snapshot
+} RVSNAPHDR;
+
+typedef struct {
+    uint32_t pc;
+    uint32_t x[32];
+    uint64_t f[32];
+    uint32_t csr[0x1000];
+    uint32_t resv_addr;
+    uint32_t resv_val;
+    uint32_t resv_valid;
+    uint32_t status;
+    uint64_t icount;
+    uint64_t idle;
+    uint64_t mtimecmp;
+    uint32_t msip;
+    uint32_t wfi;
+    uint32_t priv;
+    uint32_t trap_cause; // of the exception a hart raised but did not take yet
+    uint32_t trap_tval;
+} RVSNAPHART;
+
+static int riscv_page_zero(const uint8_t *p)
+{
+    const uint64_t *q = (const uint64_t*)p;
+    int i;
+    for (i = 0; i < SNAP_PAGE_SIZE / 8; i++) if (q[i]) return 0;
+    return 1;
+}
+
+// flags the pages written since the last checkpoint clean again, or all pages
+static void riscv_snapshot_rearm(RVMACHINE *mach, int all)
+{
+    const uint32_t n = 1 << (SNAP_PAGE_SHIFT - CODEMAP_SHIFT);
+    uint32_t page, i;
+    for (page = 0; page < mach->mem_size >> SNAP_PAGE_SHIFT; page++) {
+        if (!all && !mach->dirty[page]) continue;
+        mach->dirty[page] = 0;
+        for (i = 0; i < n; i++) mach->codemap[page * n + i] |= CODEMAP_CLEAN;
+    }
+}
+
+// from now on the pages written are recorded for the next incremental checkpoint, the first store into each page
+// takes the slow path of the store once
+int riscv_snapshot_track(RVMACHINE *mach)
+{
+    if (!mach->dirty && !(mach->dirty = calloc(mach->mem_size >> SNAP_PAGE_SHIFT, 1))) return -1;
+    riscv_snapshot_rearm(mach, 1);
+    return 0;
+}
+
+// saves the harts and the ram, with a parent only the pages written since the parent checkpoint was saved,
+// the harts must be stopped
+int riscv_snapshot_save(RVMACHINE *mach, const char *file, const char *parent)
+{
+    static const uint8_t zero[SNAP_PAGE_SIZE];
+    RVSNAPHDR   hdr = { 0 };
+    RVSNAPHART  s;
+    RISCV      *riscv;
+    uint32_t   *pages, npages = 0, page, i;
+    const char *slash;
+    FILE       *fp;
+    long        pos;
+    int         ret = -1;
+
+    if (parent && !mach->dirty) return -1;
+    riscv_dma_wait(&mach->dma); // a transfer on the helper thread finishes before its pages are saved
+    if (!(pages = malloc((mach->mem_size >> SNAP_PAGE_SHIFT) * sizeof(uint32_t)))) return -1;
+    for (page = 0; page < mach->mem_size >> SNAP_PAGE_SHIFT; page++) {
+        if (parent ? mach->dirty[page] : !riscv_page_zero(mach->mem + (page << SNAP_PAGE_SHIFT))) pages[npages++] = page;
+    }
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version   = SNAP_VERSION;
+    hdr.mem_size  = mach->mem_size;
+    hdr.nharts    = mach->nharts;
+    hdr.npages    = npages;
+    hdr.heap      = mach->heap;
+    hdr.exit_code = mach->exit_code;
+    hdr.exited    = atomic_load(&mach->exited);
+    if (parent) {
+        slash = strrchr(parent, '/');
+        strncpy(hdr.parent, slash ? slash + 1 : parent, sizeof(hdr.parent) - 1);
+    }
+
+    if ((fp = fopen(file, "wb"))) {
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        for (i = 0; i < (uint32_t)mach->nharts; i++) {
+            riscv = mach->harts[i];
+            memset(&s, 0, sizeof(s));
+            s.pc         = riscv->pc;
+            memcpy(s.x  , riscv->x  , sizeof(s.x  ));
+            memcpy(s.f  , riscv->f  , sizeof(s.f  ));
+            memcpy(s.csr, riscv->csr, sizeof(s.csr));
+            s.resv_addr  = riscv->resv_addr;
+            s.resv_val   = riscv->resv_val;
+            s.resv_valid = riscv->resv_valid;
+            s.status     = riscv->status & (TS_EXIT | TS_TRAP);
+            s.icount     = riscv->icount;
+            s.idle       = riscv->idle;
+            s.mtimecmp   = riscv->mtimecmp;
+            s.msip       = atomic_load(&riscv->msip);
+            s.wfi        = riscv->wfi;
+            s.priv       = riscv->priv;
+            s.trap_cause = riscv->trap_cause;
+            s.trap_tval  = riscv->trap_tval;
+            fwrite(&s, sizeof(s), 1, fp);
+        }
+        fwrite(pages, sizeof(uint32_t), npages, fp);
+        pos = ftell(fp);
+        fwrite(zero, 1, (SNAP_PAGE_SIZE - pos % SNAP_PAGE_SIZE) % SNAP_PAGE_SIZE, fp);
+        for (i = 0; i < npages; i++) fwrite(mach->mem + (pages[i] << SNAP_PAGE_SHIFT), SNAP_PAGE_SIZE, 1, fp);
+        ret = ferror(fp) ? -1 : 0;
+        if (fclose(fp) != 0) ret = -1;
+    }
+    if (ret == 0 && mach->dirty) riscv_snapshot_rearm(mach, 0);
+    free(pages);
+    return ret;
+}
+
+// maps the pages of one snapshot over ram after the pages of its parents
+static int riscv_snapshot_apply(RISCV *riscv, const char *file, int depth)
+{
+    RVMACHINE  *mach = riscv->mach;
+    RVSNAPHDR   hdr;
+    RVSNAPHART  s;
+    uint32_t   *pages = NULL, i, j;
+    char        path[FILENAME_MAX];
+    const char *slash;
+    off_t       off, data;
+    int         fd, ret = -1;
+
+    if (depth > 4096 || (fd = open(file, O_RDONLY)) < 0) return -1;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) || hdr.version != SNAP_VERSION
+     || hdr.mem_size != mach->mem_size || hdr.nharts < 1 || hdr.nharts > MAX_HARTS || hdr.npages > mach->mem_size >> SNAP_PAGE_SHIFT) {
+        close(fd);
+        return -1;
+    }
+    hdr.parent[sizeof(hdr.parent) - 1] = '\0';
+    if (hdr.parent[0]) {
+        slash = strrchr(file, '/');
+        snprintf(path, sizeof(path), "%.*s%s", slash ? (int)(slash - file + 1) : 0, file, hdr.parent);
+        if (riscv_snapshot_apply(riscv, path, depth + 1) < 0) { close(fd); return -1; }
+    } else if (mmap(mach->mem, mach->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    off   = sizeof(hdr) + hdr.nharts * sizeof(RVSNAPHART);
+    data  = (off + hdr.npages * sizeof(uint32_t) + SNAP_PAGE_SIZE - 1) & ~(off_t)(SNAP_PAGE_SIZE - 1);
+    pages = malloc(hdr.npages * sizeof(uint32_t) + 1);
+    if (pages && pread(fd, pages, hdr.npages * sizeof(uint32_t), off) == (ssize_t)(hdr.npages * sizeof(uint32_t))) {
+        for (ret = 0, i = 0; i < hdr.npages && ret == 0; i = j) { // one mapping per run of consecutive pages
+            for (j = i + 1; j < hdr.npages && pages[j] == pages[j - 1] + 1; j++);
+            if (pages[j - 1] >= mach->mem_size >> SNAP_PAGE_SHIFT) { ret = -1; break; }
+            if (sysconf(_SC_PAGESIZE) == SNAP_PAGE_SIZE && mmap(mach->mem + (pages[i] << SNAP_PAGE_SHIFT), (size_t)(j - i) << SNAP_PAGE_SHIFT,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, data + ((off_t)i << SNAP_PAGE_SHIFT)) != MAP_FAILED) continue;
+            if (pread(fd, mach->mem + (pages[i] << SNAP_PAGE_SHIFT), (size_t)(j - i) << SNAP_PAGE_SHIFT, data + ((off_t)i << SNAP_PAGE_SHIFT))
+                != (ssize_t)((size_t)(j - i) << SNAP_PAGE_SHIFT)) ret = -1;
+        }
+    }
+    while (ret == 0 && mach->nharts < (int)hdr.nharts && riscv_hart_add(mach)) mach->harts[mach->nharts - 1]->engine = riscv->engine;
+    for (i = 0; ret == 0 && i < hdr.nharts && i < (uint32_t)mach->nharts; i++) {
+        if (pread(fd, &s, sizeof(s), sizeof(hdr) + i * sizeof(s)) != sizeof(s)) { ret = -1; break; }
+        riscv = mach->harts[i];
+        riscv->pc         = s.pc;
+        memcpy(riscv->x  , s.x  , sizeof(s.x  ));
+        memcpy(riscv->f  , s.f  , sizeof(s.f  ));
+        memcpy(riscv->csr, s.csr, sizeof(s.csr));
+        riscv->resv_addr  = s.resv_addr;
+        riscv->resv_val   = s.resv_val;
+        riscv->resv_valid = s.resv_valid;
+        riscv->status     = s.status;
+        riscv->icount     = s.icount;
+        riscv->idle       = s.idle;
+        riscv->mtimecmp   = s.mtimecmp;
+        riscv->wfi        = s.wfi;
+        riscv->priv       = s.priv;
+        riscv->trap_cause = s.trap_cause;
+        riscv->trap_tval  = s.trap_tval;
+        atomic_store(&riscv->msip, s.msip);
+        riscv_tlb_flush(riscv);
+        riscv_vm_update(riscv);
+    }
+    mach->heap      = hdr.heap;
+    mach->exit_code = hdr.exit_code;
+    atomic_store(&mach->exited, hdr.exited);
+    free(pages);
+    close(fd);
+    return ret;
+}
+
+// restores a snapshot with the checkpoints it builds on, the ram is mapped from the files and only read when touched,
+// the harts must be stopped
+int riscv_snapshot_load(RISCV *riscv, const char *file)
+{
+    RVMACHINE *mach = riscv->mach;
+    int        i;
+    riscv_dma_wait(&mach->dma);
+    if (riscv_snapshot_apply(riscv, file, 0) < 0) return -1;
+    // decoded code and clean flags belong to the old ram
+    mmap(mach->codemap, mach->mem_size >> CODEMAP_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    for (i = 0; i < mach->nharts; i++) {
+        mach->harts[i]->codegen = atomic_load(&mach->codegen);
+        riscv_dcache_flush(mach->harts[i]);
+    }
+    if (mach->dirty) riscv_snapshot_rearm(mach, 1);
+    return 0;
+}
+
+#if FFVM_SDL
+// drain the sdl event queue into the keyboard, returns nonzero once the window is closed
+static int sdl_poll_events(void *opaque)
+{
+    RVMACHINE  *mach = opaque;
+    SDL_Event   event;
+    const char *seq;
+    while (SDL_PollEvent(&event)) {
+        switch (event.type) {
+        case SDL_QUIT:
+            riscv_stop(mach);
+            return 1;
+        case SDL_WINDOWEVENT:
+            video_redraw = 1;
+            break;
+        case SDL_TEXTINPUT:
+            riscv_kbd_push(&mach->kbd, 1, event.text.text, strlen(event.text.text));
+            break;
+        case SDL_KEYDOWN: // keys without text, encoded the way a terminal sends them
+            switch (event.key.keysym.sym) {
+            case SDLK_RETURN   : seq = "\n"    ; break;
+            case SDLK_BACKSPACE: seq = "\x7f"  ; break;
+            case SDLK_TAB      : seq = "\t"    ; break;
+            case SDLK_ESCAPE   : seq = "\x1b"  ; break;
+            case SDLK_UP       : seq = "\x1b[A"; break;
+            case SDLK_DOWN     : seq = "\x1b[B"; break;
+            case SDLK_RIGHT    : seq = "\x1b[C"; break;
+            case SDLK_LEFT     : seq = "\x1b[D"; break;
+            default            : seq = NULL    ; break;
             }
+            if (seq) riscv_kbd_push(&mach->kbd, 1, seq, strlen(seq));
             break;
         }
-        break;
-    case 0x33: // r-type
-        if ((inst_funct7 & (1 << 0)) == 0) {
-            switch (inst_funct3) {
-            case 0x0: // add & sub
-                if (inst_funct7 & (1 << 5)) { // sub
-                    riscv->x[inst_rd] = riscv->x[inst_rs1] - riscv->x[inst_rs2];
-                } else { // add
-                    riscv->x[inst_rd] = riscv->x[inst_rs1] + riscv->x[inst_rs2];
-                }
-                break;
-            case 0x1: riscv->x[inst_rd] = riscv->x[inst_rs1] << (riscv->x[inst_rs2] & 0x1f); break; // sll
-            case 0x2: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] < (int32_t)riscv->x[inst_rs2]; break; // slt
-            case 0x3: riscv->x[inst_rd] = riscv->x[inst_rs1] < riscv->x[inst_rs2]; break; // sltu
-            case 0x4: riscv->x[inst_rd] = riscv->x[inst_rs1] ^ riscv->x[inst_rs2]; break; // xor
-            case 0x5: // srl & sra
-                if (inst_funct7 & (1 << 5)) { // sra
-                    riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] >> (riscv->x[inst_rs2] & 0x1f);
-                } else { // srl
-                    riscv->x[inst_rd] = riscv->x[inst_rs1] >> (riscv->x[inst_rs2] & 0x1f);
+    }
+    return 0;
+}
+
+static void sdl_convert_fb(RVFB *fb, uint8_t *dst, int dpitch, const SDL_Rect *rect)
+{
+    const uint8_t *src;
+    uint32_t      *out;
+    uint16_t       p;
+    int            x, y;
+    for (y = 0; y < rect->h; y++) {
+        src = fb->mem + (rect->y + y) * fb->pitch + (rect->x << riscv_fb_bpp_shift(fb->format));
+        out = (uint32_t*)(dst + y * dpitch);
+        switch (fb->format) {
+        case FB_FMT_PAL8:
+            for (x = 0; x < rect->w; x++) out[x] = fb->palette[src[x]];
+            break;
+        case FB_FMT_RGB565:
+            for (x = 0; x < rect->w; x++) {
+                memcpy(&p, src + x * 2, 2);
+                out[x] = 0xFF000000 | ((p & 0xF800) << 8) | ((p & 0xE000) << 3) | ((p & 0x07E0) << 5) | ((p & 0x0600) >> 1)
+                                    | ((p & 0x001F) << 3) | ((p & 0x001C) >> 2);
+            }
+            break;
+        case FB_FMT_ARGB8888:
+            memcpy(out, src, rect->w * 4);
+            break;
+        }
+    }
+}
+
+// upload only the dirty tiles of the guest framebuffer, a static screen costs a scan of the dirty map
+static void sdl_present_fb(RVMACHINE *mach)
+{
+    RVFB    *fb = &mach->fb;
+    SDL_Rect rect;
+    void    *pixels;
+    int      pitch, tx, tx1, ty, ntx, nty, uploaded = 0;
+    uint8_t *row;
+
+    if (!video_renderer || fb->format == FB_FMT_OFF) return;
+    if ((fb->ctrl & FB_CTRL_VSYNC) && !fb->ready) return;
+    if (fb->reconfig || !video_fbtex) {
+        if (video_fbtex) SDL_DestroyTexture(video_fbtex);
+        video_fbtex = SDL_CreateTexture(video_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, fb->width, fb->height);
+        if (!video_fbtex) return;
+        SDL_RenderSetScale(video_renderer, 1, 1);
+        SDL_RenderSetLogicalSize(video_renderer, fb->width, fb->height);
+        fb->reconfig = 0;
+        riscv_fb_dirty_all(fb);
+    }
+
+    if (fb->ndirty) {
+        ntx = (fb->width  + (1 << FB_TILE_SHIFT) - 1) >> FB_TILE_SHIFT;
+        nty = (fb->height + (1 << FB_TILE_SHIFT) - 1) >> FB_TILE_SHIFT;
+        for (ty = 0; ty < nty; ty++) {
+            row = fb->dirty + ty * FB_TILES_X;
+            for (tx = 0; tx < ntx; tx = tx1) { // one lock per run of dirty tiles
+                for (tx1 = tx; tx1 < ntx && row[tx1]; tx1++);
+                if (tx1 == tx) { tx1++; continue; }
+                rect.x = tx << FB_TILE_SHIFT;
+                rect.y = ty << FB_TILE_SHIFT;
+                rect.w = ((uint32_t)tx1 << FB_TILE_SHIFT < fb->width  ? tx1 << FB_TILE_SHIFT : (int)fb->width ) - rect.x;
+                rect.h = ((uint32_t)(ty + 1) << FB_TILE_SHIFT < fb->height ? (ty + 1) << FB_TILE_SHIFT : (int)fb->height) - rect.y;
+                if (SDL_LockTexture(video_fbtex, &rect, &pixels, &pitch) == 0) {
+                    sdl_convert_fb(fb, pixels, pitch, &rect);
+                    SDL_UnlockTexture(video_fbtex);
                 }
-                break;
-            case 0x6: riscv->x[inst_rd] = riscv->x[inst_rs1] | riscv->x[inst_rs2]; break; // or
-            case 0x7: riscv->x[inst_rd] = riscv->x[inst_rs1] & riscv->x[inst_rs2]; break; // and
             }
+        }
+        memset(fb->dirty, 0, sizeof(fb->dirty));
+        fb->ndirty = 0;
+        uploaded   = 1;
+    }
+    fb->ready = 0;
+    fb->frames++;
+
+    if (uploaded || video_redraw) {
+        SDL_RenderClear(video_renderer);
+        SDL_RenderCopy (video_renderer, video_fbtex, NULL, NULL);
+        SDL_RenderPresent(video_renderer);
+        video_redraw = 0;
+    }
+}
+
+static SDL_AudioDeviceID audio_dev;
+static uint8_t           audio_silence;
+
+static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
+{
+    riscv_audio_pull(opaque, stream, len, audio_silence);
+}
+
+static void sdl_close_audio(RVMACHINE *mach)
+{
+    if (audio_dev) SDL_CloseAudioDevice(audio_dev);
+    audio_dev = 0;
+    atomic_store(&mach->audio.playing, 0);
+}
+
+// the host device follows the guest, it is opened when playback starts or changes format and closed when it stops,
+// if it cannot be opened the guest clocked sink drops the samples
+static void sdl_update_audio(RVMACHINE *mach)
+{
+    RVAUDIO      *a = &mach->audio;
+    SDL_AudioSpec want = {0}, have;
+    if (!a->host || !a->reconfig) return;
+    a->reconfig = 0;
+    sdl_close_audio(mach);
+    if (!(a->ctrl & AUDIO_CTRL_ENABLE)) return;
+    want.freq     = a->rate;
+    want.format   = a->format == AUDIO_FMT_S16 ? AUDIO_S16LSB : AUDIO_U8;
+    want.channels = a->channels;
+    want.samples  = 512;
+    want.callback = sdl_audio_callback;
+    want.userdata = a;
+    if (!(audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0))) {
+        fprintf(stderr, "no audio device: %s\n", SDL_GetError());
+        a->host  = 0;
+        a->start = mach->harts[0]->icount + mach->harts[0]->idle;
+        return;
+    }
+    audio_silence = have.silence;
+    a->host_rate  = a->rate * riscv_audio_frame(a);
+    atomic_store(&a->played , 0);
+    atomic_store(&a->playing, 1);
+    SDL_PauseAudioDevice(audio_dev, 0);
+}
+#else
+static int  sdl_poll_events (void *opaque) { return 0; }
+static void sdl_present_fb  (RVMACHINE *mach) {}
+static void sdl_update_audio(RVMACHINE *mach) {}
+static void sdl_close_audio (RVMACHINE *mach) {}
+#endif
+
+// per frame host work on the main thread with the io lock held, also run while the guest blocks on the keyboard,
+// nonzero once the window is closed
+static int host_frame(void *opaque)
+{
+    RVMACHINE *mach = opaque;
+    int        quit = sdl_poll_events(mach);
+    sdl_present_fb(mach);
+    sdl_update_audio(mach);
+    if (mach->con.mode == CON_MODE_VRAM) riscv_con_update(&mach->con, stdout);
+    return quit;
+}
+
+// milliseconds of the clock the harts are paced by, the samples the host audio device played while it plays so the
+// guest keeps in step with the device instead of drifting from it, else the system tick, returns 1 for the audio clock
+static int host_clock(RVMACHINE *mach, uint32_t *tick)
+{
+    RVAUDIO *a = &mach->audio;
+    if (atomic_load(&a->playing)) {
+        *tick = (uint32_t)(atomic_load(&a->played) * 1000 / a->host_rate);
+        return 1;
+    }
+    *tick = get_tick_count();
+    return 0;
+}
+
+static const char *engine_names[] = { "switch", "dcache", "block", "jit" };
+
+// one json object per run, appended to file for the benchmark scripts
+// restored is the number of instructions that ran before the snapshot the run started from
+static void write_stats(const char *file, const char *rom, RVMACHINE *mach, uint64_t restored, double seconds)
+{
+    struct rusage ru;
+    uint64_t icount = 0, skipped = 0, misses = 0, ran;
+    int      i;
+    FILE    *fp = fopen(file, "a");
+    if (!fp) { perror(file); return; }
+    getrusage(RUSAGE_SELF, &ru);
+    for (i = 0; i < mach->nharts; i++) icount += mach->harts[i]->icount, skipped += mach->harts[i]->skipped, misses += mach->harts[i]->tlb_misses;
+    ran = icount - skipped - restored; // the rates are of the instructions that really ran in this run
+    fprintf(fp, "{\"rom\": \"%s\", \"engine\": \"%s\", \"harts\": %d, \"insts\": %llu, \"skipped_insts\": %llu, \"seconds\": %.6f, \"mips\": %.2f, \"ns_per_inst\": %.3f, \"peak_rss_kb\": %ld, \"tlb_misses\": %llu, \"exited\": %s, \"exit_code\": %d}\n",
+        rom, engine_names[mach->harts[0]->engine], mach->nharts, (unsigned long long)icount, (unsigned long long)skipped,
+        seconds, seconds > 0 ? ran / seconds / 1e6 : 0.0, ran ? seconds * 1e9 / ran : 0.0,
+        ru.ru_maxrss, (unsigned long long)misses, atomic_load(&mach->exited) ? "true" : "false", (int)mach->exit_code);
+    fclose(fp);
+}
+
+static uint64_t    run_limit;  // instructions per hart, 0 for no limit
+static const char *snap_file;  // snapshot saved at the end, checkpoints are saved as snap_file.1, snap_file.2, ...
+static uint64_t    snap_every; // instructions between checkpoints, 0 for none
+static uint64_t    snap_next;
+static int         snap_count;
+
+// the first checkpoint is full, the next ones only hold the pages written since the one before
+static void run_checkpoint(RVMACHINE *mach)
+{
+    char file[FILENAME_MAX], parent[FILENAME_MAX];
+    snprintf(file  , sizeof(file  ), "%s.%d", snap_file, snap_count + 1);
+    snprintf(parent, sizeof(parent), "%s.%d", snap_file, snap_count);
+    if (riscv_snapshot_save(mach, file, snap_count ? parent : NULL) < 0) perror(file);
+    else snap_count++;
+}
+
+// runs one hart on the calling thread until the machine stops or the hart reaches the limit,
+// hart 0 runs on the main thread and also does the host frames, a slice is counted in cycles so time spent in wfi
+// paces the hart like instructions do, the limits count instructions
+static void* run_hart(void *arg)
+{
+    RISCV     *riscv = arg;
+    RVMACHINE *mach  = riscv->mach;
+    uint32_t   next_tick = 0, tick;
+    uint64_t   slice_end, budget, start;
+    int32_t    sleep_tick;
+    int        quit, tick_src = 0, src, ret = RUN_BUDGET;
+
+    while (!atomic_load(&mach->exited) && (!run_limit || riscv->icount < run_limit)) {
+        if (mach->headless) {
+            slice_end = riscv->icount + riscv->idle + RISCV_CPU_FREQ;
         } else {
-            switch (inst_funct3) {
-            case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] * riscv->x[inst_rs2]; break; // mul
-            case 0x1: // mulh
-                mult64res = (int64_t)riscv->x[inst_rs1] * (int64_t)riscv->x[inst_rs2];
-                riscv->x[inst_rd] = (uint32_t)(mult64res >> 32);
-                break;
-            case 0x2: // mulhsu
-                mult64res = (int64_t)riscv->x[inst_rs1] * (uint64_t)riscv->x[inst_rs2];
-                riscv->x[inst_rd] = (uint32_t)(mult64res >> 32);
-                break;
-            case 0x3: // mulhu
-                mult64res = (uint64_t)riscv->x[inst_rs1] * (uint64_t)riscv->x[inst_rs2];
-                riscv->x[inst_rd] = (uint32_t)(mult64res >> 32);
-                break;
-            case 0x4: // div
-                riscv->x[inst_rd] = (uint32_t)((int32_t)riscv->x[inst_rs1] / (int32_t)riscv->x[inst_rs2]);
-                break;
-            case 0x5: // divu
-                riscv->x[inst_rd] = riscv->x[inst_rs1] / riscv->x[inst_rs2];
-                break;
-            case 0x6: // rem
-                riscv->x[inst_rd] = (uint32_t)((int32_t)riscv->x[inst_rs1] % (int32_t)riscv->x[inst_rs2]);
-                break;
-            case 0x7: // remu
-                riscv->x[inst_rd] = riscv->x[inst_rs1] % riscv->x[inst_rs2];
-                break;
-            }
+            src = host_clock(mach, &tick);
+            if (!next_tick || src != tick_src) { next_tick = tick; tick_src = src; } // the clock changed, start over from now
+            next_tick += 1000 / RISCV_FRAMERATE;
+            slice_end  = riscv->icount + riscv->idle + RISCV_CPU_FREQ / RISCV_FRAMERATE;
         }
-        break;
-    case 0x73:
-        switch (inst_funct3) {
-        case 0:
-            if (instruction & (1 << 20)) { // ebreak;
-                // todo...
-            } else { // ecall
-                riscv->x[10] = handle_ecall(riscv);
-            }
-            break;
-        case 1: temp = riscv->csr[inst_csr]; riscv->csr[inst_csr] = riscv->x[inst_rs1]; riscv->x[inst_rd] = temp; break; // csrrw
-        case 2: temp = riscv->csr[inst_csr]; riscv->csr[inst_csr]|= riscv->x[inst_rs1]; riscv->x[inst_rd] = temp; break; // csrrs
-        case 3: temp = riscv->csr[inst_csr]; riscv->csr[inst_csr]&=~riscv->x[inst_rs1]; riscv->x[inst_rd] = temp; break; // csrrc
-        case 5: riscv->x[inst_rd] = riscv->csr[inst_csr]; riscv->csr[inst_csr] = (instruction >> 15) & 0x1f;      break; // csrrwi
-        case 6: temp = riscv->csr[inst_csr]; riscv->csr[inst_csr]|= ((instruction >> 15) & 0x1f); riscv->x[inst_rd] = temp; break; // csrrsi
-        case 7: temp = riscv->csr[inst_csr]; riscv->csr[inst_csr]&=~((instruction >> 15) & 0x1f); riscv->x[inst_rd] = temp; break; // csrrci
-        }
-        break;
-    case 0x2f:
-        if (inst_funct3 == 0x2) {
-            temp = riscv_memr32(riscv, riscv->x[inst_rs1]);
-            switch (instruction >> 27) {
-            case 0x02: riscv->mreserved = riscv->x[inst_rs1]; break; // lr.w
-            case 0x03: // sc.w
-                if (riscv->mreserved == riscv->x[inst_rs1]) riscv_memw32(riscv, riscv->x[inst_rs1], riscv->x[inst_rs2]);
-                temp = !(riscv->mreserved == riscv->x[inst_rs1]);
-                break;
-            case 0x01: riscv_memw32(riscv, riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // amoswap.w
-            case 0x00: riscv_memw32(riscv, riscv->x[inst_rs1], temp + riscv->x[inst_rs2]); break; // amoadd.w
-            case 0x04: riscv_memw32(riscv, riscv->x[inst_rs1], temp ^ riscv->x[inst_rs2]); break; // amoxor.w
-            case 0x0c: riscv_memw32(riscv, riscv->x[inst_rs1], temp & riscv->x[inst_rs2]); break; // amoand.w
-            case 0x08: riscv_memw32(riscv, riscv->x[inst_rs1], temp | riscv->x[inst_rs2]); break; // amoor.w
-            case 0x10: riscv_memw32(riscv, riscv->x[inst_rs1], (int32_t)temp < (int32_t)riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amomin.w
-            case 0x14: riscv_memw32(riscv, riscv->x[inst_rs1], (int32_t)temp > (int32_t)riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amomax.w
-            case 0x18: riscv_memw32(riscv, riscv->x[inst_rs1], temp < riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amominu.w
-            case 0x1c: riscv_memw32(riscv, riscv->x[inst_rs1], temp > riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amomaxu.w
-            }
-            riscv->x[inst_rd] = temp;
+        while (ret != RUN_EXIT && riscv->icount + riscv->idle < slice_end) {
+            budget = slice_end - riscv->icount - riscv->idle;
+            if (run_limit  && budget > run_limit - riscv->icount) budget = run_limit - riscv->icount;
+            if (snap_every && budget > snap_next - riscv->icount) budget = snap_next - riscv->icount;
+            if (!budget) break;
+            start = riscv->icount;
+            ret   = riscv_run_n(riscv, (uint32_t)budget);
+            if (ret == RUN_IDLE) riscv_wfi_wait(riscv, mach->headless ? UINT64_MAX : slice_end - riscv->icount - riscv->idle);
+            if (ret == RUN_POLL) riscv_poll_wait(riscv, budget - (riscv->icount - start));
         }
-        break;
-    case 0x0f:
-        if (instruction == 0x0000100f) { // fence.i
-            // todo...
-        } else if ((instruction & 0xf00fff80) == 0) { // fence
-            // todo...
+        if (snap_every && riscv->icount >= snap_next) {
+            run_checkpoint(mach);
+            snap_next = riscv->icount + snap_every;
         }
-        break;
+        if (mach->headless) continue;
+        if (riscv->hartid == 0) {
+            pthread_mutex_lock(&mach->iolock);
+            quit = host_frame(mach);
+            pthread_mutex_unlock(&mach->iolock);
+            if (quit) break;
+        }
+        if (host_clock(mach, &tick) != tick_src) continue;
+        sleep_tick = next_tick - tick;
+        if (sleep_tick > 4 * 1000 / RISCV_FRAMERATE) sleep_tick = 4 * 1000 / RISCV_FRAMERATE; // a stalled audio device slows the guest down but does not stop it
+        if (sleep_tick > 0) usleep(sleep_tick * 1000);
+//      printf("sleep_tick: %d\n", sleep_tick);
     }
-    riscv->pc += bflag ? 0 : 4;
+    return NULL;
 }
 
-void riscv_run(RISCV *riscv)
+// batch mode runs many single hart machines of one rom on a pool of worker threads, each job line of the job file is
+// "input [insts]", input is the keyboard script or - for none, insts defaults to -n
+typedef struct {
+    char    *input;
+    uint64_t limit;
+} BATCHJOB;
+
+struct BATCH;
+typedef struct {
+    struct BATCH   *batch;
+    pthread_mutex_t lock; // the owner takes jobs from the head, idle workers steal half from the tail
+    int             head, tail;
+    pthread_t       thread;
+    int             thread_ok;
+} BATCHQUEUE;
+
+typedef struct BATCH {
+    BATCHJOB   *jobs;
+    int         njobs;
+    BATCHQUEUE *queues;
+    int         nqueues;
+    int         image;    // rom image every machine maps copy on write
+    int         root;     // files root of the machines
+    uint32_t    mem_size;
+    int         engine;
+    FILE       *results;
+    pthread_mutex_t results_lock;
+} BATCH;
+
+static int batch_next(BATCHQUEUE *q)
 {
-    const uint32_t instruction = riscv_memr32(riscv, riscv->pc);
-    if ((instruction & 0x3) != 0x3) {
-        riscv_execute_rv16(riscv, (uint16_t)instruction);
+    BATCH      *b   = q->batch;
+    BATCHQUEUE *v;
+    int         job = -1, n = 0, i;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) job = q->head++;
+    pthread_mutex_unlock(&q->lock);
+    for (i = 1; job < 0 && i < b->nqueues; i++) {
+        v = b->queues + (q - b->queues + i) % b->nqueues;
+        pthread_mutex_lock(&v->lock);
+        n = (v->tail - v->head + 1) / 2;
+        if (n > 0) job = v->tail -= n;
+        pthread_mutex_unlock(&v->lock);
+    }
+    if (n > 1) { // keep the rest of the stolen range
+        pthread_mutex_lock(&q->lock);
+        q->head = job + 1;
+        q->tail = job + n;
+        pthread_mutex_unlock(&q->lock);
+    }
+    return job;
+}
+
+static void json_puts(FILE *fp, const char *s, size_t n)
+{
+    size_t i;
+    fputc('"', fp);
+    for (i = 0; i < n; i++) {
+        uint8_t c = s[i];
+        if      (c == '"' || c == '\\') { fputc('\\', fp); fputc(c, fp); }
+        else if (c == '\n') fputs("\\n", fp);
+        else if (c < 0x20 || c >= 0x7f) fprintf(fp, "\\u%04x", c); // guest bytes are not utf-8
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void batch_run(BATCH *b, int id)
+{
+    BATCHJOB  *job   = b->jobs + id;
+    RISCV     *riscv = NULL;
+    RVMACHINE *mach  = NULL;
+    char      *out   = NULL;
+    size_t     len   = 0;
+    uint64_t   left, start;
+    int        fd    = -1;
+    const char *error = NULL;
+    struct timespec ts0, ts1;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    if (job->input && (fd = open(job->input, O_RDONLY)) < 0) error = strerror(errno);
+    else if (!(riscv = riscv_init_image(b->image, b->mem_size))) error = "cannot load the rom";
+    if (riscv) {
+        mach             = riscv->mach;
+        mach->headless   = 1;
+        mach->files_root = b->root;
+        mach->out        = open_memstream(&out, &len);
+        riscv->engine    = b->engine;
+        if (!mach->out) mach->out = fopen("/dev/null", "w");
+        if (fd >= 0) riscv_kbd_attach(&mach->kbd, fd);
+        while (!(riscv->status & TS_EXIT) && (!job->limit || riscv->icount < job->limit)) {
+            left  = job->limit ? job->limit - riscv->icount : RISCV_CPU_FREQ;
+            left  = left < RISCV_CPU_FREQ ? left : RISCV_CPU_FREQ;
+            start = riscv->icount;
+            switch (riscv_run_n(riscv, (uint32_t)left)) {
+            case RUN_IDLE: riscv_wfi_wait(riscv, UINT64_MAX); break;
+            case RUN_POLL: riscv_poll_wait(riscv, left - (riscv->icount - start)); break;
+            }
+        }
+        fclose(mach->out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+    pthread_mutex_lock(&b->results_lock);
+    fprintf(b->results, "{\"job\": %d, \"input\": ", id);
+    if (job->input) json_puts(b->results, job->input, strlen(job->input)); else fputs("null", b->results);
+    if (riscv) {
+        fprintf(b->results, ", \"insts\": %llu, \"skipped_insts\": %llu, \"seconds\": %.6f, \"exited\": %s, \"exit_code\": %d, \"stdout\": ",
+            (unsigned long long)riscv->icount, (unsigned long long)riscv->skipped, (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9,
+            atomic_load(&mach->exited) ? "true" : "false", (int)mach->exit_code);
+        json_puts(b->results, out ? out : "", out ? len : 0);
     } else {
-        riscv_execute_rv32(riscv, (uint32_t)instruction);
+        fputs(", \"error\": ", b->results);
+        json_puts(b->results, error, strlen(error));
     }
-    riscv->x[0] = 0;
+    fputs("}\n", b->results);
+    pthread_mutex_unlock(&b->results_lock);
+
+    free(out);
+    riscv_free(riscv);
+    if (fd >= 0) close(fd);
 }
 
-RISCV* riscv_init(char *rom)
+static void* batch_worker(void *arg)
 {
-    FILE  *fp    = NULL;
-    RISCV *riscv = calloc(1, sizeof(RISCV));
-    if (!riscv) return NULL;
-    riscv->csr[0x301] = (1 << 8) | (1 << 12) | (1 << 0) | (1 << 2); // misa rv32imac
-    fp = fopen(rom, "rb");
-    if (fp) {
-        fread(riscv->mem, 1, sizeof(riscv->mem), fp);
-        fclose(fp);
+    BATCHQUEUE *q = arg;
+    int         job;
+    while ((job = batch_next(q)) >= 0) batch_run(q->batch, job);
+    return NULL;
+}
+
+// the rom is copied once into an anonymous file, later changes to the rom file do not reach running machines
+static int batch_image(const char *rom)
+{
+    char    buf[65536];
+    ssize_t n;
+    int     fd = open(rom, O_RDONLY), image;
+    if (fd < 0) return -1;
+    image = memfd_create("ffvm-rom", MFD_CLOEXEC);
+    if (image < 0) return fd;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (write(image, buf, n) != n) { close(image); lseek(fd, 0, SEEK_SET); return fd; }
     }
-    return riscv;
+    close(fd);
+    return image;
 }
 
-void riscv_free(RISCV *riscv) { free(riscv); }
+static int batch_main(const char *rom, const char *jobfile, const char *results, int nthreads, int engine, uint32_t mem_size, int root)
+{
+    BATCH  b    = { 0 };
+    FILE  *fp   = fopen(jobfile, "r");
+    char   line[FILENAME_MAX + 64], *input, *insts;
+    int    i, cap = 0;
 
+    if (!fp) { perror(jobfile); return 1; }
+    while (fgets(line, sizeof(line), fp)) {
+        if (!(input = strtok(line, " \t\r\n")) || input[0] == '#') continue;
+        insts = strtok(NULL, " \t\r\n");
+        if (b.njobs == cap) {
+            cap    = cap ? cap * 2 : 256;
+            b.jobs = realloc(b.jobs, cap * sizeof(BATCHJOB));
+            if (!b.jobs) { fclose(fp); return 1; }
+        }
+        b.jobs[b.njobs].input = strcmp(input, "-") ? strdup(input) : NULL;
+        b.jobs[b.njobs].limit = insts ? strtoull(insts, NULL, 0) : run_limit;
+        b.njobs++;
+    }
+    fclose(fp);
 
-#define RISCV_CPU_FREQ  (1*1000*1000)
-#define RISCV_FRAMERATE  100
+    if ((b.image = batch_image(rom)) < 0) { perror(rom); return 1; }
+    b.results = results ? fopen(results, "a") : stdout;
+    if (!b.results) { perror(results); return 1; }
+    b.mem_size = mem_size;
+    b.engine   = engine;
+    b.root     = root;
+    b.nqueues  = nthreads < 1 ? 1 : nthreads > b.njobs && b.njobs ? b.njobs : nthreads;
+    b.queues   = calloc(b.nqueues, sizeof(BATCHQUEUE));
+    pthread_mutex_init(&b.results_lock, NULL);
+    for (i = 0; i < b.nqueues; i++) { // contiguous ranges to start with, stealing evens out uneven jobs
+        b.queues[i].batch = &b;
+        b.queues[i].head  = (int)((int64_t)b.njobs * (i + 0) / b.nqueues);
+        b.queues[i].tail  = (int)((int64_t)b.njobs * (i + 1) / b.nqueues);
+        pthread_mutex_init(&b.queues[i].lock, NULL);
+    }
+    for (i = 1; i < b.nqueues; i++) { // the jobs of a worker that failed to start are stolen by the others
+        b.queues[i].thread_ok = pthread_create(&b.queues[i].thread, NULL, batch_worker, b.queues + i) == 0;
+    }
+    batch_worker(b.queues);
+    for (i = 1; i < b.nqueues; i++) {
+        if (b.queues[i].thread_ok) pthread_join(b.queues[i].thread, NULL);
+    }
+
+    if (b.results != stdout) fclose(b.results); else fflush(stdout);
+    for (i = 0; i < b.nqueues; i++) pthread_mutex_destroy(&b.queues[i].lock);
+    pthread_mutex_destroy(&b.results_lock);
+    for (i = 0; i < b.njobs; i++) free(b.jobs[i].input);
+    free(b.jobs);
+    free(b.queues);
+    close(b.image);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     char romfile[FILENAME_MAX] = "test.rom";
-    uint32_t next_tick = 0;
-    int32_t  sleep_tick, i;
-    RISCV    *riscv = NULL;
-
-    if (argc >= 2) strncpy(romfile, argv[1], sizeof(romfile));
-    riscv = riscv_init(romfile);
-    init_video();
-    if (!riscv) return 0;
-
-    while (!(riscv->status & (TS_EXIT))) {
-        if (!next_tick) next_tick = get_tick_count();
-        next_tick += 1000 / RISCV_FRAMERATE;
-        for (i=0; i<RISCV_CPU_FREQ/RISCV_FRAMERATE; i++) {
-            riscv_run(riscv);
-        }
-        sleep_tick = next_tick - get_tick_count();
+    const char *input = NULL, *stats = NULL, *jobs = NULL, *restore = NULL, *record = NULL, *replay = NULL;
+    const char *profile = NULL, *elf = NULL, *wav = NULL, *trace = NULL;
+    int      engine = FFVM_JIT ? ENGINE_JIT : ENGINE_BLOCK, headless = !FFVM_SDL, fd = STDIN_FILENO, nharts = 1, opt, i;
+    int      nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN), root = AT_FDCWD;
+    uint32_t mem_mb = DEF_MEM_SIZE >> 20;
+    uint64_t restored = 0;
+    struct timespec ts0, ts1;
+    pthread_t  threads[MAX_HARTS];
+    RISCV     *riscv = NULL;
+    RVMACHINE *mach;
+    RVSYMTAB   syms = {0};
 
+    while ((opt = getopt(argc, argv, "e:Hn:i:j:c:m:b:t:s:r:k:R:P:p:E:a:T:d:")) != -1) {
+        switch (opt) {
+        case 'e': // execution engine: switch, dcache, block or jit
+            if      (strcmp(optarg, "switch") == 0) engine = ENGINE_SWITCH;
+            else if (strcmp(optarg, "dcache") == 0) engine = ENGINE_DCACHE;
+            else if (strcmp(optarg, "block" ) == 0) engine = ENGINE_BLOCK;
+            else if (strcmp(optarg, "jit"   ) == 0) engine = ENGINE_JIT;
+            else { fprintf(stderr, "unknown engine: %s\n", optarg); return 1; }
+            break;
+        case 'H': headless = 1; break;                         // no window, no throttle
+        case 'n': run_limit = strtoull(optarg, NULL, 0); break; // stop each hart after this many instructions
+        case 'i': input = optarg; break;                      // keyboard input script instead of stdin
+        case 'j': stats = optarg; break;                      // append run statistics as json
+        case 'c': nharts = atoi(optarg); break;               // harts, each runs on its own host thread
+        case 'm': mem_mb = strtoul(optarg, NULL, 0); break;   // ram size in MB, rounded up to a power of 2
+        case 'b': jobs = optarg; break;                       // batch mode job file, results go to the -j file or stdout
+        case 't': nthreads = atoi(optarg); break;             // batch mode worker threads
+        case 's': snap_file = optarg; break;                  // save a snapshot when the run ends
+        case 'r': restore = optarg; break;                    // restore a snapshot or checkpoint before running
+        case 'k': snap_every = strtoull(optarg, NULL, 0); break; // save a checkpoint every this many instructions
+        case 'R': record = optarg; break;                     // record the values of all device reads
+        case 'P': replay = optarg; headless = 1; break;       // replay recorded device reads, no keyboard and no throttle
+        case 'p': profile = optarg; break;                    // profile into profile.txt and profile.folded
+        case 'E': elf = optarg; break;                        // elf file of a raw rom for the profile symbols
+        case 'a': wav = optarg; break;                        // write the guest audio to a wav file on the guest clock
+        case 'T': trace = optarg; break;                      // trace fetches, loads, stores and branches, read by fftrace
+        case 'd':                                             // host directory the guest opens files under
+            if ((root = open(optarg, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) { perror(optarg); return 1; }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e switch|dcache|block|jit] [-H] [-n insts] [-i input] [-j stats.json] [-c harts] [-m ram_mb] [-b jobs [-t threads]] [-r snapshot] [-s snapshot [-k insts]] [-R log | -P log] [-p profile [-E elf]] [-a audio.wav] [-T trace] [-d dir] [rom]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nharts < 1 || nharts > MAX_HARTS) { fprintf(stderr, "harts must be 1 to %d\n", MAX_HARTS); return 1; }
+    if (mem_mb < MIN_MEM_SIZE >> 20 || mem_mb > MAX_MEM_SIZE >> 20) { fprintf(stderr, "ram must be %d to %d MB\n", MIN_MEM_SIZE >> 20, MAX_MEM_SIZE >> 20); return 1; }
+    if (snap_every && (!snap_file || nharts != 1)) { fprintf(stderr, "checkpoints need -s and a single hart\n"); return 1; }
+    if ((record || replay) && (nharts != 1 || (record && replay))) { fprintf(stderr, "record or replay a single hart\n"); return 1; }
+    if (optind < argc) strncpy(romfile, argv[optind], sizeof(romfile) - 1);
+    if (jobs) return batch_main(romfile, jobs, stats, nthreads, engine, mem_mb << 20, root);
+    if (replay) fd = -1;
+    else if (input && (fd = open(input, O_RDONLY)) < 0) { perror(input); return 1; }
+    if (!(riscv = riscv_init(romfile, mem_mb << 20))) {
+        fprintf(stderr, "failed to load %s: %s\n", romfile, strerror(errno));
+        return 1;
+    }
+    if (!headless) init_video();
+    mach = riscv->mach;
+    mach->headless   = headless;
+    mach->files_root = root;
+    mach->audio.host = !headless && !wav;
+    if (wav && riscv_audio_wav(&mach->audio, wav) < 0) { perror(wav); riscv_free(riscv); return 1; }
+    while (mach->nharts < nharts && riscv_hart_add(mach));
+    for (i = 0; i < mach->nharts; i++) mach->harts[i]->engine = engine;
+    if (restore && riscv_snapshot_load(riscv, restore) < 0) { fprintf(stderr, "failed to restore %s\n", restore); riscv_free(riscv); return 1; }
+    if (snap_every) {
+        if (mach->nharts != 1 || riscv_snapshot_track(mach) < 0) { fprintf(stderr, "checkpoints need a single hart\n"); riscv_free(riscv); return 1; }
+        snap_next = riscv->icount + snap_every;
+    }
+    for (i = 0; profile && i < mach->nharts; i++) {
+        if (riscv_prof_start(mach->harts[i]) < 0) { fprintf(stderr, "failed to start the profiler\n"); riscv_free(riscv); return 1; }
+    }
+    if ((record || replay) && riscv_iolog_open(mach, record ? record : replay, !!replay) < 0) {
+        perror(record ? record : replay);
+        riscv_free(riscv);
+        return 1;
+    }
+    if (trace && riscv_trace_open(mach, trace) < 0) { perror(trace); riscv_free(riscv); return 1; }
 
-    SDL_Event event;
-    if (SDL_PollEvent(&event)) {
-       //User requests quit
-        if( event.type == SDL_QUIT )
-            return 0;
+    // raw mode once for the whole run instead of toggling termios on every keyboard poll
+    if (fd == STDIN_FILENO && isatty(STDIN_FILENO)) {
+        initTermios(0);
+        atexit(resetTermios);
+        signal(SIGINT , termSignal);
+        signal(SIGTERM, termSignal);
+        signal(SIGHUP , termSignal);
+        mach->kbd.echo = 1;
+    }
+    if (fd >= 0) riscv_kbd_attach(&mach->kbd, fd);
+    if (!headless) {
+        // on a terminal the console is drawn from the text vram once per frame, pipes keep the raw stream
+        if (isatty(STDOUT_FILENO)) mach->con.mode = CON_MODE_VRAM;
+        mach->kbd.pump        = host_frame;
+        mach->kbd.pump_opaque = mach;
+        mach->kbd.pump_thread = pthread_self();
     }
 
-        if (sleep_tick > 0) usleep(sleep_tick * 1000);
-//      printf("sleep_tick: %d\n", sleep_tick);
+    for (i = 0; i < mach->nharts; i++) restored += mach->harts[i]->icount - mach->harts[i]->skipped;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    for (i = 1; i < mach->nharts; i++) {
+        if (pthread_create(&threads[i], NULL, run_hart, mach->harts[i]) != 0) { perror("pthread_create"); riscv_stop(mach); break; }
+    }
+    nharts = i;
+    run_hart(riscv);
+    for (i = 1; i < nharts; i++) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    sdl_close_audio(mach);
+    if (mach->con.mode == CON_MODE_VRAM) {
+        riscv_con_update(&mach->con, stdout);
+        printf("\033[0m\033[%u;1H\n", mach->con.rows);
+    }
+    fflush(stdout);
+    if (stats) write_stats(stats, romfile, mach, restored, (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9);
+    if (snap_file && riscv_snapshot_save(mach, snap_file, NULL) < 0) perror(snap_file);
+    if (profile) {
+        if (elf && riscv_symtab_load(&syms, elf) < 0) fprintf(stderr, "no symbols in %s\n", elf);
+        if (riscv_prof_write(mach, profile, elf ? &syms : &mach->syms) < 0) perror(profile);
+        riscv_symtab_free(&syms);
     }
 
+    opt = atomic_load(&mach->exited) ? (int)(mach->exit_code & 0xFF) : 0;
+    if (riscv_trace_close(mach) < 0) {
+        fprintf(stderr, "failed to write the trace %s\n", trace);
+        opt = 1;
+    }
+    if (riscv_iolog_close(mach) < 0) {
+        if (record) perror(record);
+        opt = 1;
+    }
     riscv_free(riscv);
-    return 0;
+    return opt;
 }